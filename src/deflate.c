@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#include "deflate.h"
+
+#define DEFLATE_CHUNK_SIZE 4096
+#define DEFLATE_MEM_LEVEL 8
+
+#ifdef HAVE_ZLIB
+
+int deflater_init(struct deflater *deflater, int level, int window_bits)
+{
+  z_stream *stream;
+  int result;
+
+  deflater->stream = NULL;
+
+  if (window_bits < DEFLATE_MIN_WINDOW_BITS
+      || window_bits > DEFLATE_MAX_WINDOW_BITS) {
+    return EINVAL;
+  }
+
+  stream = (z_stream *)calloc(1, sizeof(*stream));
+  if (stream == NULL) {
+    return ENOMEM;
+  }
+
+  /* Negative window bits mean no zlib header and trailer */
+  result = deflateInit2(stream,
+                        level,
+                        Z_DEFLATED,
+                        -window_bits,
+                        DEFLATE_MEM_LEVEL,
+                        Z_DEFAULT_STRATEGY);
+  if (result != Z_OK) {
+    free(stream);
+    return result == Z_MEM_ERROR ? ENOMEM : EINVAL;
+  }
+
+  deflater->stream = stream;
+  return 0;
+}
+
+void deflater_free(struct deflater *deflater)
+{
+  if (deflater->stream != NULL) {
+    deflateEnd((z_stream *)deflater->stream);
+    free(deflater->stream);
+    deflater->stream = NULL;
+  }
+}
+
+int deflater_reset(struct deflater *deflater)
+{
+  if (deflateReset((z_stream *)deflater->stream) != Z_OK) {
+    return EINVAL;
+  }
+  return 0;
+}
+
+int deflater_compress(struct deflater *deflater,
+                      const char *data,
+                      size_t len,
+                      struct strbuf *output)
+{
+  z_stream *stream = (z_stream *)deflater->stream;
+  char chunk[DEFLATE_CHUNK_SIZE];
+  size_t start = output->length;
+  int result;
+  int error;
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = (uInt)len;
+
+  /*
+   * A sync flush ends the output on a byte boundary with an empty stored
+   * block, which is what makes each message decodable on its own.
+   */
+  do {
+    stream->next_out = (Bytef *)chunk;
+    stream->avail_out = sizeof(chunk);
+    result = deflate(stream, Z_SYNC_FLUSH);
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      output->length = start;
+      return EINVAL;
+    }
+    error = strbuf_appendn(output,
+                           chunk,
+                           sizeof(chunk) - stream->avail_out);
+    if (error != 0) {
+      output->length = start;
+      return error;
+    }
+  } while (stream->avail_out == 0);
+
+  /* The receiver adds the 00 00 FF FF tail back */
+  if (output->length - start >= 4
+      && memcmp(output->str + output->length - 4, "\0\0\xFF\xFF", 4) == 0) {
+    output->length -= 4;
+    output->str[output->length] = '\0';
+  }
+
+  return 0;
+}
+
+#else /* HAVE_ZLIB */
+
+int deflater_init(struct deflater *deflater, int level, int window_bits)
+{
+  UNUSED(level);
+  UNUSED(window_bits);
+  deflater->stream = NULL;
+  return ENOSYS;
+}
+
+void deflater_free(struct deflater *deflater)
+{
+  UNUSED(deflater);
+}
+
+int deflater_reset(struct deflater *deflater)
+{
+  UNUSED(deflater);
+  return ENOSYS;
+}
+
+int deflater_compress(struct deflater *deflater,
+                      const char *data,
+                      size_t len,
+                      struct strbuf *output)
+{
+  UNUSED(deflater);
+  UNUSED(data);
+  UNUSED(len);
+  UNUSED(output);
+  return ENOSYS;
+}
+
+#endif /* HAVE_ZLIB */
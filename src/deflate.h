@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "defs.h"
+#include "strbuf.h"
+
+#define DEFLATE_MIN_WINDOW_BITS 9
+#define DEFLATE_MAX_WINDOW_BITS 15
+
+/*
+ * Raw DEFLATE stream in the form used by permessage-deflate (RFC 7692): each
+ * message is flushed to a byte boundary and the trailing empty block is
+ * stripped. The window carries over from one message to the next until
+ * deflater_reset() is called. Only available if built with zlib.
+ */
+struct deflater {
+  void *stream;
+};
+
+int deflater_init(struct deflater *deflater, int level, int window_bits);
+void deflater_free(struct deflater *deflater);
+int deflater_reset(struct deflater *deflater);
+int deflater_compress(struct deflater *deflater,
+                      const char *data,
+                      size_t len,
+                      struct strbuf *output);
+
+#endif /* DEFLATE_H */
@@ -28,6 +28,8 @@
 #define UNUSED(x) (void)(x)
 #define COUNT_OF(a) (sizeof(a) / sizeof(a[0]))
 
+#define CACHE_LINE_SIZE 64
+
 #ifdef _MSC_VER
   typedef signed __int8 int8_t;
   typedef unsigned __int8 uint8_t;
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event.h"
+#include "json.h"
+
+static const char *const event_type_names[] = {
+  "query_start",
+  "query_error",
+  "query_result"
+};
+
+static char *event_text_buffer(const struct event_record *record)
+{
+  return record->heap_text != NULL
+    ? record->heap_text
+    : (char *)record->inline_text;
+}
+
+void event_init(struct event_record *record, int type)
+{
+  int i;
+
+  record->type = type;
+  record->flags = 0;
+  record->error_code = 0;
+  record->time = 0;
+  record->query_id = 0;
+  record->rows = 0;
+  record->thread_id = 0;
+  record->seq = 0;
+  record->weight = 1;
+  for (i = 0; i < EVENT_TEXT_COUNT; i++) {
+    record->text[i].offset = EVENT_TEXT_NULL;
+    record->text[i].length = 0;
+  }
+  record->text_size = 0;
+  record->heap_text = NULL;
+}
+
+void event_clear(struct event_record *record)
+{
+  free(record->heap_text);
+  record->heap_text = NULL;
+  record->text_size = 0;
+}
+
+/*
+ * Copies only the used part of the record and transfers ownership of its
+ * heap text (if any) to dst.
+ */
+void event_move(struct event_record *dst, struct event_record *src)
+{
+  size_t size = offsetof(struct event_record, inline_text);
+
+  if (src->heap_text == NULL) {
+    size += src->text_size;
+  }
+  memcpy(dst, src, size);
+  src->heap_text = NULL;
+  src->text_size = 0;
+}
+
+/*
+ * Returns the amount of memory taken by the record's data.
+ */
+size_t event_size(const struct event_record *record)
+{
+  return offsetof(struct event_record, inline_text) + record->text_size;
+}
+
+int event_set_text(
+  struct event_record *record, int field, const char *str, size_t len)
+{
+  size_t new_size;
+  char *buf;
+
+  if (str == NULL) {
+    record->text[field].offset = EVENT_TEXT_NULL;
+    record->text[field].length = 0;
+    return 0;
+  }
+
+  new_size = record->text_size + len + 1;
+  if (new_size > (uint32_t)-1) {
+    return ERANGE;
+  }
+
+  if (record->heap_text != NULL || new_size > sizeof(record->inline_text)) {
+    buf = (char *)realloc(record->heap_text, new_size);
+    if (buf == NULL) {
+      return ENOMEM;
+    }
+    if (record->heap_text == NULL) {
+      memcpy(buf, record->inline_text, record->text_size);
+    }
+    record->heap_text = buf;
+  } else {
+    buf = record->inline_text;
+  }
+
+  memcpy(buf + record->text_size, str, len);
+  buf[record->text_size + len] = '\0';
+  record->text[field].offset = record->text_size;
+  record->text[field].length = (uint32_t)len;
+  record->text_size = (uint32_t)new_size;
+
+  return 0;
+}
+
+const char *event_get_text(
+  const struct event_record *record, int field, size_t *len)
+{
+  const struct event_text *text = &record->text[field];
+
+  if (len != NULL) {
+    *len = text->length;
+  }
+  if (text->offset == EVENT_TEXT_NULL) {
+    return NULL;
+  }
+  return event_text_buffer(record) + text->offset;
+}
+
+int event_encode_json(const struct event_record *record, struct strbuf *json)
+{
+  int error;
+
+  error = strbuf_append(json, "{");
+  if (error != 0) {
+    return error;
+  }
+
+  json_encode(json, "\"type\": %s, ", event_type_names[record->type]);
+
+  switch (record->type) {
+    case EVENT_QUERY_START:
+      json_encode(json,
+        "\"user\": %s, ", event_get_text(record, EVENT_USER, NULL));
+      json_encode(json,
+        "\"query\": %s, ", event_get_text(record, EVENT_QUERY, NULL));
+      json_encode(json,
+        "\"time\": %L, ", record->time);
+      json_encode(json,
+        "\"rows\": %L, ", record->rows);
+      json_encode(json,
+        "\"query_id\": %L", record->query_id);
+      if ((record->flags & EVENT_HAS_DATABASE) != 0) {
+        json_encode(json,
+          ", \"database\": %s", event_get_text(record, EVENT_DATABASE, NULL));
+      }
+      break;
+    case EVENT_QUERY_ERROR:
+      if ((record->flags & EVENT_HAS_QUERY_ID) != 0) {
+        json_encode(json,
+          "\"query_id\": %L, ", record->query_id);
+      }
+      json_encode(json,
+        "\"time\": %L, ", record->time);
+      json_encode(json,
+        "\"error_code\": %i, ", record->error_code);
+      json_encode(json,
+        "\"error_message\": %s",
+        event_get_text(record, EVENT_ERROR_MESSAGE, NULL));
+      break;
+    case EVENT_QUERY_RESULT:
+      if ((record->flags & EVENT_HAS_QUERY_ID) != 0) {
+        json_encode(json,
+          "\"query_id\": %L, ", record->query_id);
+      }
+      json_encode(json,
+        "\"time\": %L, ", record->time);
+      json_encode(json,
+        "\"rows\": %L", record->rows);
+      break;
+  }
+
+  json_encode(json, ", \"thread_id\": %L", (long long)record->thread_id);
+  json_encode(json, ", \"seq\": %L", (long long)record->seq);
+  if (record->weight != 1) {
+    json_encode(json, ", \"weight\": %L", (long long)record->weight);
+  }
+
+  return strbuf_append(json, "}");
+}
+
+static uint32_t hash_string(const char *str, size_t len)
+{
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void dictionary_clear(struct event_dictionary *dictionary)
+{
+  size_t i;
+
+  for (i = 0; i < EVENT_DICTIONARY_CAPACITY; i++) {
+    free(dictionary->entries[i].str);
+    dictionary->entries[i].str = NULL;
+  }
+  dictionary->count = 0;
+  dictionary->size = 0;
+}
+
+static struct event_dictionary_entry *dictionary_find(
+  struct event_dictionary *dictionary,
+  const char *str,
+  size_t len,
+  uint32_t hash)
+{
+  struct event_dictionary_entry *entry;
+  size_t i;
+
+  for (i = hash & (EVENT_DICTIONARY_CAPACITY - 1);
+       ;
+       i = (i + 1) & (EVENT_DICTIONARY_CAPACITY - 1)) {
+    entry = &dictionary->entries[i];
+    if (entry->str == NULL
+        || (entry->hash == hash
+            && entry->length == len
+            && memcmp(entry->str, str, len) == 0)) {
+      return entry;
+    }
+  }
+}
+
+void event_encoder_init(struct event_encoder *encoder)
+{
+  memset(encoder, 0, sizeof(*encoder));
+  encoder->reset = true;
+}
+
+void event_encoder_reset(struct event_encoder *encoder)
+{
+  dictionary_clear(&encoder->users);
+  dictionary_clear(&encoder->databases);
+  encoder->time = 0;
+  encoder->query_id = 0;
+  encoder->reset = true;
+}
+
+static int append_varint(struct strbuf *output, unsigned long long value)
+{
+  char buf[10];
+  size_t len = 0;
+
+  while (value >= 0x80) {
+    buf[len++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  buf[len++] = (char)value;
+  return strbuf_appendn(output, buf, len);
+}
+
+static int append_zigzag(struct strbuf *output, long long value)
+{
+  return append_varint(output,
+    ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+static int append_string(struct strbuf *output, const char *str, size_t len)
+{
+  int error;
+
+  if (str == NULL) {
+    return append_varint(output, 0);
+  }
+  error = append_varint(output, (unsigned long long)len + 1);
+  if (error != 0) {
+    return error;
+  }
+  return strbuf_appendn(output, str, len);
+}
+
+static int append_dictionary_string(struct strbuf *output,
+                                    struct event_encoder *encoder,
+                                    struct event_dictionary *dictionary,
+                                    const char *str,
+                                    size_t len)
+{
+  struct event_dictionary_entry *entry;
+  uint32_t hash;
+  int error;
+
+  if (str == NULL) {
+    return append_varint(output, 0);
+  }
+
+  hash = hash_string(str, len);
+  entry = dictionary_find(dictionary, str, len, hash);
+  if (entry->str != NULL) {
+    return append_varint(output, ((unsigned long long)entry->index + 1) * 2);
+  }
+
+  error = append_varint(output, (unsigned long long)len * 2 + 1);
+  if (error == 0) {
+    error = strbuf_appendn(output, str, len);
+  }
+  if (error != 0) {
+    return error;
+  }
+
+  /*
+   * The receiver remembers every new name, so the numbering must go on even
+   * when the table is full. The next message starts over.
+   */
+  if (dictionary->size < EVENT_DICTIONARY_LIMIT) {
+    entry->str = (char *)malloc(len + 1);
+    if (entry->str != NULL) {
+      memcpy(entry->str, str, len);
+      entry->str[len] = '\0';
+      entry->hash = hash;
+      entry->length = len;
+      entry->index = dictionary->count;
+      dictionary->size++;
+    }
+  } else {
+    encoder->reset = true;
+  }
+  dictionary->count++;
+
+  return 0;
+}
+
+int event_encoder_begin(struct event_encoder *encoder, struct strbuf *output)
+{
+  char flags = 0;
+
+  if (encoder->reset) {
+    event_encoder_reset(encoder);
+    encoder->reset = false;
+    flags |= EVENT_MESSAGE_RESET;
+  }
+  return strbuf_appendn(output, &flags, 1);
+}
+
+int event_encode_binary(struct event_encoder *encoder,
+                        const struct event_record *record,
+                        struct strbuf *output)
+{
+  bool has_query_id = record->type == EVENT_QUERY_START
+    || (record->flags & EVENT_HAS_QUERY_ID) != 0;
+  bool has_database = record->type == EVENT_QUERY_START
+    && (record->flags & EVENT_HAS_DATABASE) != 0;
+  char tag;
+  const char *str;
+  size_t len;
+  int error;
+
+  tag = (char)(record->type
+    | (has_query_id ? 1 << 2 : 0)
+    | (has_database ? 1 << 3 : 0)
+    | (record->weight != 1 ? 1 << 4 : 0));
+  if ((error = strbuf_appendn(output, &tag, 1)) != 0
+      || (error = append_zigzag(output, record->time - encoder->time)) != 0
+      || (error = append_varint(output, record->thread_id)) != 0
+      || (error = append_varint(output, record->seq)) != 0) {
+    return error;
+  }
+  encoder->time = record->time;
+
+  if (has_query_id) {
+    error = append_zigzag(output, record->query_id - encoder->query_id);
+    if (error != 0) {
+      return error;
+    }
+    encoder->query_id = record->query_id;
+  }
+
+  switch (record->type) {
+    case EVENT_QUERY_START:
+      str = event_get_text(record, EVENT_USER, &len);
+      error = append_dictionary_string(output,
+                                       encoder,
+                                       &encoder->users,
+                                       str,
+                                       len);
+      if (error == 0) {
+        str = event_get_text(record, EVENT_QUERY, &len);
+        error = append_string(output, str, len);
+      }
+      if (error == 0) {
+        error = append_zigzag(output, record->rows);
+      }
+      if (error == 0 && has_database) {
+        str = event_get_text(record, EVENT_DATABASE, &len);
+        error = append_dictionary_string(output,
+                                         encoder,
+                                         &encoder->databases,
+                                         str,
+                                         len);
+      }
+      break;
+    case EVENT_QUERY_ERROR:
+      error = append_varint(output, (unsigned long long)record->error_code);
+      if (error == 0) {
+        str = event_get_text(record, EVENT_ERROR_MESSAGE, &len);
+        error = append_string(output, str, len);
+      }
+      break;
+    case EVENT_QUERY_RESULT:
+      error = append_zigzag(output, record->rows);
+      break;
+  }
+  if (error != 0) {
+    return error;
+  }
+
+  if (record->weight != 1) {
+    return append_varint(output, (unsigned long long)record->weight);
+  }
+  return 0;
+}
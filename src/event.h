@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "defs.h"
+#include "strbuf.h"
+
+#define EVENT_INLINE_TEXT_SIZE 448
+#define EVENT_TEXT_NULL ((uint32_t)-1)
+
+enum {
+  EVENT_QUERY_START,
+  EVENT_QUERY_ERROR,
+  EVENT_QUERY_RESULT
+};
+
+enum {
+  EVENT_USER,
+  EVENT_QUERY,
+  EVENT_DATABASE,
+  EVENT_ERROR_MESSAGE,
+  EVENT_TEXT_COUNT
+};
+
+enum {
+  EVENT_HAS_QUERY_ID = 1u << 0,
+  EVENT_HAS_DATABASE = 1u << 1
+};
+
+enum {
+  EVENT_MESSAGE_RESET = 1u << 0
+};
+
+#define EVENT_DICTIONARY_CAPACITY 1024 /* must be a power of two */
+#define EVENT_DICTIONARY_LIMIT (EVENT_DICTIONARY_CAPACITY / 2)
+
+struct event_text {
+  uint32_t offset;
+  uint32_t length;
+};
+
+/*
+ * Raw event data captured on the server's query thread. Strings are copied
+ * into inline_text; only those that don't fit there go to the heap.
+ */
+struct event_record {
+  int type;
+  unsigned int flags;
+  int error_code;
+  long long time;
+  long long query_id;
+  long long rows;
+  unsigned long thread_id;
+  unsigned long long seq; /* per-thread sequence number */
+  long weight; /* number of statements this one stands for when sampling */
+  struct event_text text[EVENT_TEXT_COUNT];
+  uint32_t text_size;
+  char *heap_text;
+  char inline_text[EVENT_INLINE_TEXT_SIZE];
+};
+
+void event_init(struct event_record *record, int type);
+void event_clear(struct event_record *record);
+void event_move(struct event_record *dst, struct event_record *src);
+size_t event_size(const struct event_record *record);
+
+int event_set_text(
+  struct event_record *record, int field, const char *str, size_t len);
+const char *event_get_text(
+  const struct event_record *record, int field, size_t *len);
+
+struct event_dictionary_entry {
+  uint32_t hash;
+  uint32_t index;
+  size_t length;
+  char *str;
+};
+
+struct event_dictionary {
+  struct event_dictionary_entry entries[EVENT_DICTIONARY_CAPACITY];
+  uint32_t count; /* strings sent so far, stored or not */
+  uint32_t size;
+};
+
+/*
+ * State of the binary event stream. A message starts with a flags byte,
+ * EVENT_MESSAGE_RESET tells the receiver to forget everything it learned
+ * from earlier messages. Each event is then encoded as:
+ *
+ *   tag           type in bits 0-1, then 1 bit each for query_id, database
+ *                 and weight being present
+ *   time          zigzag varint, difference from the previous event
+ *   thread_id     varint
+ *   seq           varint
+ *   query_id      zigzag varint, difference from the previous query_id
+ *   ...           user, query, rows, database (query_start),
+ *                 error_code, error_message (query_error) or
+ *                 rows (query_result)
+ *   weight        varint
+ *
+ * Strings are a varint length + 1 (0 is null) and the UTF-8 bytes. User
+ * and database names are coded with dictionaries: even numbers refer to the
+ * (n / 2 - 1)-th name sent before, odd ones are followed by a new name of
+ * length (n - 1) / 2.
+ */
+struct event_encoder {
+  bool reset;
+  long long time;
+  long long query_id;
+  struct event_dictionary users;
+  struct event_dictionary databases;
+};
+
+void event_encoder_init(struct event_encoder *encoder);
+void event_encoder_reset(struct event_encoder *encoder);
+int event_encoder_begin(struct event_encoder *encoder, struct strbuf *output);
+int event_encode_binary(struct event_encoder *encoder,
+                        const struct event_record *record,
+                        struct strbuf *output);
+
+int event_encode_json(const struct event_record *record, struct strbuf *json);
+
+#endif /* EVENT_H */
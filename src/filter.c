@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+#include "string_ext.h"
+
+#define FILTER_SET_MIN_CAPACITY 8
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+static const char *const filter_field_names[] = {
+  "user",
+  "database",
+  "host",
+  "command",
+  "query"
+};
+
+static uint32_t hash_value(const char *str, size_t len, bool ignore_case)
+{
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)str[i];
+    hash ^= ignore_case ? (unsigned char)tolower(c) : c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool values_equal(const char *a,
+                         const char *b,
+                         size_t len,
+                         bool ignore_case)
+{
+  return ignore_case ? strncasecmp(a, b, len) == 0 : memcmp(a, b, len) == 0;
+}
+
+static int filter_set_insert(struct filter_set *set,
+                             char *value,
+                             size_t len,
+                             uint32_t hash);
+
+static int filter_set_grow(struct filter_set *set)
+{
+  struct filter_set old = *set;
+  size_t i;
+
+  set->capacity = old.capacity != 0
+    ? old.capacity * 2
+    : FILTER_SET_MIN_CAPACITY;
+  set->count = 0;
+  set->entries = (struct filter_set_entry *)calloc(set->capacity,
+                                                   sizeof(*set->entries));
+  if (set->entries == NULL) {
+    *set = old;
+    return ENOMEM;
+  }
+
+  for (i = 0; i < old.capacity; i++) {
+    struct filter_set_entry *entry = &old.entries[i];
+    if (entry->value != NULL) {
+      filter_set_insert(set, entry->value, entry->length, entry->hash);
+    }
+  }
+  free(old.entries);
+
+  return 0;
+}
+
+static int filter_set_insert(struct filter_set *set,
+                             char *value,
+                             size_t len,
+                             uint32_t hash)
+{
+  size_t i;
+  int error;
+
+  if ((set->count + 1) * 2 > set->capacity) {
+    error = filter_set_grow(set);
+    if (error != 0) {
+      return error;
+    }
+  }
+
+  /* Open addressing with linear probing */
+  for (i = hash & (set->capacity - 1);
+       set->entries[i].value != NULL;
+       i = (i + 1) & (set->capacity - 1)) {
+    struct filter_set_entry *entry = &set->entries[i];
+    if (entry->hash == hash
+        && entry->length == len
+        && values_equal(entry->value, value, len, set->ignore_case)) {
+      free(value); /* duplicate */
+      return 0;
+    }
+  }
+
+  set->entries[i].value = value;
+  set->entries[i].length = len;
+  set->entries[i].hash = hash;
+  set->count++;
+
+  return 0;
+}
+
+static bool filter_set_contains(const struct filter_set *set,
+                                const char *value,
+                                size_t len)
+{
+  uint32_t hash;
+  size_t i;
+
+  if (set->count == 0 || value == NULL) {
+    return false;
+  }
+
+  hash = hash_value(value, len, set->ignore_case);
+  for (i = hash & (set->capacity - 1);
+       set->entries[i].value != NULL;
+       i = (i + 1) & (set->capacity - 1)) {
+    const struct filter_set_entry *entry = &set->entries[i];
+    if (entry->hash == hash
+        && entry->length == len
+        && values_equal(entry->value, value, len, set->ignore_case)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void filter_set_free(struct filter_set *set)
+{
+  size_t i;
+
+  for (i = 0; i < set->capacity; i++) {
+    free(set->entries[i].value);
+  }
+  free(set->entries);
+  set->entries = NULL;
+  set->capacity = 0;
+  set->count = 0;
+}
+
+static int trie_insert(struct filter_trie_node **root,
+                       const char *prefix,
+                       size_t len)
+{
+  struct filter_trie_node **nodes = root;
+  struct filter_trie_node *node = NULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)tolower((unsigned char)prefix[i]);
+
+    for (node = *nodes; node != NULL; node = node->next) {
+      if (node->c == c) {
+        break;
+      }
+    }
+    if (node == NULL) {
+      node = (struct filter_trie_node *)calloc(1, sizeof(*node));
+      if (node == NULL) {
+        return ENOMEM;
+      }
+      node->c = c;
+      node->next = *nodes;
+      *nodes = node;
+    }
+    nodes = &node->child;
+  }
+
+  if (node != NULL) {
+    node->terminal = true;
+  }
+
+  return 0;
+}
+
+static bool trie_match_prefix(const struct filter_trie_node *nodes,
+                              const char *str,
+                              size_t len)
+{
+  const struct filter_trie_node *node;
+  size_t i;
+
+  for (i = 0; i < len && nodes != NULL; i++) {
+    unsigned char c = (unsigned char)tolower((unsigned char)str[i]);
+
+    for (node = nodes; node != NULL; node = node->next) {
+      if (node->c == c) {
+        break;
+      }
+    }
+    if (node == NULL) {
+      return false;
+    }
+    if (node->terminal) {
+      return true;
+    }
+    nodes = node->child;
+  }
+
+  return false;
+}
+
+static void trie_free(struct filter_trie_node *node)
+{
+  while (node != NULL) {
+    struct filter_trie_node *next = node->next;
+    trie_free(node->child);
+    free(node);
+    node = next;
+  }
+}
+
+void filter_init(struct filter *filter)
+{
+  int i;
+
+  memset(filter, 0, sizeof(*filter));
+  for (i = 0; i < FILTER_QUERY; i++) {
+    bool ignore_case = i == FILTER_HOST || i == FILTER_COMMAND;
+    filter->include[i].ignore_case = ignore_case;
+    filter->exclude[i].ignore_case = ignore_case;
+  }
+  filter->empty = true;
+}
+
+void filter_free(struct filter *filter)
+{
+  int i;
+
+  for (i = 0; i < FILTER_QUERY; i++) {
+    filter_set_free(&filter->include[i]);
+    filter_set_free(&filter->exclude[i]);
+  }
+  trie_free(filter->include_prefixes);
+  trie_free(filter->exclude_prefixes);
+  filter->include_prefixes = NULL;
+  filter->exclude_prefixes = NULL;
+  filter->empty = true;
+}
+
+int filter_field_from_name(const char *name, size_t len)
+{
+  size_t i;
+
+  if (len == 2 && strncasecmp(name, "db", 2) == 0) {
+    return FILTER_DATABASE;
+  }
+  for (i = 0; i < COUNT_OF(filter_field_names); i++) {
+    if (strlen(filter_field_names[i]) == len
+        && strncasecmp(name, filter_field_names[i], len) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+int filter_add_rule(struct filter *filter,
+                    bool exclude,
+                    int field,
+                    const char *value,
+                    size_t len)
+{
+  struct filter_set *set;
+  char *value_copy;
+  int error;
+
+  if (field < 0 || field >= FILTER_FIELD_COUNT || len == 0) {
+    return EINVAL;
+  }
+
+  if (field == FILTER_QUERY) {
+    error = trie_insert(exclude
+                          ? &filter->exclude_prefixes
+                          : &filter->include_prefixes,
+                        value,
+                        len);
+  } else {
+    set = exclude ? &filter->exclude[field] : &filter->include[field];
+    value_copy = strndup(value, len);
+    if (value_copy == NULL) {
+      return ENOMEM;
+    }
+    error = filter_set_insert(set,
+                              value_copy,
+                              len,
+                              hash_value(value, len, set->ignore_case));
+    if (error != 0) {
+      free(value_copy);
+    }
+  }
+
+  if (error == 0) {
+    filter->empty = false;
+  }
+  return error;
+}
+
+/*
+ * Parses a comma-separated list of "field:value" rules, for example:
+ * "user:repl, command:Binlog Dump, query:SELECT 1".
+ */
+int filter_parse_rules(struct filter *filter, bool exclude, const char *rules)
+{
+  const char *p = rules;
+  const char *end;
+  const char *colon;
+  const char *value;
+  const char *value_end;
+  int field;
+  int error;
+
+  if (rules == NULL) {
+    return 0;
+  }
+
+  while (*p != '\0') {
+    while (IS_SPACE(*p) || *p == ',') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    end = strchr(p, ',');
+    if (end == NULL) {
+      end = p + strlen(p);
+    }
+    colon = (const char *)memchr(p, ':', end - p);
+    if (colon == NULL) {
+      return EINVAL;
+    }
+
+    value_end = colon;
+    while (value_end > p && IS_SPACE(value_end[-1])) {
+      value_end--;
+    }
+    field = filter_field_from_name(p, value_end - p);
+    if (field < 0) {
+      return EINVAL;
+    }
+
+    value = colon + 1;
+    while (value < end && IS_SPACE(*value)) {
+      value++;
+    }
+    value_end = end;
+    while (value_end > value && IS_SPACE(value_end[-1])) {
+      value_end--;
+    }
+
+    error = filter_add_rule(filter, exclude, field, value, value_end - value);
+    if (error != 0) {
+      return error;
+    }
+
+    p = end;
+  }
+
+  return 0;
+}
+
+bool filter_match(const struct filter *filter,
+                  const struct filter_input *input)
+{
+  const char *query;
+  size_t query_len;
+  int i;
+
+  if (filter->empty) {
+    return true;
+  }
+
+  for (i = 0; i < FILTER_QUERY; i++) {
+    if (filter->include[i].count > 0
+        && !filter_set_contains(&filter->include[i],
+                                input->values[i],
+                                input->lengths[i])) {
+      return false;
+    }
+    if (filter_set_contains(&filter->exclude[i],
+                            input->values[i],
+                            input->lengths[i])) {
+      return false;
+    }
+  }
+
+  if (filter->include_prefixes == NULL && filter->exclude_prefixes == NULL) {
+    return true;
+  }
+
+  query = input->values[FILTER_QUERY];
+  query_len = input->lengths[FILTER_QUERY];
+  if (query == NULL) {
+    return filter->include_prefixes == NULL;
+  }
+  while (query_len > 0 && IS_SPACE(*query)) {
+    query++;
+    query_len--;
+  }
+
+  if (filter->include_prefixes != NULL
+      && !trie_match_prefix(filter->include_prefixes, query, query_len)) {
+    return false;
+  }
+  if (trie_match_prefix(filter->exclude_prefixes, query, query_len)) {
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Extracts user name and host from the "priv_user[user] @ host [ip]" string
+ * that the server puts into audit events.
+ */
+void filter_split_user_host(const char *user_host, struct filter_input *input)
+{
+  const char *p;
+  const char *host;
+  const char *host_end;
+
+  input->values[FILTER_USER] = NULL;
+  input->lengths[FILTER_USER] = 0;
+  input->values[FILTER_HOST] = NULL;
+  input->lengths[FILTER_HOST] = 0;
+
+  if (user_host == NULL) {
+    return;
+  }
+
+  for (p = user_host; *p != '\0' && *p != '[' && *p != ' '; p++);
+  input->values[FILTER_USER] = user_host;
+  input->lengths[FILTER_USER] = p - user_host;
+
+  host = strstr(p, "@ ");
+  if (host == NULL) {
+    return;
+  }
+  host += 2;
+  for (host_end = host; *host_end != '\0' && *host_end != ' '; host_end++);
+  if (host_end == host) {
+    /* No host name, use IP address instead */
+    const char *ip = strchr(host, '[');
+    if (ip == NULL) {
+      return;
+    }
+    host = ip + 1;
+    for (host_end = host; *host_end != '\0' && *host_end != ']'; host_end++);
+  }
+  if (host_end > host) {
+    input->values[FILTER_HOST] = host;
+    input->lengths[FILTER_HOST] = host_end - host;
+  }
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "defs.h"
+
+enum {
+  FILTER_USER,
+  FILTER_DATABASE,
+  FILTER_HOST,
+  FILTER_COMMAND,
+  FILTER_QUERY,
+  FILTER_FIELD_COUNT
+};
+
+struct filter_set_entry {
+  char *value;
+  size_t length;
+  uint32_t hash;
+};
+
+struct filter_set {
+  struct filter_set_entry *entries;
+  size_t capacity;
+  size_t count;
+  bool ignore_case;
+};
+
+struct filter_trie_node {
+  unsigned char c;
+  bool terminal;
+  struct filter_trie_node *child;
+  struct filter_trie_node *next;
+};
+
+/*
+ * Compiled include/exclude rules. Exact values are kept in hash sets,
+ * query prefixes in a (case-insensitive) trie.
+ */
+struct filter {
+  struct filter_set include[FILTER_QUERY];
+  struct filter_set exclude[FILTER_QUERY];
+  struct filter_trie_node *include_prefixes;
+  struct filter_trie_node *exclude_prefixes;
+  bool empty;
+};
+
+struct filter_input {
+  const char *values[FILTER_FIELD_COUNT];
+  size_t lengths[FILTER_FIELD_COUNT];
+};
+
+void filter_init(struct filter *filter);
+void filter_free(struct filter *filter);
+
+int filter_field_from_name(const char *name, size_t len);
+
+int filter_add_rule(struct filter *filter,
+                    bool exclude,
+                    int field,
+                    const char *value,
+                    size_t len);
+int filter_parse_rules(struct filter *filter, bool exclude, const char *rules);
+
+bool filter_match(const struct filter *filter,
+                  const struct filter_input *input);
+
+void filter_split_user_host(const char *user_host,
+                            struct filter_input *input);
+
+#endif /* FILTER_H */
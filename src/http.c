@@ -20,6 +20,7 @@
  * IN THE SOFTWARE.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include "http.h"
@@ -29,6 +30,11 @@
 #define IS_SPACE(c) ((c) == ' ')
 #define IS_HSPACE(c) ((c) == ' ' || (c) == '\t')
 #define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define HEX_VALUE(c) \
+  (IS_DIGIT(c) ? (c) - '0' \
+    : (c) >= 'a' && (c) <= 'f' ? (c) - 'a' + 10 \
+    : (c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10 \
+    : -1)
 #define SKIP(x) while (p < end && (x)) p++
 
 static const char *const http_methods[] = {
@@ -183,69 +189,467 @@ const char *http_parse_headers(
   return p;
 }
 
-static int on_headers(const char *buf,
-                      int len,
-                      int chunk_offset,
-                      int chunk_len)
+void http_header_scanner_init(struct http_header_scanner *scanner)
 {
-  return strnstr(buf + chunk_offset, "\r\n\r\n", len) != NULL;
+  scanner->offset = 0;
+  scanner->state = 0;
 }
 
-int http_recv_headers(socket_t sock, char *headers, size_t size)
+/*
+ * Continues scanning buf, which holds len bytes now, from where the last
+ * call stopped. Returns the length of the request line and headers,
+ * including the final CRLF, or 0 if they are not complete yet.
+ */
+size_t http_scan_headers(struct http_header_scanner *scanner,
+                         const char *buf,
+                         size_t len)
+{
+  static const char terminator[] = CRLF CRLF;
+  size_t i = scanner->offset;
+  int state = scanner->state;
+
+  while (i < len && state < 4) {
+    if (buf[i] == terminator[state]) {
+      state++;
+    } else {
+      state = buf[i] == '\r' ? 1 : 0;
+    }
+    i++;
+  }
+
+  scanner->offset = i;
+  scanner->state = state;
+  return state == 4 ? i : 0;
+}
+
+/*
+ * Length of the path part of a request target, up to the query string.
+ */
+size_t http_path_length(const struct http_fragment *target)
+{
+  const char *query = (const char *)memchr(target->ptr, '?', target->length);
+
+  return query != NULL ? (size_t)(query - target->ptr) : target->length;
+}
+
+/*
+ * Finds the first "name=value" pair with the given name in the query string
+ * of a request target. The value is left URL-encoded.
+ */
+bool http_get_query_param(const struct http_fragment *target,
+                          const char *name,
+                          struct http_fragment *value)
 {
-  return recv_n(sock, headers, (int)size, 0, on_headers);
+  const char *p = target->ptr + http_path_length(target);
+  const char *end = target->ptr + target->length;
+  size_t name_len = strlen(name);
+  const char *param;
+
+  while (p < end) {
+    p++; /* '?' or '&' */
+    param = p;
+    SKIP(*p != '&');
+    if ((size_t)(p - param) > name_len
+        && strncmp(param, name, name_len) == 0
+        && param[name_len] == '=') {
+      value->ptr = param + name_len + 1;
+      value->length = p - value->ptr;
+      return true;
+    }
+  }
+  return false;
 }
 
-int http_send_content(socket_t sock,
-                      const char *content,
-                      size_t length,
-                      const char *type)
+/*
+ * Decodes %XX escapes and '+' into buf, which must have room for len + 1
+ * bytes. Malformed escapes are copied as they are. Returns the length of
+ * the null-terminated result.
+ */
+size_t http_url_decode(const char *str, size_t len, char *buf)
 {
-  char headers[128];
-  int result;
+  size_t i;
+  size_t n = 0;
+
+  for (i = 0; i < len; i++) {
+    if (str[i] == '%'
+        && i + 2 < len
+        && HEX_VALUE(str[i + 1]) >= 0
+        && HEX_VALUE(str[i + 2]) >= 0) {
+      buf[n++] = (char)(HEX_VALUE(str[i + 1]) * 16 + HEX_VALUE(str[i + 2]));
+      i += 2;
+    } else if (str[i] == '+') {
+      buf[n++] = ' ';
+    } else {
+      buf[n++] = str[i];
+    }
+  }
+  buf[n] = '\0';
+  return n;
+}
 
+/*
+ * Checks an Accept-Encoding value such as "gzip, deflate;q=0.5" for the
+ * given content coding, or "*". A q value of zero rules the coding out.
+ */
+bool http_accepts_encoding(const struct http_fragment *accept_encoding,
+                           const char *coding)
+{
+  const char *p = accept_encoding->ptr;
+  const char *end = p + accept_encoding->length;
+  size_t coding_len = strlen(coding);
+  int accepted = -1;
+  int any_accepted = -1;
+
+  while (p < end) {
+    const char *token;
+    size_t token_len;
+    bool q_zero = false;
+
+    SKIP(IS_HSPACE(*p) || *p == ',');
+    token = p;
+    SKIP(!IS_HSPACE(*p) && *p != ',' && *p != ';');
+    token_len = p - token;
+
+    /* Parameters, only q matters */
+    while (p < end && *p != ',') {
+      SKIP(IS_HSPACE(*p) || *p == ';');
+      if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+        p += 2;
+        q_zero = true;
+        SKIP(*p == '0' || *p == '.');
+        if (p < end && IS_DIGIT(*p)) {
+          q_zero = false;
+        }
+      }
+      SKIP(*p != ',' && *p != ';');
+    }
+
+    if (token_len == coding_len
+        && strncasecmp(token, coding, coding_len) == 0) {
+      accepted = !q_zero;
+    } else if (token_len == 1 && *token == '*') {
+      any_accepted = !q_zero;
+    }
+  }
+
+  return accepted >= 0 ? accepted != 0 : any_accepted > 0;
+}
+
+/*
+ * Checks whether a comma-separated header value, like that of Connection,
+ * contains the token (case-insensitive).
+ */
+bool http_has_token(const struct http_fragment *value, const char *token)
+{
+  const char *p = value->ptr;
+  const char *end = p + value->length;
+  size_t token_len = strlen(token);
+  const char *start;
+
+  while (p < end) {
+    SKIP(IS_HSPACE(*p) || *p == ',');
+    start = p;
+    SKIP(!IS_HSPACE(*p) && *p != ',');
+    if ((size_t)(p - start) == token_len
+        && strncasecmp(start, token, token_len) == 0) {
+      return true;
+    }
+    SKIP(*p != ',');
+  }
+  return false;
+}
+
+static const char *opaque_tag(const char *etag, const char **end)
+{
+  if (strncmp(etag, "W/", 2) == 0) {
+    etag += 2;
+  }
+  *end = *etag == '"' ? strchr(etag + 1, '"') : NULL;
+  return *end != NULL ? etag : NULL;
+}
+
+/*
+ * Checks If-None-Match against the entity tag of the current representation,
+ * using the weak comparison: W/"a" matches "a".
+ */
+bool http_etag_matches(const struct http_fragment *if_none_match,
+                       const char *etag)
+{
+  const char *p = if_none_match->ptr;
+  const char *end = p + if_none_match->length;
+  const char *tag;
+  const char *tag_end;
+  size_t tag_len;
+
+  tag = opaque_tag(etag, &tag_end);
+  if (tag == NULL) {
+    return false;
+  }
+  tag_len = tag_end - tag + 1;
+
+  while (p < end) {
+    const char *start;
+
+    SKIP(IS_HSPACE(*p) || *p == ',');
+    if (p < end && *p == '*') {
+      return true;
+    }
+    if (end - p >= 2 && strncmp(p, "W/", 2) == 0) {
+      p += 2;
+    }
+    if (p >= end || *p != '"') {
+      return false;
+    }
+    start = p++;
+    SKIP(*p != '"');
+    if (p == end) {
+      return false;
+    }
+    p++;
+    if ((size_t)(p - start) == tag_len && strncmp(start, tag, tag_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *connection_header(bool keep_alive)
+{
+  return keep_alive
+    ? "Connection: keep-alive" CRLF
+    : "Connection: close" CRLF;
+}
+
+static void format_cache_headers(char *buf,
+                                 size_t size,
+                                 const char *etag,
+                                 const char *cache_control)
+{
   snprintf(
-    headers,
-    sizeof(headers),
+    buf,
+    size,
+    "%s%s%s%s%s%s",
+    etag != NULL ? "ETag: " : "",
+    etag != NULL ? etag : "",
+    etag != NULL ? CRLF : "",
+    cache_control != NULL ? "Cache-Control: " : "",
+    cache_control != NULL ? cache_control : "",
+    cache_control != NULL ? CRLF : "");
+}
+
+static void format_response(struct http_response *response,
+                            const char *content,
+                            size_t length,
+                            const char *format,
+                            ...)
+{
+  va_list args;
+  int headers_length;
+
+  va_start(args, format);
+  headers_length = vsnprintf(response->headers,
+                             sizeof(response->headers),
+                             format,
+                             args);
+  va_end(args);
+  response->headers_length = headers_length > 0
+    ? (size_t)headers_length
+    : 0;
+  if (response->headers_length >= sizeof(response->headers)) {
+    response->headers_length = sizeof(response->headers) - 1;
+  }
+  response->content = content;
+  response->content_length = length;
+  response->sent = 0;
+}
+
+void http_format_content(struct http_response *response,
+                         const char *content,
+                         size_t length,
+                         const char *type,
+                         const char *etag,
+                         const char *cache_control,
+                         bool keep_alive)
+{
+  char cache_headers[160];
+
+  format_cache_headers(cache_headers,
+                       sizeof(cache_headers),
+                       etag,
+                       cache_control);
+  format_response(
+    response,
+    content,
+    length,
     "HTTP/1.1 200 OK" CRLF
     "Content-Type: %s" CRLF
     "Content-Length: %zu" CRLF
-    "Connection: close" CRLF
+    "%s"
+    "%s"
     CRLF,
     type,
-    length);
+    length,
+    cache_headers,
+    connection_header(keep_alive));
+}
 
-  result = send_string(sock, headers);
-  if (result <= 0) {
-    return result;
-  }
+/*
+ * Content that has variants for different values of Accept-Encoding.
+ * encoding may be NULL for the unencoded one. The variants share a weak
+ * entity tag, if any.
+ */
+void http_format_encoded_content(struct http_response *response,
+                                 const char *content,
+                                 size_t length,
+                                 const char *type,
+                                 const char *encoding,
+                                 const char *etag,
+                                 const char *cache_control,
+                                 bool keep_alive)
+{
+  char cache_headers[160];
+
+  format_cache_headers(cache_headers,
+                       sizeof(cache_headers),
+                       etag,
+                       cache_control);
+  format_response(
+    response,
+    content,
+    length,
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Type: %s" CRLF
+    "Content-Length: %zu" CRLF
+    "%s%s%s"
+    "Vary: Accept-Encoding" CRLF
+    "%s"
+    "%s"
+    CRLF,
+    type,
+    length,
+    encoding != NULL ? "Content-Encoding: " : "",
+    encoding != NULL ? encoding : "",
+    encoding != NULL ? CRLF : "",
+    cache_headers,
+    connection_header(keep_alive));
+}
 
-  return send_n(sock, content, (int)length, 0);
+void http_format_ok(struct http_response *response, bool keep_alive)
+{
+  format_response(
+    response,
+    NULL,
+    0,
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Length: 0" CRLF
+    "%s"
+    CRLF,
+    connection_header(keep_alive));
 }
 
-int http_send_ok(socket_t sock)
+void http_format_not_modified(struct http_response *response,
+                              const char *etag,
+                              const char *cache_control,
+                              bool keep_alive)
 {
-  return send_string(sock,
-                     "HTTP/1.1 200 OK" CRLF
-                     "Content-Length: 0" CRLF
-                     "Connection: close" CRLF
-                     CRLF);
+  char cache_headers[160];
+
+  format_cache_headers(cache_headers,
+                       sizeof(cache_headers),
+                       etag,
+                       cache_control);
+  format_response(
+    response,
+    NULL,
+    0,
+    "HTTP/1.1 304 Not Modified" CRLF
+    "%s"
+    "%s"
+    CRLF,
+    cache_headers,
+    connection_header(keep_alive));
 }
 
-int http_send_bad_request_error(socket_t sock)
+/*
+ * Starts a response whose body goes on until the connection is closed,
+ * such as an event stream.
+ */
+void http_format_stream_headers(struct http_response *response,
+                                const char *type)
 {
-  return send_string(sock,
-                     "HTTP/1.1 400 Bad Request" CRLF
-                     "Content-Length: 0" CRLF
-                     "Connection: close" CRLF
-                     CRLF);
+  format_response(
+    response,
+    NULL,
+    0,
+    "HTTP/1.1 200 OK" CRLF
+    "Content-Type: %s" CRLF
+    "Cache-Control: no-cache" CRLF
+    "Connection: close" CRLF
+    CRLF,
+    type);
 }
 
-int http_send_internal_error(socket_t sock)
+void http_format_bad_request_error(struct http_response *response)
 {
-  return send_string(sock,
-                     "HTTP/1.1 500 Internal Server Error" CRLF
-                     "Content-Length: 0" CRLF
-                     "Connection: close" CRLF
-                     CRLF);
+  format_response(
+    response,
+    NULL,
+    0,
+    "HTTP/1.1 400 Bad Request" CRLF
+    "Content-Length: 0" CRLF
+    "Connection: close" CRLF
+    CRLF);
+}
+
+void http_format_internal_error(struct http_response *response)
+{
+  format_response(
+    response,
+    NULL,
+    0,
+    "HTTP/1.1 500 Internal Server Error" CRLF
+    "Content-Length: 0" CRLF
+    "Connection: close" CRLF
+    CRLF);
+}
+
+bool http_response_done(const struct http_response *response)
+{
+  return response->sent
+    == response->headers_length + response->content_length;
+}
+
+/*
+ * Sends as much of the rest of the response as the socket takes without
+ * blocking. Headers and content go out in one write, so that a kept-alive
+ * connection doesn't wait for a delayed ACK between them. Returns the
+ * number of bytes sent or -1 on error.
+ */
+int http_send_response(socket_t sock, struct http_response *response)
+{
+  struct socket_buf bufs[2];
+  int count = 0;
+  int len;
+
+  if (response->sent < response->headers_length) {
+    bufs[count].data = response->headers + response->sent;
+    bufs[count].len = response->headers_length - response->sent;
+    count++;
+    bufs[count].data = response->content;
+    bufs[count].len = response->content_length;
+    count++;
+  } else {
+    bufs[count].data = response->content
+      + (response->sent - response->headers_length);
+    bufs[count].len = response->headers_length
+      + response->content_length
+      - response->sent;
+    count++;
+  }
+
+  len = send_v_nb(sock, bufs, count, 0);
+  if (len > 0) {
+    response->sent += (size_t)len;
+  }
+  return len;
 }
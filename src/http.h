@@ -26,11 +26,34 @@
 #include "defs.h"
 #include "socket_ext.h"
 
+#define HTTP_MAX_RESPONSE_HEADERS 512
+
 struct http_fragment {
   const char *ptr;
   size_t length;
 };
 
+/*
+ * A response that is sent as the socket takes it. The headers are kept
+ * here, the content is only referenced and must outlive the response.
+ */
+struct http_response {
+  char headers[HTTP_MAX_RESPONSE_HEADERS];
+  size_t headers_length;
+  const char *content;
+  size_t content_length;
+  size_t sent;
+};
+
+/*
+ * Finds the end of the header section in a buffer that fills up a bit at
+ * a time, without looking at the same bytes twice.
+ */
+struct http_header_scanner {
+  size_t offset;
+  int state; /* how much of CRLF CRLF has been seen */
+};
+
 const char *http_parse_request_line(
   const char *buf,
   struct http_fragment *method,
@@ -44,15 +67,57 @@ const char *http_parse_headers(
     void *data),
   void *data);
 
-int http_recv_headers(socket_t sock, char *headers, size_t size);
+size_t http_path_length(const struct http_fragment *target);
+bool http_get_query_param(
+  const struct http_fragment *target,
+  const char *name,
+  struct http_fragment *value);
+size_t http_url_decode(const char *str, size_t len, char *buf);
+
+void http_header_scanner_init(struct http_header_scanner *scanner);
+size_t http_scan_headers(
+  struct http_header_scanner *scanner,
+  const char *buf,
+  size_t len);
+
+bool http_has_token(const struct http_fragment *value, const char *token);
+bool http_accepts_encoding(
+  const struct http_fragment *accept_encoding,
+  const char *coding);
+bool http_etag_matches(
+  const struct http_fragment *if_none_match,
+  const char *etag);
 
-int http_send_content(
-  socket_t sock,
+void http_format_content(
+  struct http_response *response,
   const char *content,
   size_t length,
+  const char *type,
+  const char *etag,
+  const char *cache_control,
+  bool keep_alive);
+void http_format_encoded_content(
+  struct http_response *response,
+  const char *content,
+  size_t length,
+  const char *type,
+  const char *encoding,
+  const char *etag,
+  const char *cache_control,
+  bool keep_alive);
+void http_format_ok(struct http_response *response, bool keep_alive);
+void http_format_not_modified(
+  struct http_response *response,
+  const char *etag,
+  const char *cache_control,
+  bool keep_alive);
+void http_format_stream_headers(
+  struct http_response *response,
   const char *type);
-int http_send_ok(socket_t sock);
-int http_send_bad_request_error(socket_t sock);
-int http_send_internal_error(socket_t sock);
+void http_format_bad_request_error(struct http_response *response);
+void http_format_internal_error(struct http_response *response);
+
+bool http_response_done(const struct http_response *response);
+int http_send_response(socket_t sock, struct http_response *response);
 
 #endif /* HTTP_H */
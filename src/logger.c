@@ -32,18 +32,33 @@
   extern "C" {
 #endif
 #include "defs.h"
+#include "deflate.h"
 #include "error.h"
+#include "event.h"
+#include "filter.h"
 #include "http.h"
 #include "json.h"
+#include "poller.h"
+#include "publisher.h"
+#include "ring.h"
+#include "sampler.h"
 #include "socket_ext.h"
+#include "socket_map.h"
 #include "strbuf.h"
 #include "string_ext.h"
 #include "time.h"
 #include "thread.h"
+#include "uring.h"
 #include "ui_favicon_ico.h"
 #include "ui_index_html.h"
 #include "ui_index_css.h"
 #include "ui_index_js.h"
+#ifdef HAVE_ZLIB
+  #include "ui_favicon_ico_gz.h"
+  #include "ui_index_html_gz.h"
+  #include "ui_index_css_gz.h"
+  #include "ui_index_js_gz.h"
+#endif
 #include "ws.h"
 #ifdef __cplusplus
   }
@@ -60,11 +75,22 @@
 #endif
 #define MYSQL_LOGGER_PORT (MYSQL_PORT + 10000)
 #define MAX_HTTP_HEADERS (8 * 1024) /* HTTP RFC recommends at least 8000 */
-#define MAX_ACTIVE_CONNECTIONS 256
-#define MAX_WS_CLIENTS 32
+#define HTTP_REQUEST_TIMEOUT 10000 /* ms, when keep-alive is off */
 #define MAX_WS_MESSAGE_LEN 4096
+#define MAX_WS_FRAME_SIZE (16 * 1024 * 1024)
+#define MAX_CLIENT_FRAMES 256
 #define MAX_WS_MESSAGES 1024
-#define MAX_MESSAGE_QUEUE_SIZE 10240
+#define MAX_MESSAGE_QUEUE_SIZE 16384 /* must be a power of two */
+#define MAX_STAGED_EVENTS 16
+#define MAX_POLLER_EVENTS 64
+#define MAX_SENDER_THREADS 64
+#define MAX_SHARD_FRAME_SETS 256
+#define MAX_PENDING_CLIENTS 64
+#define MIN_CLIENT_SLOTS 16
+#define MAX_URING_ENTRIES 256
+#define MAX_EVENT_FILTERS 64 /* one bit each in event_span */
+#define THREAD_MATCH_CACHE_SIZE 1024 /* must be a power of two */
+#define BINARY_PROTOCOL "mysql-logger.binary"
 
 #define LOG(...) log_printf("[logger] ", __VA_ARGS__)
 #define LOG_ERROR(...) \
@@ -84,24 +110,239 @@
   #define CSTR(s) (s).str
 #endif
 
+/* Compressed at build time by cdump */
+#ifdef HAVE_ZLIB
+  #define GZIP_RESOURCE(name) name##_gz, sizeof(name##_gz) - 1
+#else
+  #define GZIP_RESOURCE(name) NULL, 0
+#endif
+
+/*
+ * Resources named after their content hash never change, the rest are
+ * revalidated on every use.
+ */
+#define ETAG(hash) "W/\"" hash "\""
+#define CACHE_IMMUTABLE "public, max-age=31536000, immutable"
+#define CACHE_REVALIDATE "no-cache"
+
+#if MYSQL_AUDIT_INTERFACE_VERSION >= 0x0400
+  #define STATUS_VAR(name, value, type) \
+    {name, (char *)(value), type, SHOW_SCOPE_GLOBAL}
+#else
+  #define STATUS_VAR(name, value, type) {name, (char *)(value), type}
+#endif
+
+enum server_thread_state {
+  SERVER_BUSY,
+  SERVER_WAITING, /* for a full batch or flush_interval */
+  SERVER_SLEEPING /* until there is anything to send */
+};
+
 struct http_resource {
   const char *path;
   const char *content_type;
   const char *data;
   size_t size;
+  const char *gzip_data;
+  size_t gzip_size;
+  const char *etag;
+  const char *cache_control;
+};
+
+struct http_request_headers {
+  struct http_fragment accept_encoding;
+  struct http_fragment connection;
+  struct http_fragment if_none_match;
+};
+
+/*
+ * What it takes to rebuild the query_start event of a statement that was
+ * sampled out, without copying anything up front. The query stays valid
+ * until the statement is done. The user name doesn't (the server builds it
+ * in a temporary buffer), so it's taken from the later event along with
+ * the database and query ID.
+ */
+struct held_statement {
+  const char *query;
+  long long time;
+  unsigned long long seq;
+};
+
+struct event_staging {
+  struct event_record records[MAX_STAGED_EVENTS];
+  int count;
+  long long first_time;
+  unsigned long long next_seq;
+  uint32_t random_state;
+  bool skip_statement;
+  long statement_weight;
+  bool statement_held; /* sampled out, held kept in case it fails */
+  struct held_statement held;
+  struct event_staging *next; /* in staging_buffers */
+  struct event_staging *next_free;
+};
+
+enum message_format {
+  FORMAT_JSON,
+  FORMAT_BINARY,
+  FORMAT_COUNT
+};
+
+/*
+ * Where an event is in a JSON message and which event stream filters it
+ * matches, one bit per slot in event_filters.
+ */
+struct event_span {
+  size_t offset;
+  size_t length;
+  uint64_t filter_matches;
+};
+
+/*
+ * Messages are encoded once per format and compressed once for all clients
+ * of that format that use permessage-deflate. Sender threads ask for a
+ * message that can be decoded on its own by bumping requested_generation.
+ */
+struct message_stream {
+  int opcode;
+  volatile long client_count;
+  volatile long deflate_client_count;
+  volatile long requested_generation;
+  long generation;
+  int event_count;
+  struct strbuf message;
+  struct strbuf deflated_message;
+  struct deflater deflater;
+  bool deflate_reset_pending;
+  bool record_spans; /* for event streams, JSON only */
+  struct event_span *spans;
+  int span_capacity;
 };
 
+struct sender_shard;
+
+/*
+ * Frames waiting to be written to a client. Clients whose queue fills up
+ * are switched to summary mode: they stop getting events and are told how
+ * many they missed once they catch up.
+ *
+ * Event stream clients (GET /events) are queued the same way, but get
+ * Server-Sent Events cut out of the JSON frames instead.
+ */
 struct ws_client {
-  mutex_t mutex;
-  bool connected;
+  struct sender_shard *shard;
+  int index; /* in shard->clients */
+  bool closing;
+  bool lagging;
+  bool want_write;
+  bool deflate;
+  bool event_stream;
+  int filter_index; /* in event_filters, -1 for none */
+  unsigned long long first_set_seq;
+  enum message_format format;
   socket_t socket;
+  struct ws_parser parser;
   struct sockaddr address;
   char address_str[INET6_ADDRSTRLEN];
+  struct ws_frame *frames[MAX_CLIENT_FRAMES];
+  int frame_head;
+  int frame_count;
+  size_t frame_offset; /* bytes of the first frame already sent */
+  size_t queued_bytes;
+  long long lag_start_time;
+  long long events_skipped;
+  long needed_generation; /* of frames the client is able to decode */
 };
 
-struct ws_message {
-  struct strbuf message;
-  struct ws_message *next;
+/*
+ * Frames of one message in every format, shared by all sender threads.
+ */
+struct frame_set {
+  volatile long refs;
+  unsigned long long seq;
+  struct ws_frame *frames[FORMAT_COUNT][2];
+  long generations[FORMAT_COUNT];
+  int event_counts[FORMAT_COUNT];
+  struct event_span *spans; /* into frames[FORMAT_JSON][0]->data */
+  int span_count;
+};
+
+struct pending_client {
+  socket_t sock;
+  struct ws_options options;
+  bool event_stream;
+  int filter_index;
+  unsigned long long first_set_seq;
+  char *early_data; /* sent right after the handshake request, or NULL */
+  size_t early_length;
+};
+
+/*
+ * An HTTP connection on the server thread. Requests are answered as they
+ * come in, several of them may arrive in one read. Responses are sent as
+ * the socket takes them; the next request waits until the previous
+ * response is out. Connections are kept in order of last activity so that
+ * idle ones can be found quickly.
+ */
+struct http_connection {
+  socket_t sock;
+  struct http_connection *prev;
+  struct http_connection *next;
+  long long last_active_time;
+  int request_count;
+  struct http_header_scanner scanner;
+  size_t length;
+  char buf[MAX_HTTP_HEADERS + 1]; /* with room for a null terminator */
+  struct http_response response;
+  bool want_write;
+  bool close_when_sent;
+  bool handing_over; /* to a sender thread once the response is sent */
+  struct pending_client pending;
+};
+
+/*
+ * Filters of event stream clients, shared by clients that asked for the
+ * same rules. Only the server thread sets them up and uses them, sender
+ * threads just drop their references.
+ */
+struct event_filter {
+  volatile long refs;
+  char *rules; /* include and exclude, NULL if the slot is free */
+  struct filter filter;
+};
+
+struct thread_matches {
+  bool valid;
+  unsigned long thread_id;
+  uint64_t filter_matches;
+};
+
+/*
+ * A sender thread and the clients it owns. The server thread hands it new
+ * clients and frame sets under the mutex; if it doesn't keep up, frame
+ * sets that don't fit in the inbox are dropped for this shard alone.
+ */
+struct sender_shard {
+  thread_t thread;
+  bool thread_started;
+  struct poller poller;
+  mutex_t mutex;
+  bool sleeping;
+  struct frame_set *inbox[MAX_SHARD_FRAME_SETS];
+  int inbox_count;
+  long long missed_events[FORMAT_COUNT];
+  struct pending_client pending[MAX_PENDING_CLIENTS];
+  int pending_count;
+  volatile long client_count; /* including pending ones */
+  int max_clients;
+  struct ws_client **clients; /* connected, in no particular order */
+  int connected_count;
+  int client_slots;
+  struct socket_map client_map;
+  struct ws_client **ready_clients; /* client_slots per frame kind */
+  struct uring_send *sends;
+  struct uring send_ring;
+  bool send_ring_active;
 };
 
 static mutex_t log_mutex;
@@ -109,53 +350,112 @@ static FILE *log_file;
 
 static int config_http_port;
 static int config_ws_port;
+static int config_max_connections;
+static int config_http_keep_alive_timeout;
+static int config_http_max_requests;
+static int config_sender_threads;
 static bool config_trace;
-
-/* HTTP -> plugin */
-static volatile bool http_server_active;
-socket_t http_server_socket = INVALID_SOCKET;
-static thread_t http_server_thread;
+static bool config_always_capture;
+static int config_flush_interval;
+static int config_batch_size;
+static int config_staging_size;
+static char *config_overflow_policy;
+static int config_block_timeout;
+static char *config_include;
+static char *config_exclude;
+static bool config_batch_frames;
+static int config_max_frame_size;
+static bool config_use_io_uring;
+static bool config_deflate;
+static bool config_binary_protocol;
+static int config_deflate_level;
+static int config_deflate_window_bits;
+static int config_client_queue_size;
+static int config_client_lag_timeout;
+static int config_sample_rate;
+static bool config_adaptive_sampling;
+static int config_user_rate_limit;
+static int config_database_rate_limit;
+
+/* HTTP and WebSocket -> plugin */
+static volatile bool server_active;
+static struct poller server_poller;
+static socket_t server_socket = INVALID_SOCKET;
+static thread_t server_thread;
+static volatile long server_thread_state;
+static struct socket_map http_connections;
+static struct http_connection *http_connections_head; /* least recent */
+static struct http_connection *http_connections_tail;
 static struct http_resource http_resources[] = {
   {
     "/",
     "text/html",
     ui_index_html,
-    sizeof(ui_index_html) - 1
+    sizeof(ui_index_html) - 1,
+    GZIP_RESOURCE(ui_index_html),
+    ETAG(UI_INDEX_HTML_HASH),
+    CACHE_REVALIDATE
   },
   {
     "/favicon.ico",
     "image/x-icon",
     ui_favicon_ico,
-    sizeof(ui_favicon_ico) - 1
+    sizeof(ui_favicon_ico) - 1,
+    GZIP_RESOURCE(ui_favicon_ico),
+    ETAG(UI_FAVICON_ICO_HASH),
+    CACHE_REVALIDATE
   },
   {
-    "/index.css",
+    "/index." UI_INDEX_CSS_HASH ".css",
     "text/css",
     ui_index_css,
-    sizeof(ui_index_css) - 1
+    sizeof(ui_index_css) - 1,
+    GZIP_RESOURCE(ui_index_css),
+    ETAG(UI_INDEX_CSS_HASH),
+    CACHE_IMMUTABLE
   },
   {
-    "/index.js",
+    "/index." UI_INDEX_JS_HASH ".js",
     "text/javascript",
     ui_index_js,
-    sizeof(ui_index_js) - 1
+    sizeof(ui_index_js) - 1,
+    GZIP_RESOURCE(ui_index_js),
+    ETAG(UI_INDEX_JS_HASH),
+    CACHE_IMMUTABLE
   },
 };
-
-/* WebSocket -> plugin */
-static volatile bool ws_server_active;
-static socket_t ws_server_socket = INVALID_SOCKET;
-static thread_t ws_server_thread;
-static struct ws_client ws_clients[MAX_WS_CLIENTS];
-static mutex_t ws_clients_mutex;
+static volatile long ws_client_count;
 
 /* plugin -> WebSocket */
-static volatile bool messaging_active;
-static thread_t message_thread;
-static struct ws_message *message_queue;
-static struct ws_message *message_queue_tail;
-static volatile long pending_message_count;
-static mutex_t message_queue_mutex;
+static struct ring message_queue;
+static struct message_stream streams[FORMAT_COUNT];
+static struct event_encoder binary_encoder;
+static struct sender_shard *sender_shards;
+static int sender_shard_count;
+static bool deflate_active;
+static const char *const ws_protocols[] = {BINARY_PROTOCOL, NULL};
+static thread_key_t staging_key;
+static mutex_t staging_mutex; /* protects the two lists below */
+static struct event_staging *staging_buffers; /* all of them */
+static struct event_staging *free_staging_buffers; /* left by exited threads */
+static struct publisher publisher;
+static struct filter capture_filter;
+static struct event_filter event_filters[MAX_EVENT_FILTERS];
+static int event_filter_count; /* slots in use */
+static struct thread_matches thread_matches[THREAD_MATCH_CACHE_SIZE];
+static volatile long event_stream_count;
+static unsigned long long frame_set_seq;
+static struct sampler sampler;
+static const char *const overflow_policy_names[] = {
+  "drop_newest",
+  "drop_oldest",
+  "sample",
+  "block"
+};
+
+/* Statistics (exported as status variables) */
+static volatile long long statements_sampled_out;
+static volatile long long clients_evicted;
 
 #if !TARGET_MARIADB || MYSQL_AUDIT_INTERFACE_VERSION < 0x0302
   static volatile long query_id_counter = 1;
@@ -186,510 +486,2795 @@ static void log_printf(const char *prefix, const char *format, ...)
   mutex_unlock(&log_mutex);
 }
 
-static void serve(const char *tag,
-                  unsigned short port,
-                  socket_t *sock,
-                  volatile bool *flag,
-                  int (*handler)(socket_t))
+static struct ws_client *find_ws_client(struct sender_shard *shard,
+                                        socket_t sock)
 {
-  socket_t server_sock;
-  socket_t client_sock;
-  struct sockaddr_in server_addr;
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
-  int opt;
-  int result;
-  int i;
-  pollfd_t pollfds[MAX_ACTIVE_CONNECTIONS + 1];
-  pollfd_t *server_pollfd = &pollfds[MAX_ACTIVE_CONNECTIONS];
+  return (struct ws_client *)socket_map_get(&shard->client_map, sock);
+}
 
-  server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (server_sock < 0) {
-    LOG_ERROR("Could not open socket: %s\n",
-        xstrerror(ERROR_SYSTEM, socket_error));
-    return;
+/*
+ * Makes the client skip frames until the server thread encodes one of its
+ * format that can be decoded without any of the earlier ones. Returns false
+ * if the client can decode any frame anyway.
+ */
+static bool restart_client_stream(struct ws_client *client)
+{
+  if (!client->deflate && client->format != FORMAT_BINARY) {
+    return false;
   }
+  client->needed_generation =
+    ATOMIC_FETCH_ADD(&streams[client->format].requested_generation, 1) + 1;
+  return true;
+}
 
-  /*
-   * Allow reuse of this socket address (port) without waiting.
-   */
-  opt = 1;
-  setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt));
+static int init_ws_client(struct ws_client *client,
+                          struct sender_shard *shard,
+                          const struct pending_client *pending)
+{
+  socket_t sock = pending->sock;
+  struct sockaddr addr;
+  socklen_t addr_len = sizeof(addr);
+  char ip_str[INET6_ADDRSTRLEN] = {0};
+  int error;
 
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(port);
-  if (bind(server_sock,
-           (struct sockaddr *)&server_addr,
-           sizeof(server_addr)) != 0) {
-    close_socket(server_sock);
-    LOG_ERROR("Could not bind to port %u: %s\n",
-        port,
-        xstrerror(ERROR_SYSTEM, socket_error));
-    return;
+  error = getpeername(sock, &addr, &addr_len);
+  if (error != 0
+      || inet_ntop(addr.sa_family, &addr, ip_str, sizeof(ip_str)) == NULL) {
+    strncpy(ip_str, "(unknown address)", sizeof(ip_str));
+    ip_str[sizeof(ip_str) - 1] = '\0';
   }
 
-  if (listen(server_sock, 32) != 0) {
-    close_socket(server_sock);
-    LOG_ERROR("Could not start listening for connections: %s\n",
-        xstrerror(ERROR_SYSTEM, socket_error));
-    return;
+  /* A slow client must never hold up the sender thread */
+  error = set_socket_nonblocking(sock, true);
+  if (error != 0) {
+    return socket_error;
+  }
+
+  client->shard = shard;
+  client->index = -1;
+  client->closing = false;
+  client->lagging = false;
+  client->want_write = false;
+  client->deflate = pending->options.deflate;
+  client->event_stream = pending->event_stream;
+  client->filter_index = pending->filter_index;
+  client->first_set_seq = pending->first_set_seq;
+  client->format = pending->options.protocol == 0
+    ? FORMAT_BINARY
+    : FORMAT_JSON;
+  client->socket = sock;
+  client->address = addr;
+  client->address_str[0] = '\0';
+  strncpy(client->address_str, ip_str, sizeof(client->address_str));
+  client->address_str[sizeof(client->address_str) - 1] = '\0';
+  client->frame_head = 0;
+  client->frame_count = 0;
+  client->frame_offset = 0;
+  client->queued_bytes = 0;
+  client->events_skipped = 0;
+  client->needed_generation = 0;
+  ws_parser_init(&client->parser);
+  if (client->deflate) {
+    client->parser.extension_flags = WS_FLAG_RSV1;
   }
 
-  assert(sock != NULL);
-  assert(flag != NULL);
-  *sock = server_sock;
+  return 0;
+}
 
-  for (i = 0; i <= MAX_ACTIVE_CONNECTIONS; i++) {
-    pollfds[i].fd = INVALID_SOCKET;
-    pollfds[i].events = 0;
-    pollfds[i].revents = 0;
+/*
+ * Makes room for twice as many clients. The arrays only ever grow, up to
+ * the shard's share of max_connections.
+ */
+static int grow_client_list(struct sender_shard *shard)
+{
+  int slots = shard->client_slots != 0
+    ? shard->client_slots * 2
+    : MIN_CLIENT_SLOTS;
+  struct ws_client **clients;
+  struct ws_client **ready_clients;
+  struct uring_send *sends;
+
+  if (slots > shard->max_clients) {
+    slots = shard->max_clients;
   }
 
-  while (*flag) {
-    for (i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
-      pollfds[i].events = pollfds[i].fd != INVALID_SOCKET ? POLLIN : 0;
-      pollfds[i].revents = 0;
-    }
+  clients = (struct ws_client **)
+    realloc(shard->clients, slots * sizeof(*clients));
+  if (clients == NULL) {
+    return ENOMEM;
+  }
+  shard->clients = clients;
 
-    /* Server's socket */
-    server_pollfd->fd = server_sock;
-    server_pollfd->events = POLLIN;
-    server_pollfd->revents = 0;
+  ready_clients = (struct ws_client **)
+    realloc(shard->ready_clients,
+            slots * FORMAT_COUNT * 2 * sizeof(*ready_clients));
+  if (ready_clients == NULL) {
+    return ENOMEM;
+  }
+  shard->ready_clients = ready_clients;
 
-    result = poll(pollfds, MAX_ACTIVE_CONNECTIONS + 1, 10);
-    if (result < 0) {
-      LOG_ERROR("Failed to poll socket: %s\n",
-          xstrerror(ERROR_SYSTEM, socket_error));
-      break;
-    }
+  sends = (struct uring_send *)realloc(shard->sends, slots * sizeof(*sends));
+  if (sends == NULL) {
+    return ENOMEM;
+  }
+  shard->sends = sends;
 
-    if (result == 0) {
-      continue;
+  shard->client_slots = slots;
+  return 0;
+}
+
+static int add_ws_client(struct sender_shard *shard,
+                         const struct pending_client *pending)
+{
+  socket_t sock = pending->sock;
+  struct ws_client *client;
+  int error;
+
+  if (shard->connected_count == shard->client_slots
+      && (error = grow_client_list(shard)) != 0) {
+    return error;
+  }
+
+  client = (struct ws_client *)malloc(sizeof(*client));
+  if (client == NULL) {
+    return ENOMEM;
+  }
+  if ((error = init_ws_client(client, shard, pending)) != 0
+      || (error = socket_map_put(&shard->client_map, sock, client)) != 0) {
+    free(client);
+    return error;
+  }
+  if ((error = poller_add(&shard->poller, sock, POLLER_READ)) != 0) {
+    socket_map_remove(&shard->client_map, sock);
+    free(client);
+    return error;
+  }
+  client->index = shard->connected_count;
+  shard->clients[shard->connected_count++] = client;
+
+  ATOMIC_INCREMENT(&ws_client_count);
+  ATOMIC_INCREMENT(&streams[client->format].client_count);
+  if (client->deflate) {
+    ATOMIC_INCREMENT(&streams[client->format].deflate_client_count);
+  }
+  restart_client_stream(client);
+
+  LOG("Client connected: %s (%s%s)\n",
+      client->address_str,
+      client->event_stream
+        ? "event stream"
+        : client->format == FORMAT_BINARY ? "binary" : "JSON",
+      client->deflate ? ", compressed" : "");
+
+  return 0;
+}
+
+/*
+ * Can be called from any thread, the filter stays where it is until the
+ * server thread needs the slot for another one.
+ */
+static void release_event_filter(int index)
+{
+  if (index >= 0) {
+    ATOMIC_DECREMENT(&event_filters[index].refs);
+  }
+}
+
+static void free_client_frames(struct ws_client *client)
+{
+  while (client->frame_count > 0) {
+    ws_frame_unref(client->frames[client->frame_head]);
+    client->frame_head = (client->frame_head + 1) % MAX_CLIENT_FRAMES;
+    client->frame_count--;
+  }
+  client->frame_head = 0;
+  client->frame_offset = 0;
+  client->queued_bytes = 0;
+}
+
+/*
+ * Removes the client from its shard and frees it. The socket itself
+ * belongs to the sender loop, which closes it.
+ */
+static void free_ws_client(struct ws_client *client)
+{
+  struct sender_shard *shard = client->shard;
+  struct ws_client *last;
+
+  ATOMIC_DECREMENT(&ws_client_count);
+  ATOMIC_DECREMENT(&streams[client->format].client_count);
+  if (client->deflate) {
+    ATOMIC_DECREMENT(&streams[client->format].deflate_client_count);
+  }
+  ATOMIC_DECREMENT(&shard->client_count);
+  if (client->event_stream) {
+    release_event_filter(client->filter_index);
+    ATOMIC_DECREMENT(&event_stream_count);
+  }
+
+  free_client_frames(client);
+  socket_map_remove(&shard->client_map, client->socket);
+
+  /* Move the last client into the hole */
+  last = shard->clients[--shard->connected_count];
+  shard->clients[client->index] = last;
+  last->index = client->index;
+
+  free(client);
+}
+
+/*
+ * Interrupts the shard's poller_wait() if it's in one or about to enter
+ * it. Must be called with the shard's mutex held.
+ */
+static void wake_sender_shard(struct sender_shard *shard)
+{
+  if (shard->sleeping) {
+    shard->sleeping = false;
+    poller_wakeup(&shard->poller);
+  }
+}
+
+/*
+ * Hands the connection over to the sender thread with the fewest clients.
+ * Returns 1 if it did, after which the server thread must not touch the
+ * socket anymore.
+ */
+/*
+ * Tells a WebSocket client that it is being turned away. This runs on
+ * threads that serve other clients too, so it never waits for the socket:
+ * the frame is dropped if there is no room for it.
+ */
+static void reject_ws_client(socket_t sock)
+{
+  struct ws_frame *frame;
+
+  frame = ws_frame_create(WS_OP_CLOSE, NULL, 0, WS_FLAG_FINAL);
+  if (frame != NULL) {
+    send_nb(sock, (const char *)frame->data, (int)frame->size, 0);
+    ws_frame_unref(frame);
+  }
+}
+
+static int hand_over_client(struct pending_client *pending)
+{
+  socket_t sock = pending->sock;
+  struct sender_shard *shard = NULL;
+  long min_count = 0;
+  long count;
+  int i;
+
+  for (i = 0; i < sender_shard_count; i++) {
+    count = ATOMIC_LOAD(&sender_shards[i].client_count);
+    if (count < sender_shards[i].max_clients
+        && (shard == NULL || count < min_count)) {
+      shard = &sender_shards[i];
+      min_count = count;
+    }
+  }
+  if (shard == NULL) {
+    LOG("Client limit reached, closing connection\n");
+    if (!pending->event_stream) {
+      reject_ws_client(sock);
     }
+    return -1;
+  }
 
-    if ((server_pollfd->revents & POLLIN) != 0) {
-      /* Server socket is ready to accept a new client connection */
-      client_sock = accept(server_sock,
-                           (struct sockaddr *)&client_addr,
-                           &client_addr_len);
-      if (client_sock < 0) {
-        LOG_ERROR("Could not accept connection: %s\n",
-            xstrerror(ERROR_SYSTEM, socket_error));
-      }
-      for (i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
-        if (pollfds[i].fd == INVALID_SOCKET) {
-          LOG_TRACE("[%s] Connection accepted: %d\n", tag, i);
-          pollfds[i].fd = (int)client_sock;
-          break;
-        }
-      }
-      if (i == MAX_ACTIVE_CONNECTIONS) {
-        LOG_ERROR("Reached connection count limit\n");
-        continue;
-      }
+  /* Event streams start with the next frame set */
+  pending->first_set_seq = frame_set_seq + 1;
+  if (pending->event_stream) {
+    ATOMIC_INCREMENT(&event_stream_count);
+  }
+
+  mutex_lock(&shard->mutex);
+  if (shard->pending_count == MAX_PENDING_CLIENTS) {
+    mutex_unlock(&shard->mutex);
+    LOG("Too many clients connecting at once, closing connection\n");
+    if (pending->event_stream) {
+      ATOMIC_DECREMENT(&event_stream_count);
+    } else {
+      reject_ws_client(sock);
     }
+    return -1;
+  }
+  poller_remove(&server_poller, sock);
+  shard->pending[shard->pending_count++] = *pending;
+  ATOMIC_INCREMENT(&shard->client_count);
+  wake_sender_shard(shard);
+  mutex_unlock(&shard->mutex);
 
-    for (i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
-      if (pollfds[i].fd == INVALID_SOCKET) {
-        continue;
-      }
+  return 1;
+}
 
-      if ((pollfds[i].revents & POLLHUP) != 0
-            || (pollfds[i].revents & POLLERR) != 0) {
-        /* Client disconnected */
-        LOG_TRACE("[%s] Disconnected: %d\n", tag, i);
-        close_socket(pollfds[i].fd);
-        pollfds[i].fd = INVALID_SOCKET;
-        continue;
-      }
+static void set_event_text(struct event_record *record,
+                           int field,
+                           const char *str)
+{
+  int error;
 
-      if ((pollfds[i].revents & POLLIN) != 0) {
-        /* One of the client sockets is ready for reading */
-        if (handler(pollfds[i].fd) != 0) {
-          LOG_TRACE("Disconnected: %d\n", i);
-          close_socket(pollfds[i].fd);
-          pollfds[i].fd = INVALID_SOCKET;
-        }
-        continue;
-      }
-    }
+  error = event_set_text(record, field, str, str != NULL ? strlen(str) : 0);
+  if (error != 0) {
+    LOG_ERROR("Could not copy event text: %s\n",
+        xstrerror(ERROR_C, error));
   }
 }
 
-static int process_http_request(socket_t sock)
+static const char *get_statement_query(
+    const struct mysql_event_general *event_general)
 {
-  char buf[MAX_HTTP_HEADERS];
-  int len;
-  struct http_fragment http_method;
-  struct http_fragment request_target;
-  int http_version;
-  size_t i;
-  size_t resource_count = sizeof(http_resources) / sizeof(http_resources[0]);
+  return CSTR(event_general->general_query) != NULL
+    ? CSTR(event_general->general_query)
+    : CSTR(event_general->general_command);
+}
 
-  len = http_recv_headers(sock, buf, sizeof(buf));
-  if (len < 0) {
-    LOG_ERROR("Could not receive HTTP request headers: %s\n",
+/*
+ * Fills in a query_start event. Except for the query, everything comes from
+ * event_general, which may also be one of the statement's later events.
+ */
+static void init_query_start(struct event_record *record,
+                             const struct mysql_event_general *event_general,
+                             const char *query)
+{
+  event_init(record, EVENT_QUERY_START);
+  set_event_text(record, EVENT_USER, CSTR(event_general->general_user));
+  set_event_text(record, EVENT_QUERY, query);
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+  record->query_id = event_general->query_id;
+  record->flags |= EVENT_HAS_QUERY_ID | EVENT_HAS_DATABASE;
+  set_event_text(record,
+                 EVENT_DATABASE,
+                 *(const char * const *)&event_general->database);
+#else
+  record->query_id = ATOMIC_INCREMENT(&query_id_counter);
+  record->flags |= EVENT_HAS_QUERY_ID;
+#endif
+}
+
+static void init_event_record(struct event_staging *staging,
+                              struct event_record *record,
+                              const struct mysql_event_general *event_general)
+{
+  switch (event_general->event_subclass) {
+    case MYSQL_AUDIT_GENERAL_LOG:
+      init_query_start(record,
+                       event_general,
+                       get_statement_query(event_general));
+      record->rows = event_general->general_rows;
+      break;
+    case MYSQL_AUDIT_GENERAL_ERROR:
+      event_init(record, EVENT_QUERY_ERROR);
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+      record->query_id = event_general->query_id;
+      record->flags |= EVENT_HAS_QUERY_ID;
+#endif
+      record->error_code = event_general->general_error_code;
+      set_event_text(record,
+                     EVENT_ERROR_MESSAGE,
+                     CSTR(event_general->general_command));
+      break;
+    case MYSQL_AUDIT_GENERAL_RESULT:
+      event_init(record, EVENT_QUERY_RESULT);
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+      record->query_id = event_general->query_id;
+      record->flags |= EVENT_HAS_QUERY_ID;
+#endif
+      record->rows = event_general->general_rows;
+      break;
+  }
+
+  record->time = time_ms();
+  record->thread_id = event_general->general_thread_id;
+  record->seq = staging->next_seq++;
+  if (record->type == EVENT_QUERY_START) {
+    record->weight = staging->statement_weight;
+  }
+}
+
+static void wake_server_thread(bool force)
+{
+  long state = server_thread_state;
+
+  /*
+   * Only the first producer to see the server thread waiting with a full
+   * batch pending (or sleeping with nothing to send) pays for waking it up,
+   * everyone else just leaves.
+   */
+  if ((state == SERVER_SLEEPING
+       || (state == SERVER_WAITING
+           && (force
+               || ring_count(&message_queue) >= (size_t)config_batch_size)))
+      && ATOMIC_COMPARE_EXCHANGE(&server_thread_state,
+                                 state,
+                                 SERVER_BUSY) == state) {
+    poller_wakeup(&server_poller);
+  }
+}
+
+/* Called by the publisher while the queue is full */
+static bool wait_for_queue(long long *deadline)
+{
+  if (*deadline == 0) {
+    *deadline = time_ms() + config_block_timeout;
+  }
+  if (time_ms() >= *deadline) {
+    return false;
+  }
+  wake_server_thread(true);
+  thread_sleep(1);
+  return true;
+}
+
+/* Moves events staged by the current thread to the message queue */
+static void publish_staged_events(struct event_staging *staging)
+{
+  int published;
+
+  published = publisher_publish(&publisher,
+                                staging->records,
+                                staging->count,
+                                &staging->random_state);
+  if (published < staging->count) {
+    LOG_TRACE("Ignoring %d events because of message queue overflow\n",
+        staging->count - published);
+  }
+  staging->count = 0;
+  wake_server_thread(false);
+}
+
+static void stage_event(struct event_staging *staging,
+                        const struct event_record *record)
+{
+  if (staging->count == 1) {
+    staging->first_time = record->time;
+  }
+  if (staging->count >= config_staging_size
+      || staging->count >= MAX_STAGED_EVENTS
+      || record->time - staging->first_time >= config_flush_interval) {
+    publish_staged_events(staging);
+  }
+}
+
+static void send_event(struct event_staging *staging,
+                       const struct mysql_event_general *event_general)
+{
+  struct event_record *record;
+
+  /*
+   * Only copy the raw event data here, on the server's query thread, and
+   * leave the JSON encoding to the messaging thread.
+   *
+   * Events are collected in a per-thread buffer and published in batches to
+   * reduce contention on the queue. Events from the same thread stay in
+   * order; across threads they can be ordered by time, thread ID and seq.
+   */
+  record = &staging->records[staging->count++];
+  init_event_record(staging, record, event_general);
+  stage_event(staging, record);
+}
+
+/*
+ * Sets a sampled out statement aside until we know whether it fails. This
+ * is on the path of every statement that isn't captured, so it copies
+ * nothing; the event is only built if the statement fails.
+ */
+static void hold_statement(struct event_staging *staging,
+                           const struct mysql_event_general *event_general)
+{
+  staging->held.query = get_statement_query(event_general);
+  staging->held.time = time_ms();
+  staging->held.seq = staging->next_seq++;
+  staging->statement_held = true;
+  staging->skip_statement = true;
+}
+
+/*
+ * Stages the query_start event of a statement that was sampled out but
+ * then failed: errors are always reported, along with their query.
+ * event_general is the statement's error or result event.
+ */
+static void release_held_statement(
+    struct event_staging *staging,
+    const struct mysql_event_general *event_general)
+{
+  struct event_record *record;
+
+  record = &staging->records[staging->count++];
+  init_query_start(record, event_general, staging->held.query);
+  record->time = staging->held.time;
+  record->thread_id = event_general->general_thread_id;
+  record->seq = staging->held.seq;
+  record->weight = 1;
+  staging->statement_held = false;
+  staging->skip_statement = false;
+  stage_event(staging, record);
+}
+
+static void discard_held_statement(struct event_staging *staging)
+{
+  staging->statement_held = false;
+}
+
+/*
+ * Throws away whatever the thread has staged, e.g. when the last client
+ * disconnects in the middle of a statement.
+ */
+static void clear_staged_events(struct event_staging *staging)
+{
+  int i;
+
+  for (i = 0; i < staging->count; i++) {
+    event_clear(&staging->records[i]);
+  }
+  staging->count = 0;
+  if (staging->statement_held) {
+    discard_held_statement(staging);
+  }
+}
+
+/* Called when a thread that staged events exits */
+static void release_event_staging(void *data)
+{
+  struct event_staging *staging = (struct event_staging *)data;
+
+  clear_staged_events(staging);
+  mutex_lock(&staging_mutex);
+  staging->next_free = free_staging_buffers;
+  free_staging_buffers = staging;
+  mutex_unlock(&staging_mutex);
+}
+
+/*
+ * Returns the staging buffer of the current thread. Buffers are heap
+ * allocated rather than thread-local so that the ones left by other threads
+ * can be freed when the plugin is unloaded; those of exited threads are
+ * reused.
+ */
+static struct event_staging *get_event_staging(void)
+{
+  struct event_staging *staging;
+
+  staging = (struct event_staging *)thread_key_get(staging_key);
+  if (staging != NULL) {
+    return staging;
+  }
+
+  mutex_lock(&staging_mutex);
+  staging = free_staging_buffers;
+  if (staging != NULL) {
+    free_staging_buffers = staging->next_free;
+  } else {
+    staging = (struct event_staging *)calloc(1, sizeof(*staging));
+    if (staging != NULL) {
+      staging->random_state =
+        (uint32_t)(size_t)staging ^ (uint32_t)time_ms() ^ 0x9E3779B9u;
+      staging->next = staging_buffers;
+      staging_buffers = staging;
+    }
+  }
+  mutex_unlock(&staging_mutex);
+
+  if (staging != NULL && thread_key_set(staging_key, staging) != 0) {
+    release_event_staging(staging);
+    return NULL;
+  }
+  return staging;
+}
+
+static void free_event_staging(void)
+{
+  struct event_staging *staging;
+
+  while (staging_buffers != NULL) {
+    staging = staging_buffers;
+    staging_buffers = staging->next;
+    clear_staged_events(staging);
+    free(staging);
+  }
+  free_staging_buffers = NULL;
+}
+
+/*
+ * Only MariaDB tells plugins the current database; elsewhere database rules
+ * would silently match nothing.
+ */
+static bool has_unsupported_rules(const struct filter *filter)
+{
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+  UNUSED(filter);
+  return false;
+#else
+  return filter->include[FILTER_DATABASE].count > 0
+    || filter->exclude[FILTER_DATABASE].count > 0;
+#endif
+}
+
+static bool filter_event(const struct mysql_event_general *event_general)
+{
+  struct filter_input input;
+
+  filter_split_user_host(CSTR(event_general->general_user), &input);
+#if !TARGET_MARIADB
+  if (event_general->general_host.length > 0) {
+    input.values[FILTER_HOST] = CSTR(event_general->general_host);
+    input.lengths[FILTER_HOST] = event_general->general_host.length;
+  } else if (event_general->general_ip.length > 0) {
+    input.values[FILTER_HOST] = CSTR(event_general->general_ip);
+    input.lengths[FILTER_HOST] = event_general->general_ip.length;
+  }
+#endif
+
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+  input.values[FILTER_DATABASE] =
+    *(const char * const *)&event_general->database;
+#else
+  input.values[FILTER_DATABASE] = NULL;
+#endif
+  input.values[FILTER_COMMAND] = CSTR(event_general->general_command);
+  input.values[FILTER_QUERY] = CSTR(event_general->general_query);
+
+  input.lengths[FILTER_DATABASE] = input.values[FILTER_DATABASE] != NULL
+    ? strlen(input.values[FILTER_DATABASE]) : 0;
+  input.lengths[FILTER_COMMAND] = input.values[FILTER_COMMAND] != NULL
+    ? strlen(input.values[FILTER_COMMAND]) : 0;
+  input.lengths[FILTER_QUERY] = input.values[FILTER_QUERY] != NULL
+    ? strlen(input.values[FILTER_QUERY]) : 0;
+
+  return filter_match(&capture_filter, &input);
+}
+
+/*
+ * Decides whether a statement is captured. Each captured statement stands
+ * for the ones thinned out by 1-in-N sampling and for those rejected by the
+ * per-user and per-database limits since the previous one.
+ */
+static bool sample_statement(struct event_staging *staging,
+                             const struct mysql_event_general *event_general)
+{
+  struct filter_input input;
+  const char *database = NULL;
+  long rate;
+  long weight;
+
+  rate = sampler_rate(config_sample_rate,
+                      config_adaptive_sampling,
+                      ring_count(&message_queue),
+                      ring_capacity(&message_queue));
+  if (rate > 1 && sampler_random(&staging->random_state) % (uint32_t)rate != 0) {
+    return false;
+  }
+
+  weight = rate;
+  if (config_user_rate_limit > 0 || config_database_rate_limit > 0) {
+    filter_split_user_host(CSTR(event_general->general_user), &input);
+#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
+    database = *(const char * const *)&event_general->database;
+#endif
+    weight = sampler_limit(&sampler,
+                           input.values[FILTER_USER],
+                           input.lengths[FILTER_USER],
+                           config_user_rate_limit,
+                           database,
+                           database != NULL ? strlen(database) : 0,
+                           config_database_rate_limit,
+                           rate,
+                           time_ms());
+    if (weight == 0) {
+      return false;
+    }
+  }
+
+  staging->statement_weight = weight;
+  return true;
+}
+
+/*
+ * Stops sending to a client and makes the sender loop drop the connection.
+ * The close frame is only sent if it doesn't cut into a partially sent one.
+ */
+static void close_ws_client(struct ws_client *client,
+                            uint16_t code,
+                            const char *reason)
+{
+  struct ws_frame *frame;
+
+  if (code != 0 && !client->event_stream && client->frame_offset == 0) {
+    frame = ws_frame_create_close(code, reason);
+    if (frame != NULL) {
+      send_nb(client->socket, (const char *)frame->data, (int)frame->size, 0);
+      ws_frame_unref(frame);
+    }
+  }
+  free_client_frames(client);
+  client->closing = true;
+  shutdown(client->socket, SHUT_RDWR);
+}
+
+/*
+ * Writes queued frames until the client's socket buffer is full.
+ */
+static void flush_ws_client(struct ws_client *client)
+{
+  struct ws_frame *frame;
+  int result;
+
+  while (client->frame_count > 0) {
+    frame = client->frames[client->frame_head];
+    result = send_nb(client->socket,
+                     (const char *)frame->data + client->frame_offset,
+                     (int)(frame->size - client->frame_offset),
+                     0);
+    if (result < 0) {
+      LOG_ERROR("Failed to send message to %s: %s\n",
+          client->address_str,
+          xstrerror(ERROR_SYSTEM, socket_error));
+      close_ws_client(client, 0, NULL);
+      return;
+    }
+    client->frame_offset += (size_t)result;
+    client->queued_bytes -= (size_t)result;
+    if (client->frame_offset < frame->size) {
+      break;
+    }
+    ws_frame_unref(frame);
+    client->frame_head = (client->frame_head + 1) % MAX_CLIENT_FRAMES;
+    client->frame_count--;
+    client->frame_offset = 0;
+  }
+}
+
+/*
+ * Asks the poller to report when the client's socket can take more data,
+ * but only while there is something left to send.
+ */
+static void update_write_interest(struct ws_client *client)
+{
+  bool want_write = client->frame_count > 0 && !client->closing;
+
+  if (want_write != client->want_write) {
+    poller_modify(&client->shard->poller,
+                  client->socket,
+                  POLLER_READ | (want_write ? POLLER_WRITE : 0));
+    client->want_write = want_write;
+  }
+}
+
+static bool queue_ws_frame(struct ws_client *client, struct ws_frame *frame)
+{
+  if (client->frame_count == MAX_CLIENT_FRAMES
+      || (client->frame_count > 0
+          && client->queued_bytes + frame->size
+              > (size_t)config_client_queue_size)) {
+    return false;
+  }
+  client->frames[(client->frame_head + client->frame_count)
+                 % MAX_CLIENT_FRAMES] = ws_frame_ref(frame);
+  client->frame_count++;
+  client->queued_bytes += frame->size;
+  return true;
+}
+
+/*
+ * Tells the client how many events it missed, right before the first
+ * frame it gets after catching up.
+ */
+static void queue_skipped_events(struct ws_client *client)
+{
+  char summary[128];
+  struct ws_frame *frame;
+
+  snprintf(summary, sizeof(summary),
+           "%s{\"type\": \"events_skipped\", \"count\": %lld}%s",
+           client->event_stream ? "data: " : "",
+           client->events_skipped,
+           client->event_stream ? "\n\n" : "");
+  if (client->event_stream) {
+    frame = ws_frame_alloc(strlen(summary));
+    if (frame != NULL) {
+      memcpy(frame->data, summary, frame->size);
+    }
+  } else {
+    frame = ws_frame_create(WS_OP_TEXT,
+                            summary,
+                            strlen(summary),
+                            WS_FLAG_FINAL);
+  }
+  if (frame != NULL) {
+    queue_ws_frame(client, frame);
+    ws_frame_unref(frame);
+  }
+  client->events_skipped = 0;
+}
+
+/*
+ * Brings a lagging client back once it has drained half of its queue, or
+ * disconnects it if it hasn't within client_lag_timeout ms.
+ */
+static void update_client_lag(struct ws_client *client, long long now)
+{
+  if (!client->lagging) {
+    return;
+  }
+
+  if (client->queued_bytes <= (size_t)config_client_queue_size / 2
+      && client->frame_count <= MAX_CLIENT_FRAMES / 2) {
+    LOG("Client %s caught up, %lld events were skipped\n",
+        client->address_str, client->events_skipped);
+    client->lagging = false;
+    if (!restart_client_stream(client)) {
+      queue_skipped_events(client);
+    }
+  } else if (config_client_lag_timeout > 0
+      && now - client->lag_start_time >= config_client_lag_timeout) {
+    LOG("Disconnecting client %s: too slow\n", client->address_str);
+    ATOMIC_FETCH_ADD64(&clients_evicted, 1);
+    close_ws_client(client, WS_CLOSE_POLICY_VIOLATION, "Too slow");
+  }
+}
+
+static void skip_events(struct ws_client *client,
+                        long long event_count,
+                        long long now)
+{
+  if (!client->lagging) {
+    LOG("Client %s is falling behind, skipping events\n",
+        client->address_str);
+    client->lagging = true;
+    client->lag_start_time = now;
+  }
+  client->events_skipped += event_count;
+}
+
+static void queue_message(struct ws_client *client,
+                          struct ws_frame *frame,
+                          int event_count,
+                          long long now)
+{
+  if (!client->lagging && queue_ws_frame(client, frame)) {
+    flush_ws_client(client);
+    return;
+  }
+  skip_events(client, event_count, now);
+}
+
+/*
+ * Sends a frame to clients with empty queues in a single io_uring
+ * submission and queues whatever their sockets couldn't take. If the ring
+ * fails, clients whose sends weren't done get the frame the usual way.
+ */
+static void send_message_uring(struct sender_shard *shard,
+                               struct ws_frame *frame,
+                               int event_count,
+                               struct ws_client **clients,
+                               int count,
+                               long long now)
+{
+  struct uring_send *sends = shard->sends;
+  long result;
+  int error;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    sends[i].sock = clients[i]->socket;
+    sends[i].data = frame->data;
+    sends[i].len = frame->size;
+  }
+
+  error = uring_send_all(&shard->send_ring, sends, count);
+  if (error != 0) {
+    LOG_ERROR("io_uring failed, falling back to send(): %s\n",
+        xstrerror(ERROR_SYSTEM, error));
+    uring_free(&shard->send_ring);
+    shard->send_ring_active = false;
+  }
+
+  for (i = 0; i < count; i++) {
+    struct ws_client *client = clients[i];
+
+    result = sends[i].result;
+    if (result == -EINPROGRESS && error != 0) {
+      queue_message(client, frame, event_count, now);
+      update_client_lag(client, now);
+      update_write_interest(client);
+      continue;
+    }
+    if (result == -EAGAIN || result == -EWOULDBLOCK) {
+      result = 0;
+    }
+    if (result < 0) {
+      LOG_ERROR("Failed to send message to %s: %s\n",
+          client->address_str,
+          xstrerror(ERROR_SYSTEM, (int)-result));
+      close_ws_client(client, 0, NULL);
+      continue;
+    }
+    if ((size_t)result < frame->size) {
+      queue_ws_frame(client, frame);
+      client->frame_offset = (size_t)result;
+      client->queued_bytes -= (size_t)result;
+      update_write_interest(client);
+    }
+  }
+}
+
+/*
+ * Cuts the events that pass the filter (all of them for -1) out of the
+ * JSON frame and turns each into a "data:" message. Nothing is encoded
+ * again, it's just copying.
+ */
+static struct ws_frame *create_event_stream_frame(const struct frame_set *set,
+                                                  int filter_index,
+                                                  int *event_count)
+{
+  static const char prefix[] = "data: ";
+  static const char suffix[] = "\n\n";
+  const uint8_t *json = set->frames[FORMAT_JSON][0]->data;
+  uint64_t mask = filter_index >= 0 ? (uint64_t)1 << filter_index : 0;
+  struct ws_frame *frame;
+  size_t size = 0;
+  uint8_t *p;
+  int i;
+
+  *event_count = 0;
+  for (i = 0; i < set->span_count; i++) {
+    if (mask == 0 || (set->spans[i].filter_matches & mask) != 0) {
+      size += sizeof(prefix) - 1 + set->spans[i].length + sizeof(suffix) - 1;
+      (*event_count)++;
+    }
+  }
+  if (*event_count == 0) {
+    return NULL;
+  }
+
+  frame = ws_frame_alloc(size);
+  if (frame == NULL) {
+    LOG_ERROR("Error allocating frame: %s\n", xstrerror(ERROR_C, errno));
+    return NULL;
+  }
+  p = frame->data;
+  for (i = 0; i < set->span_count; i++) {
+    if (mask == 0 || (set->spans[i].filter_matches & mask) != 0) {
+      memcpy(p, prefix, sizeof(prefix) - 1);
+      p += sizeof(prefix) - 1;
+      memcpy(p, json + set->spans[i].offset, set->spans[i].length);
+      p += set->spans[i].length;
+      memcpy(p, suffix, sizeof(suffix) - 1);
+      p += sizeof(suffix) - 1;
+    }
+  }
+  return frame;
+}
+
+/*
+ * Sends an event stream client its share of the frame set. Frames are made
+ * once per filter and shared by the shard's clients that use it.
+ */
+static void send_event_stream_frame(struct ws_client *client,
+                                    const struct frame_set *set,
+                                    struct ws_frame **frames,
+                                    int *event_counts,
+                                    long long now)
+{
+  int slot = client->filter_index + 1; /* 0 is for no filter */
+
+  if (set->seq < client->first_set_seq) {
+    return;
+  }
+  if (event_counts[slot] < 0) {
+    frames[slot] = create_event_stream_frame(set,
+                                             client->filter_index,
+                                             &event_counts[slot]);
+  }
+  if (frames[slot] == NULL) {
+    return;
+  }
+
+  if (!client->lagging && client->events_skipped > 0) {
+    queue_skipped_events(client);
+  }
+  queue_message(client, frames[slot], event_counts[slot], now);
+  update_client_lag(client, now);
+  update_write_interest(client);
+}
+
+/*
+ * Sends each of the shard's clients the frame for its format.
+ * frames[format][1] is the compressed one, if there is one.
+ */
+static void send_frame_set(struct sender_shard *shard,
+                           const struct frame_set *set)
+{
+  int ready_counts[FORMAT_COUNT * 2] = {0};
+  struct ws_frame *stream_frames[MAX_EVENT_FILTERS + 1];
+  int stream_event_counts[MAX_EVENT_FILTERS + 1];
+  long long now = time_ms();
+  int i;
+
+  for (i = 0; i < MAX_EVENT_FILTERS + 1; i++) {
+    stream_frames[i] = NULL;
+    stream_event_counts[i] = -1; /* not made yet */
+  }
+
+  for (i = 0; i < shard->connected_count; i++) {
+    struct ws_client *client = shard->clients[i];
+    int kind;
+    struct ws_frame *frame;
+
+    if (client->closing) {
+      continue;
+    }
+
+    if (client->event_stream) {
+      if (set->span_count > 0) {
+        send_event_stream_frame(client,
+                                set,
+                                stream_frames,
+                                stream_event_counts,
+                                now);
+      }
+      continue;
+    }
+
+    kind = client->format * 2
+      + (client->deflate && set->frames[client->format][1] != NULL);
+    frame = set->frames[client->format][kind % 2];
+    if (frame == NULL) {
+      continue;
+    }
+
+    /*
+     * Frames encoded before the client's stream was restarted. Clients
+     * that are catching up count them as skipped, new ones never knew.
+     */
+    if (set->generations[client->format] < client->needed_generation) {
+      if (client->events_skipped > 0) {
+        client->events_skipped += set->event_counts[client->format];
+      }
+      continue;
+    }
+    if (!client->lagging && client->events_skipped > 0) {
+      queue_skipped_events(client);
+    }
+
+    LOG_TRACE("Sending %lu bytes to %s\n",
+              (unsigned long)frame->size, client->address_str);
+    if (shard->send_ring_active
+        && !client->lagging
+        && client->frame_count == 0) {
+      shard->ready_clients[kind * shard->client_slots
+                           + ready_counts[kind]++] = client;
+      continue;
+    }
+
+    queue_message(client, frame, set->event_counts[client->format], now);
+    update_client_lag(client, now);
+    update_write_interest(client);
+  }
+
+  for (i = 0; i < FORMAT_COUNT * 2; i++) {
+    if (ready_counts[i] > 0) {
+      send_message_uring(shard,
+                         set->frames[i / 2][i % 2],
+                         set->event_counts[i / 2],
+                         &shard->ready_clients[i * shard->client_slots],
+                         ready_counts[i],
+                         now);
+    }
+  }
+
+  for (i = 0; i < MAX_EVENT_FILTERS + 1; i++) {
+    ws_frame_unref(stream_frames[i]);
+  }
+}
+
+/*
+ * Writes are driven by the poller, this only deals with clients that have
+ * been lagging for too long.
+ */
+static void check_lagging_clients(struct sender_shard *shard)
+{
+  long long now = time_ms();
+  int i;
+
+  for (i = 0; i < shard->connected_count; i++) {
+    struct ws_client *client = shard->clients[i];
+
+    if (!client->closing && client->lagging) {
+      update_client_lag(client, now);
+      flush_ws_client(client);
+      update_write_interest(client);
+    }
+  }
+}
+
+static bool have_lagging_clients(struct sender_shard *shard)
+{
+  int i;
+
+  for (i = 0; i < shard->connected_count; i++) {
+    if (!shard->clients[i]->closing && shard->clients[i]->lagging) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void frame_set_unref(struct frame_set *set)
+{
+  int i;
+
+  if (ATOMIC_FETCH_ADD(&set->refs, -1) != 1) {
+    return;
+  }
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    ws_frame_unref(set->frames[i][0]);
+    ws_frame_unref(set->frames[i][1]);
+  }
+  free(set);
+}
+
+/*
+ * Passes the frames on to every sender thread that has clients. Shards
+ * whose inbox is full don't get them, their clients are told how many
+ * events they missed once the shard catches up.
+ */
+static void publish_frames(struct ws_frame *frames[FORMAT_COUNT][2])
+{
+  struct message_stream *json_stream = &streams[FORMAT_JSON];
+  struct frame_set *set;
+  int span_count = 0;
+  size_t header_size = 0;
+  int i;
+  int j;
+
+  /* Event streams are cut out of the JSON frame */
+  if (json_stream->record_spans && frames[FORMAT_JSON][0] != NULL) {
+    span_count = json_stream->event_count;
+    header_size = frames[FORMAT_JSON][0]->size - json_stream->message.length;
+  }
+
+  set = (struct frame_set *)malloc(
+    sizeof(*set) + span_count * sizeof(struct event_span));
+  if (set == NULL) {
+    LOG_ERROR("Error allocating frame set: %s\n", xstrerror(ERROR_C, errno));
+  } else {
+    set->refs = 1;
+    set->seq = ++frame_set_seq;
+    set->spans = (struct event_span *)(set + 1);
+    set->span_count = span_count;
+    for (i = 0; i < span_count; i++) {
+      set->spans[i] = json_stream->spans[i];
+      set->spans[i].offset += header_size;
+    }
+    for (i = 0; i < FORMAT_COUNT; i++) {
+      for (j = 0; j < 2; j++) {
+        set->frames[i][j] =
+          frames[i][j] != NULL ? ws_frame_ref(frames[i][j]) : NULL;
+      }
+      set->generations[i] = streams[i].generation;
+      set->event_counts[i] = streams[i].event_count;
+    }
+  }
+
+  for (i = 0; i < sender_shard_count; i++) {
+    struct sender_shard *shard = &sender_shards[i];
+
+    if (ATOMIC_LOAD(&shard->client_count) == 0) {
+      continue;
+    }
+    mutex_lock(&shard->mutex);
+    if (set != NULL && shard->inbox_count < MAX_SHARD_FRAME_SETS) {
+      ATOMIC_INCREMENT(&set->refs);
+      shard->inbox[shard->inbox_count++] = set;
+    } else {
+      for (j = 0; j < FORMAT_COUNT; j++) {
+        if (frames[j][0] != NULL) {
+          shard->missed_events[j] += streams[j].event_count;
+        }
+      }
+    }
+    wake_sender_shard(shard);
+    mutex_unlock(&shard->mutex);
+  }
+
+  if (set != NULL) {
+    frame_set_unref(set);
+  }
+}
+
+/*
+ * Compresses the message for permessage-deflate clients. They all share
+ * one compression context, so repeated queries cost only a few bytes. If
+ * this fails they get the uncompressed frame instead, which the extension
+ * allows.
+ */
+static struct ws_frame *deflate_message(struct message_stream *stream)
+{
+  struct ws_frame *frame = NULL;
+  int error = 0;
+
+  stream->deflated_message.length = 0;
+  if (stream->deflate_reset_pending) {
+    error = deflater_reset(&stream->deflater);
+    stream->deflate_reset_pending = error != 0;
+  }
+  if (error == 0) {
+    error = deflater_compress(&stream->deflater,
+                              stream->message.str,
+                              stream->message.length,
+                              &stream->deflated_message);
+  }
+  if (error == 0) {
+    frame = ws_frame_create(stream->opcode,
+                            stream->deflated_message.str,
+                            stream->deflated_message.length,
+                            WS_FLAG_FINAL | WS_FLAG_RSV1);
+    if (frame == NULL) {
+      error = errno;
+    }
+  }
+  if (error != 0) {
+    LOG_ERROR("Error compressing message: %s\n", xstrerror(ERROR_C, error));
+    stream->deflate_reset_pending = true;
+  }
+  return frame;
+}
+
+/*
+ * Sends the messages being built, if there are any. In batch mode JSON
+ * messages carry an array of events, otherwise a single event object.
+ */
+static void flush_frames(bool batch_frames)
+{
+  struct ws_frame *frames[FORMAT_COUNT][2] = {{NULL}};
+  bool have_frames = false;
+  int i;
+
+  /* Build the frames once, all clients send the same bytes */
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    struct message_stream *stream = &streams[i];
+
+    if (stream->event_count == 0) {
+      continue;
+    }
+    if (i == FORMAT_JSON && batch_frames) {
+      strbuf_append(&stream->message, "]");
+    }
+    frames[i][0] = ws_frame_create(stream->opcode,
+                                   stream->message.str,
+                                   stream->message.length,
+                                   WS_FLAG_FINAL);
+    if (frames[i][0] == NULL) {
+      LOG_ERROR("Error allocating frame: %s\n", xstrerror(ERROR_C, errno));
+      continue;
+    }
+    if (deflate_active && ATOMIC_LOAD(&stream->deflate_client_count) > 0) {
+      frames[i][1] = deflate_message(stream);
+    }
+    have_frames = true;
+  }
+
+  if (have_frames) {
+    publish_frames(frames);
+  }
+
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    ws_frame_unref(frames[i][0]);
+    ws_frame_unref(frames[i][1]);
+    streams[i].message.length = 0;
+    streams[i].event_count = 0;
+  }
+}
+
+/*
+ * Matches the event against the filters of event stream clients. Errors
+ * and results don't say whose statement they belong to, so they go where
+ * the last statement of the same connection went.
+ */
+static uint64_t match_event_filters(const struct event_record *record)
+{
+  struct thread_matches *cached = &thread_matches[
+    record->thread_id & (THREAD_MATCH_CACHE_SIZE - 1)];
+  struct filter_input input;
+  uint64_t matches = 0;
+  int i;
+
+  if (event_filter_count == 0) {
+    return 0;
+  }
+  if (record->type != EVENT_QUERY_START) {
+    return cached->valid && cached->thread_id == record->thread_id
+      ? cached->filter_matches
+      : ~(uint64_t)0;
+  }
+
+  filter_split_user_host(event_get_text(record, EVENT_USER, NULL), &input);
+  input.values[FILTER_DATABASE] = event_get_text(
+    record, EVENT_DATABASE, &input.lengths[FILTER_DATABASE]);
+  input.values[FILTER_COMMAND] = NULL;
+  input.lengths[FILTER_COMMAND] = 0;
+  input.values[FILTER_QUERY] = event_get_text(
+    record, EVENT_QUERY, &input.lengths[FILTER_QUERY]);
+
+  for (i = 0; i < MAX_EVENT_FILTERS; i++) {
+    if (event_filters[i].rules != NULL
+        && ATOMIC_LOAD(&event_filters[i].refs) > 0
+        && filter_match(&event_filters[i].filter, &input)) {
+      matches |= (uint64_t)1 << i;
+    }
+  }
+
+  cached->valid = true;
+  cached->thread_id = record->thread_id;
+  cached->filter_matches = matches;
+  return matches;
+}
+
+static int add_event_span(struct message_stream *stream,
+                          size_t offset,
+                          const struct event_record *record)
+{
+  struct event_span *spans;
+  int capacity;
+
+  if (stream->event_count == stream->span_capacity) {
+    capacity = stream->span_capacity != 0 ? stream->span_capacity * 2 : 64;
+    spans = (struct event_span *)
+      realloc(stream->spans, capacity * sizeof(*spans));
+    if (spans == NULL) {
+      return ENOMEM;
+    }
+    stream->spans = spans;
+    stream->span_capacity = capacity;
+  }
+  spans = &stream->spans[stream->event_count];
+  spans->offset = offset;
+  spans->length = stream->message.length - offset;
+  spans->filter_matches = match_event_filters(record);
+  return 0;
+}
+
+static int encode_json_event(struct message_stream *stream,
+                             const struct event_record *record,
+                             bool batch_frames)
+{
+  size_t mark = stream->message.length;
+  size_t offset;
+  int error = 0;
+
+  if (batch_frames) {
+    error = strbuf_append(&stream->message,
+                          stream->event_count == 0 ? "[" : ", ");
+  }
+  offset = stream->message.length;
+  if (error == 0) {
+    error = event_encode_json(record, &stream->message);
+  }
+  if (error == 0 && stream->record_spans) {
+    error = add_event_span(stream, offset, record);
+  }
+  if (error != 0) {
+    stream->message.length = mark;
+    stream->message.str[mark] = '\0';
+  }
+  return error;
+}
+
+static int encode_binary_event(struct message_stream *stream,
+                               const struct event_record *record)
+{
+  int error = 0;
+
+  if (stream->message.length == 0) {
+    error = event_encoder_begin(&binary_encoder, &stream->message);
+  }
+  if (error == 0) {
+    error = event_encode_binary(&binary_encoder, record, &stream->message);
+  }
+  if (error != 0) {
+    /*
+     * The dictionaries may already have changed, so the events encoded so
+     * far can't be sent and the stream has to start over.
+     */
+    stream->message.length = 0;
+    stream->event_count = 0;
+    binary_encoder.reset = true;
+  }
+  return error;
+}
+
+/*
+ * Starts the stream over if a sender thread has asked for it since the
+ * last time. Only called between messages.
+ */
+static void update_stream_generation(struct message_stream *stream, int format)
+{
+  long generation = ATOMIC_LOAD(&stream->requested_generation);
+
+  if (generation == stream->generation) {
+    return;
+  }
+  stream->generation = generation;
+  stream->deflate_reset_pending = true;
+  if (format == FORMAT_BINARY) {
+    binary_encoder.reset = true;
+  }
+}
+
+/*
+ * Drains the message queue into frames. Called by the server loop whenever
+ * it wakes up.
+ */
+static void process_pending_messages(void)
+{
+  struct event_record *record;
+  int event_count = 0;
+  long long frame_time = 0;
+  bool batch_frames = config_batch_frames;
+  size_t frame_size;
+  long pos;
+  int error;
+  int i;
+
+  while ((record = (struct event_record *)
+      ring_acquire(&message_queue, &pos)) != NULL) {
+    if (ATOMIC_LOAD(&ws_client_count) == 0) {
+      /* Nobody to send it to */
+      event_clear(record);
+      ring_release(&message_queue, pos);
+      continue;
+    }
+
+    frame_size = 0;
+    for (i = 0; i < FORMAT_COUNT; i++) {
+      struct message_stream *stream = &streams[i];
+
+      if (ATOMIC_LOAD(&stream->client_count) == 0) {
+        continue;
+      }
+      if (stream->event_count == 0) {
+        update_stream_generation(stream, i);
+        stream->record_spans = i == FORMAT_JSON
+          && ATOMIC_LOAD(&event_stream_count) > 0;
+      }
+      if (i == FORMAT_BINARY) {
+        error = encode_binary_event(stream, record);
+      } else {
+        error = encode_json_event(stream, record, batch_frames);
+      }
+      if (error != 0) {
+        LOG_ERROR("Error encoding message: %s\n",
+            xstrerror(ERROR_C, error));
+        continue;
+      }
+      stream->event_count++;
+      if (stream->message.length > frame_size) {
+        frame_size = stream->message.length;
+      }
+    }
+    event_clear(record);
+    ring_release(&message_queue, pos);
+
+    if (event_count++ == 0) {
+      frame_time = time_ms();
+    }
+
+    /*
+     * Frames are flushed when they grow past max_frame_size, when they
+     * have been held for flush_interval ms and when the queue runs dry.
+     */
+    if (!batch_frames
+        || frame_size >= (size_t)config_max_frame_size
+        || ((event_count & 15) == 0
+            && time_ms() - frame_time >= config_flush_interval)) {
+      flush_frames(batch_frames);
+      event_count = 0;
+    }
+  }
+  flush_frames(batch_frames);
+}
+
+/*
+ * Connections only count as active when a request is complete, so this is
+ * also how long a client has to send one.
+ */
+static long get_http_idle_limit(void)
+{
+  return config_http_keep_alive_timeout != 0
+    ? config_http_keep_alive_timeout
+    : HTTP_REQUEST_TIMEOUT;
+}
+
+/*
+ * Time until the least recently active HTTP connection times out.
+ */
+static long get_idle_timeout(void)
+{
+  long long timeout;
+
+  if (http_connections_head == NULL) {
+    return -1;
+  }
+  timeout = http_connections_head->last_active_time
+    + get_http_idle_limit()
+    - time_ms();
+  return timeout > 0 ? (long)timeout : 0;
+}
+
+static long get_wait_timeout(void)
+{
+  long idle_timeout = get_idle_timeout();
+  size_t count;
+
+  /*
+   * Producers only wake a sleeping thread right away. A waiting one is woken
+   * once there is a full batch, otherwise it comes back after flush_interval
+   * ms by itself.
+   */
+  ATOMIC_STORE(&server_thread_state, SERVER_SLEEPING);
+  count = ring_count(&message_queue);
+  if (count == 0) {
+    return idle_timeout;
+  }
+  ATOMIC_STORE(&server_thread_state, SERVER_WAITING);
+  if (count >= (size_t)config_batch_size) {
+    return 0;
+  }
+  if (idle_timeout >= 0 && idle_timeout < config_flush_interval) {
+    return idle_timeout;
+  }
+  return config_flush_interval;
+}
+
+static void send_control_frame(struct ws_client *client,
+                               int opcode,
+                               const char *payload,
+                               size_t len)
+{
+  struct ws_frame *frame;
+
+  frame = ws_frame_create(opcode, payload, len, WS_FLAG_FINAL);
+  if (frame == NULL) {
+    return;
+  }
+  if (queue_ws_frame(client, frame)) {
+    flush_ws_client(client);
+    update_write_interest(client);
+  }
+  ws_frame_unref(frame);
+}
+
+static int handle_ws_frame(int opcode,
+                           int flags,
+                           const char *payload,
+                           size_t len,
+                           void *data)
+{
+  struct ws_client *client = (struct ws_client *)data;
+  uint16_t code = WS_CLOSE_NORMAL;
+
+  UNUSED(flags);
+
+  switch (opcode) {
+    case WS_OP_PING:
+      send_control_frame(client, WS_OP_PONG, payload, len);
+      break;
+    case WS_OP_CLOSE:
+      /* Echo the status code back, the parser has checked that it's valid */
+      if (len >= sizeof(code)) {
+        code = (uint16_t)(((uint8_t)payload[0] << 8) | (uint8_t)payload[1]);
+      }
+      close_ws_client(client, code, NULL);
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Passes data received from the client to its frame parser. Returns 0 if
+ * the connection stays open and -1 if it should be closed.
+ */
+static int feed_ws_client(struct ws_client *client, const char *buf, size_t len)
+{
+  int error;
+
+  if (client->event_stream) {
+    return 0; /* nothing to say, anything sent is ignored */
+  }
+  error = ws_parser_feed(&client->parser, buf, len, handle_ws_frame, client);
+  if (error > 0) {
+    LOG("Closing connection to %s: %s\n",
+        client->address_str,
+        ws_error_message(error));
+    close_ws_client(client, WS_CLOSE_PROTOCOL_ERROR, NULL);
+    return -1;
+  }
+  return error != 0 ? -1 : 0;
+}
+
+static int process_ws_message(struct ws_client *client)
+{
+  char buf[4096];
+  int len;
+
+  while (!client->closing) {
+    len = recv(client->socket, buf, sizeof(buf), 0);
+    if (len == 0) {
+      return -1; /* connection closed */
+    }
+    if (len < 0) {
+      if (socket_errno == EWOULDBLOCK || socket_errno == EAGAIN) {
+        return 0;
+      }
+      LOG_ERROR("Could not receive WebSocket data from client %s: %s\n",
+          client->address_str,
+          xstrerror(ERROR_SYSTEM, socket_error));
+      return -1;
+    }
+    if (feed_ws_client(client, buf, (size_t)len) != 0) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+static void on_request_header(const struct http_fragment *name,
+                              const struct http_fragment *value,
+                              void *data)
+{
+  struct http_request_headers *headers = (struct http_request_headers *)data;
+
+  if (name->length == sizeof("Accept-Encoding") - 1
+      && strncasecmp(name->ptr, "Accept-Encoding", name->length) == 0) {
+    headers->accept_encoding = *value;
+  } else if (name->length == sizeof("Connection") - 1
+      && strncasecmp(name->ptr, "Connection", name->length) == 0) {
+    headers->connection = *value;
+  } else if (name->length == sizeof("If-None-Match") - 1
+      && strncasecmp(name->ptr, "If-None-Match", name->length) == 0) {
+    headers->if_none_match = *value;
+  }
+}
+
+/*
+ * Sends the gzip variant of the resource if there is one and the client
+ * accepts it. Tiny files may not get any smaller, those are sent as is.
+ * A client that already has the current version gets just a 304.
+ */
+static void send_resource(struct http_response *response,
+                          const struct http_resource *resource,
+                          const struct http_request_headers *headers,
+                          bool keep_alive)
+{
+  if (headers->if_none_match.ptr != NULL
+      && http_etag_matches(&headers->if_none_match, resource->etag)) {
+    http_format_not_modified(response,
+                             resource->etag,
+                             resource->cache_control,
+                             keep_alive);
+  } else if (resource->gzip_data == NULL
+      || resource->gzip_size >= resource->size) {
+    http_format_content(response,
+                        resource->data,
+                        resource->size,
+                        resource->content_type,
+                        resource->etag,
+                        resource->cache_control,
+                        keep_alive);
+  } else if (http_accepts_encoding(&headers->accept_encoding, "gzip")) {
+    http_format_encoded_content(response,
+                                resource->gzip_data,
+                                resource->gzip_size,
+                                resource->content_type,
+                                "gzip",
+                                resource->etag,
+                                resource->cache_control,
+                                keep_alive);
+  } else {
+    http_format_encoded_content(response,
+                                resource->data,
+                                resource->size,
+                                resource->content_type,
+                                NULL,
+                                resource->etag,
+                                resource->cache_control,
+                                keep_alive);
+  }
+}
+
+/* Answers with 400 and closes the connection once that is sent */
+static int reject_http_request(struct http_connection *connection)
+{
+  http_format_bad_request_error(&connection->response);
+  connection->close_when_sent = true;
+  return 0;
+}
+
+static void free_event_filter(struct event_filter *event_filter)
+{
+  if (event_filter->rules != NULL) {
+    filter_free(&event_filter->filter);
+    free(event_filter->rules);
+    event_filter->rules = NULL;
+    event_filter_count--;
+  }
+}
+
+/*
+ * Finds or compiles the filter for the given rules and takes a reference to
+ * it. The index is -1 if there are no rules. Rules on "command" are refused,
+ * it's not part of the events.
+ */
+static int acquire_event_filter(const char *include,
+                                const char *exclude,
+                                int *index)
+{
+  struct event_filter *event_filter = NULL;
+  char *rules;
+  uint64_t mask;
+  int error;
+  int i;
+
+  *index = -1;
+  if (*include == '\0' && *exclude == '\0') {
+    return 0;
+  }
+
+  rules = (char *)malloc(strlen(include) + strlen(exclude) + 2);
+  if (rules == NULL) {
+    return ENOMEM;
+  }
+  sprintf(rules, "%s\n%s", include, exclude);
+
+  for (i = 0; i < MAX_EVENT_FILTERS; i++) {
+    if (event_filters[i].rules == NULL) {
+      if (event_filter == NULL) {
+        event_filter = &event_filters[i];
+      }
+    } else if (strcmp(event_filters[i].rules, rules) == 0) {
+      free(rules);
+      ATOMIC_INCREMENT(&event_filters[i].refs);
+      *index = i;
+      return 0;
+    } else if (event_filter == NULL
+        && ATOMIC_LOAD(&event_filters[i].refs) == 0) {
+      event_filter = &event_filters[i];
+    }
+  }
+  if (event_filter == NULL) {
+    free(rules);
+    return ENOSPC;
+  }
+
+  free_event_filter(event_filter);
+  filter_init(&event_filter->filter);
+  if ((error = filter_parse_rules(&event_filter->filter, false, include)) != 0
+      || (error = filter_parse_rules(&event_filter->filter,
+                                     true,
+                                     exclude)) != 0
+      || event_filter->filter.include[FILTER_COMMAND].count > 0
+      || event_filter->filter.exclude[FILTER_COMMAND].count > 0
+      || has_unsupported_rules(&event_filter->filter)) {
+    filter_free(&event_filter->filter);
+    free(rules);
+    return error != 0 ? error : EINVAL;
+  }
+  event_filter->rules = rules;
+  event_filter->refs = 1;
+  event_filter_count++;
+  *index = (int)(event_filter - event_filters);
+
+  /* Forget what the slot's previous filter thought of running statements */
+  mask = ~((uint64_t)1 << *index);
+  for (i = 0; i < THREAD_MATCH_CACHE_SIZE; i++) {
+    thread_matches[i].filter_matches &= mask;
+  }
+  return 0;
+}
+
+/*
+ * Starts streaming events as Server-Sent Events. The optional include and
+ * exclude parameters take rules like the variables of the same name, the
+ * events are matched against them before they are sent.
+ */
+static int open_event_stream(struct http_connection *connection,
+                             const struct http_fragment *request_target)
+{
+  static const char *const param_names[] = {"include", "exclude"};
+  char params[2][MAX_HTTP_HEADERS];
+  struct http_fragment value;
+  struct pending_client *pending = &connection->pending;
+  int filter_index;
+  int error;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    params[i][0] = '\0';
+    if (http_get_query_param(request_target, param_names[i], &value)) {
+      http_url_decode(value.ptr, value.length, params[i]);
+    }
+  }
+
+  error = acquire_event_filter(params[0], params[1], &filter_index);
+  if (error != 0) {
+    LOG("Could not set up event stream filter: %s\n",
+        xstrerror(ERROR_C, error));
+    return reject_http_request(connection);
+  }
+
+  http_format_stream_headers(&connection->response, "text/event-stream");
+  memset(pending, 0, sizeof(*pending));
+  pending->sock = connection->sock;
+  pending->options.protocol = -1;
+  pending->event_stream = true;
+  pending->filter_index = filter_index;
+  connection->handing_over = true;
+  return 0;
+}
+
+/*
+ * HTTP/1.1 connections persist unless either side says otherwise, HTTP/1.0
+ * ones only if the client asks for it.
+ */
+static bool keep_connection_alive(const struct http_connection *connection,
+                                  const struct http_request_headers *headers,
+                                  int http_version)
+{
+  if (config_http_keep_alive_timeout == 0
+      || connection->request_count >= config_http_max_requests) {
+    return false;
+  }
+  if (http_version >= 0x0101) {
+    return !http_has_token(&headers->connection, "close");
+  }
+  return http_has_token(&headers->connection, "keep-alive");
+}
+
+/*
+ * Prepares the response to a request whose headers are in connection->buf,
+ * null-terminated. Returns 0 if there is a response to send (which may be
+ * followed by closing the connection or handing it over to a sender thread)
+ * and -1 if the connection should be closed right away.
+ */
+static int process_http_request(struct http_connection *connection,
+                                size_t len)
+{
+  const char *buf = connection->buf;
+  struct http_fragment http_method;
+  struct http_fragment request_target;
+  int http_version;
+  struct http_request_headers headers;
+  const char *header_fields;
+  struct ws_options options;
+  bool keep_alive;
+  int error;
+  size_t i;
+  size_t resource_count = sizeof(http_resources) / sizeof(http_resources[0]);
+
+  connection->request_count++;
+
+  /* WebSocket connections start as HTTP requests on the same port */
+  options.deflate = deflate_active;
+  options.deflate_window_bits = config_deflate_window_bits;
+  options.protocols = config_binary_protocol ? ws_protocols : NULL;
+  options.protocol = -1;
+  error = ws_accept_request(buf, len, &options, &connection->response);
+  if (error == 0) {
+    memset(&connection->pending, 0, sizeof(connection->pending));
+    connection->pending.sock = connection->sock;
+    connection->pending.options = options;
+    connection->pending.filter_index = -1;
+    connection->handing_over = true;
+    return 0;
+  }
+  if (error != WS_ERROR_NO_UPGRADE) {
+    LOG("WebSocket handshake failed: %s\n", ws_error_message(error));
+    return reject_http_request(connection);
+  }
+
+  header_fields = http_parse_request_line(buf,
+                                          &http_method,
+                                          &request_target,
+                                          &http_version);
+  if (header_fields == NULL) {
+    LOG_ERROR("Could not parse HTTP request\n");
+    return -1;
+  }
+
+  memset(&headers, 0, sizeof(headers));
+  http_parse_headers(header_fields, on_request_header, &headers);
+
+  if (http_version > 0x01FF) {
+    LOG_ERROR("Unsupported HTTP version %x\n", http_version);
+    return reject_http_request(connection);
+  }
+
+  if (http_path_length(&request_target) == sizeof("/events") - 1
+      && strncmp(request_target.ptr, "/events", sizeof("/events") - 1) == 0
+      && strncmp(http_method.ptr, "GET", http_method.length) == 0) {
+    return open_event_stream(connection, &request_target);
+  }
+
+  keep_alive = keep_connection_alive(connection, &headers, http_version);
+
+  for (i = 0; i < resource_count; i++) {
+    struct http_resource *resource = &http_resources[i];
+
+    if (strncmp(request_target.ptr,
+                resource->path,
+                request_target.length) == 0) {
+      if (strncmp(http_method.ptr, "GET", http_method.length) == 0) {
+        send_resource(&connection->response, resource, &headers, keep_alive);
+      } else if (strncmp(http_method.ptr, "HEAD", http_method.length) == 0) {
+        http_format_ok(&connection->response, keep_alive);
+      } else {
+        /* There might be a body, which we don't know how to skip */
+        return reject_http_request(connection);
+      }
+      break;
+    }
+  }
+
+  if (i == resource_count) {
+    return reject_http_request(connection);
+  }
+
+  connection->close_when_sent = !keep_alive;
+  return 0;
+}
+
+/*
+ * Moves the connection to the end of the list, it's the most recently
+ * active one now.
+ */
+static void touch_http_connection(struct http_connection *connection)
+{
+  connection->last_active_time = time_ms();
+  if (connection == http_connections_tail) {
+    return;
+  }
+  if (connection->prev != NULL) {
+    connection->prev->next = connection->next;
+  } else if (http_connections_head == connection) {
+    http_connections_head = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->prev = connection->prev;
+  }
+  connection->prev = http_connections_tail;
+  connection->next = NULL;
+  if (http_connections_tail != NULL) {
+    http_connections_tail->next = connection;
+  } else {
+    http_connections_head = connection;
+  }
+  http_connections_tail = connection;
+}
+
+static void update_http_interest(struct http_connection *connection)
+{
+  bool want_write = !http_response_done(&connection->response);
+
+  if (want_write != connection->want_write) {
+    poller_modify(&server_poller,
+                  connection->sock,
+                  want_write ? POLLER_WRITE : POLLER_READ);
+    connection->want_write = want_write;
+  }
+}
+
+/*
+ * Sends as much of the response as the socket takes. Returns 0 if the
+ * connection stays open, 1 if it was handed over to a sender thread and -1
+ * if it should be closed.
+ */
+static int flush_http_connection(struct http_connection *connection)
+{
+  int len;
+  int result;
+
+  if (!http_response_done(&connection->response)) {
+    len = http_send_response(connection->sock, &connection->response);
+    if (len < 0) {
+      LOG_ERROR("Could not send HTTP response: %s\n",
+          xstrerror(ERROR_SYSTEM, socket_error));
+      return -1;
+    }
+    if (len > 0) {
+      touch_http_connection(connection);
+    }
+    if (!http_response_done(&connection->response)) {
+      update_http_interest(connection);
+      return 0;
+    }
+  }
+
+  if (connection->handing_over) {
+    if (connection->length > 0) {
+      /* The client didn't wait for the response, pass on what it sent */
+      connection->pending.early_data = (char *)malloc(connection->length);
+      if (connection->pending.early_data == NULL) {
+        LOG_ERROR("Could not allocate memory for client data\n");
+        return -1;
+      }
+      memcpy(connection->pending.early_data,
+             connection->buf,
+             connection->length);
+      connection->pending.early_length = connection->length;
+    }
+    /* From here on the handover cleans up after itself */
+    connection->handing_over = false;
+    result = hand_over_client(&connection->pending);
+    if (result < 0) {
+      free(connection->pending.early_data);
+      if (connection->pending.event_stream) {
+        release_event_filter(connection->pending.filter_index);
+      }
+    }
+    return result;
+  }
+  if (connection->close_when_sent) {
+    return -1;
+  }
+  update_http_interest(connection);
+  return 0;
+}
+
+/*
+ * Answers the complete requests in the buffer, in order, as long as their
+ * responses go out right away. Partial requests stay in the buffer until
+ * the rest arrives.
+ */
+static int process_http_requests(struct http_connection *connection)
+{
+  size_t request_len;
+  char next_char;
+  int result;
+
+  while (http_response_done(&connection->response)
+         && (request_len = http_scan_headers(&connection->scanner,
+                                             connection->buf,
+                                             connection->length)) != 0) {
+    next_char = connection->buf[request_len];
+    connection->buf[request_len] = '\0';
+    result = process_http_request(connection, request_len);
+    if (result != 0) {
+      return result;
+    }
+    touch_http_connection(connection);
+    connection->buf[request_len] = next_char;
+    connection->length -= request_len;
+    memmove(connection->buf,
+            connection->buf + request_len,
+            connection->length + 1);
+    http_header_scanner_init(&connection->scanner);
+    result = flush_http_connection(connection);
+    if (result != 0) {
+      return result;
+    }
+  }
+
+  if (connection->length == MAX_HTTP_HEADERS) {
+    LOG_ERROR("HTTP request headers are too large\n");
+    reject_http_request(connection);
+    return flush_http_connection(connection);
+  }
+  return 0;
+}
+
+/*
+ * Reads whatever the client has sent and answers it. Nothing is read while
+ * a response is being sent.
+ */
+static int process_http_input(struct http_connection *connection)
+{
+  int len;
+
+  if (!http_response_done(&connection->response)) {
+    return 0;
+  }
+
+  len = recv(connection->sock,
+             connection->buf + connection->length,
+             (int)(MAX_HTTP_HEADERS - connection->length),
+             0);
+  if (len == 0) { /* EOF */
+    return -1;
+  }
+  if (len < 0) {
+    if (socket_errno == EWOULDBLOCK || socket_errno == EAGAIN) {
+      return 0;
+    }
+    LOG_ERROR("Could not receive HTTP request headers: %s\n",
+        xstrerror(ERROR_SYSTEM, socket_error));
+    return -1;
+  }
+  connection->length += (size_t)len;
+  connection->buf[connection->length] = '\0';
+
+  return process_http_requests(connection);
+}
+
+static int open_http_connection(socket_t sock)
+{
+  struct http_connection *connection;
+  int error;
+
+  connection = (struct http_connection *)malloc(sizeof(*connection));
+  if (connection == NULL) {
+    return ENOMEM;
+  }
+  connection->sock = sock;
+  connection->prev = NULL;
+  connection->next = NULL;
+  connection->request_count = 0;
+  http_header_scanner_init(&connection->scanner);
+  connection->length = 0;
+  connection->buf[0] = '\0';
+  memset(&connection->response, 0, sizeof(connection->response));
+  connection->want_write = false;
+  connection->close_when_sent = false;
+  connection->handing_over = false;
+
+  error = socket_map_put(&http_connections, sock, connection);
+  if (error != 0) {
+    free(connection);
+    return error;
+  }
+  touch_http_connection(connection);
+  return 0;
+}
+
+/*
+ * Forgets about the connection, but leaves the socket alone.
+ */
+static void free_http_connection(socket_t sock)
+{
+  struct http_connection *connection;
+
+  connection = (struct http_connection *)
+    socket_map_remove(&http_connections, sock);
+  if (connection == NULL) {
+    return;
+  }
+  if (connection->prev != NULL) {
+    connection->prev->next = connection->next;
+  } else {
+    http_connections_head = connection->next;
+  }
+  if (connection->next != NULL) {
+    connection->next->prev = connection->prev;
+  } else {
+    http_connections_tail = connection->prev;
+  }
+  if (connection->handing_over && connection->pending.event_stream) {
+    release_event_filter(connection->pending.filter_index);
+  }
+  free(connection);
+}
+
+static void close_connection(socket_t sock)
+{
+  LOG_TRACE("Disconnected: %d\n", (int)sock);
+  free_http_connection(sock);
+  poller_remove(&server_poller, sock);
+  close_socket(sock);
+}
+
+static void close_idle_connections(void)
+{
+  long long now;
+
+  now = time_ms();
+  while (http_connections_head != NULL
+      && now - http_connections_head->last_active_time
+          >= get_http_idle_limit()) {
+    close_connection(http_connections_head->sock);
+  }
+}
+
+static void close_client_connection(struct ws_client *client)
+{
+  struct sender_shard *shard = client->shard;
+  socket_t sock = client->socket;
+
+  LOG("Client disconnected: %s\n", client->address_str);
+  free_ws_client(client);
+  LOG_TRACE("Disconnected: %d\n", (int)sock);
+  poller_remove(&shard->poller, sock);
+  close_socket(sock);
+}
+
+static void accept_connections(void)
+{
+  socket_t client_sock;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+
+  /* Accept in a loop until there are no more pending connections */
+  for (;;) {
+    client_addr_len = sizeof(client_addr);
+    client_sock = accept(server_socket,
+                         (struct sockaddr *)&client_addr,
+                         &client_addr_len);
+    if (client_sock == INVALID_SOCKET) {
+      if (socket_errno != EWOULDBLOCK && socket_errno != EAGAIN) {
+        LOG_ERROR("Could not accept connection: %s\n",
+            xstrerror(ERROR_SYSTEM, socket_error));
+      }
+      break;
+    }
+    /* Neither reads nor writes ever wait for a slow client */
+    set_socket_nonblocking(client_sock, true);
+    if (poller_add(&server_poller, client_sock, POLLER_READ) != 0) {
+      LOG_ERROR("Reached connection count limit\n");
+      close_socket(client_sock);
+      continue;
+    }
+    if (open_http_connection(client_sock) != 0) {
+      LOG_ERROR("Could not allocate connection\n");
+      poller_remove(&server_poller, client_sock);
+      close_socket(client_sock);
+      continue;
+    }
+    LOG_TRACE("Connection accepted: %d\n", (int)client_sock);
+  }
+}
+
+static void process_socket_event(const struct poller_event *event)
+{
+  socket_t sock = event->sock;
+  struct http_connection *connection;
+  int result;
+
+  if ((event->events & (POLLER_READ | POLLER_WRITE)) != 0) {
+    connection = (struct http_connection *)
+      socket_map_get(&http_connections, sock);
+    if (connection == NULL) {
+      return;
+    }
+
+    /*
+     * Once a response is out, answer the requests that came in meanwhile.
+     * Readiness is only reported when new data arrives, so keep reading
+     * while there is more. WebSocket connections are handed over to the
+     * sender threads once they are accepted.
+     */
+    result = 0;
+    if ((event->events & POLLER_WRITE) != 0) {
+      result = flush_http_connection(connection);
+      if (result == 0) {
+        result = process_http_requests(connection);
+      }
+    }
+    if (result == 0) {
+      do {
+        result = process_http_input(connection);
+      } while (result == 0
+               && http_response_done(&connection->response)
+               && socket_bytes_available(sock) > 0);
+    }
+    if (result < 0) {
+      close_connection(sock);
+    } else if (result > 0) {
+      free_http_connection(sock);
+    }
+    return;
+  }
+
+  if ((event->events & POLLER_CLOSED) != 0) {
+    close_connection(sock);
+  }
+}
+
+static void process_client_event(struct sender_shard *shard,
+                                 const struct poller_event *event)
+{
+  struct ws_client *client = find_ws_client(shard, event->sock);
+
+  if (client == NULL) {
+    return;
+  }
+
+  if ((event->events & POLLER_WRITE) != 0 && !client->closing) {
+    flush_ws_client(client);
+    if (!client->closing) {
+      update_client_lag(client, time_ms());
+      flush_ws_client(client);
+    }
+    update_write_interest(client);
+  }
+
+  if ((event->events & POLLER_READ) != 0) {
+    if (process_ws_message(client) != 0) {
+      close_client_connection(client);
+    }
+    return;
+  }
+
+  if ((event->events & POLLER_CLOSED) != 0) {
+    close_client_connection(client);
+  }
+}
+
+static void add_pending_client(struct sender_shard *shard,
+                               const struct pending_client *pending)
+{
+  struct ws_client *client;
+  int error;
+
+  error = add_ws_client(shard, pending);
+  if (error == 0) {
+    if (pending->early_data != NULL) {
+      client = find_ws_client(shard, pending->sock);
+      if (feed_ws_client(client,
+                         pending->early_data,
+                         pending->early_length) != 0) {
+        close_client_connection(client);
+      }
+      free(pending->early_data);
+    }
+  } else {
+    free(pending->early_data);
+    LOG("Could not initialize client: %s\n",
+        xstrerror(ERROR_SYSTEM, error));
+    ATOMIC_DECREMENT(&shard->client_count);
+    if (pending->event_stream) {
+      release_event_filter(pending->filter_index);
+      ATOMIC_DECREMENT(&event_stream_count);
+    } else {
+      reject_ws_client(pending->sock);
+    }
+    close_socket(pending->sock);
+  }
+}
+
+/*
+ * Takes new clients and frame sets from the server thread. Frame sets that
+ * didn't fit into the inbox put all clients into summary mode.
+ */
+static void process_shard_inbox(struct sender_shard *shard)
+{
+  struct frame_set *sets[MAX_SHARD_FRAME_SETS];
+  struct pending_client pending[MAX_PENDING_CLIENTS];
+  long long missed_events[FORMAT_COUNT];
+  bool missed = false;
+  long long now;
+  int set_count;
+  int pending_count;
+  int i;
+
+  mutex_lock(&shard->mutex);
+  shard->sleeping = false;
+  set_count = shard->inbox_count;
+  memcpy(sets, shard->inbox, set_count * sizeof(sets[0]));
+  shard->inbox_count = 0;
+  pending_count = shard->pending_count;
+  memcpy(pending, shard->pending, pending_count * sizeof(pending[0]));
+  shard->pending_count = 0;
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    missed_events[i] = shard->missed_events[i];
+    missed = missed || missed_events[i] > 0;
+    shard->missed_events[i] = 0;
+  }
+  mutex_unlock(&shard->mutex);
+
+  if (missed) {
+    now = time_ms();
+    for (i = 0; i < shard->connected_count; i++) {
+      struct ws_client *client = shard->clients[i];
+
+      if (!client->closing
+          && missed_events[client->format] > 0) {
+        skip_events(client, missed_events[client->format], now);
+      }
+    }
+  }
+
+  for (i = 0; i < pending_count; i++) {
+    add_pending_client(shard, &pending[i]);
+  }
+
+  for (i = 0; i < set_count; i++) {
+    send_frame_set(shard, sets[i]);
+    frame_set_unref(sets[i]);
+  }
+}
+
+static long get_shard_wait_timeout(struct sender_shard *shard)
+{
+  long timeout = -1;
+
+  mutex_lock(&shard->mutex);
+  if (shard->inbox_count > 0 || shard->pending_count > 0) {
+    timeout = 0;
+  } else {
+    shard->sleeping = true;
+  }
+  mutex_unlock(&shard->mutex);
+
+  if (timeout != 0 && have_lagging_clients(shard)) {
+    timeout = config_flush_interval;
+  }
+  return timeout;
+}
+
+/*
+ * Delivers frames to the clients of one shard and handles their control
+ * frames. Each sender thread runs this for its own shard.
+ */
+static void run_sender_shard(void *arg)
+{
+  struct sender_shard *shard = (struct sender_shard *)arg;
+  struct poller_event events[MAX_POLLER_EVENTS];
+  int count;
+  int i;
+
+  while (server_active) {
+    count = poller_wait(&shard->poller,
+                        events,
+                        MAX_POLLER_EVENTS,
+                        get_shard_wait_timeout(shard));
+    if (count < 0) {
+      LOG_ERROR("Failed to poll sockets: %s\n",
+          xstrerror(ERROR_SYSTEM, socket_error));
+      break;
+    }
+
+    for (i = 0; i < count; i++) {
+      process_client_event(shard, &events[i]);
+    }
+
+    process_shard_inbox(shard);
+    check_lagging_clients(shard);
+  }
+}
+
+/*
+ * Serves HTTP requests and accepts WebSocket and event stream clients on the
+ * same port, and encodes queued events for the sender threads.
+ */
+static void serve(unsigned short port)
+{
+  socket_t server_sock;
+  struct sockaddr_in server_addr;
+  struct poller_event events[MAX_POLLER_EVENTS];
+  int opt;
+  int result;
+  int count;
+  int i;
+
+  server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (server_sock < 0) {
+    LOG_ERROR("Could not open socket: %s\n",
         xstrerror(ERROR_SYSTEM, socket_error));
-    return -1;
+    return;
   }
-  if (len == 0) { /* EOF */
-    return -1;
+
+  /*
+   * Allow reuse of this socket address (port) without waiting.
+   */
+  opt = 1;
+  setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt));
+
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(port);
+  if (bind(server_sock,
+           (struct sockaddr *)&server_addr,
+           sizeof(server_addr)) != 0) {
+    close_socket(server_sock);
+    LOG_ERROR("Could not bind to port %u: %s\n",
+        port,
+        xstrerror(ERROR_SYSTEM, socket_error));
+    return;
   }
 
-  if (http_parse_request_line(buf,
-                              &http_method,
-                              &request_target,
-                              &http_version) == NULL) {
-    LOG_ERROR("Could not parse HTTP request\n");
-    return -1;
+  if (listen(server_sock, 32) != 0) {
+    close_socket(server_sock);
+    LOG_ERROR("Could not start listening for connections: %s\n",
+        xstrerror(ERROR_SYSTEM, socket_error));
+    return;
   }
 
-  if (http_version > 0x01FF) {
-    LOG_ERROR("Unsupported HTTP version %x\n", http_version);
-    http_send_bad_request_error(sock);
-    return -1;
+  server_socket = server_sock;
+
+  set_socket_nonblocking(server_sock, true);
+  if ((result = poller_add(&server_poller, server_sock, POLLER_READ)) != 0) {
+    LOG_ERROR("Could not watch server socket: %s\n",
+        xstrerror(ERROR_SYSTEM, result));
+    return;
   }
 
-  for (i = 0; i < resource_count; i++) {
-    struct http_resource *resource = &http_resources[i];
+  while (server_active) {
+    count = poller_wait(&server_poller,
+                        events,
+                        MAX_POLLER_EVENTS,
+                        get_wait_timeout());
+    ATOMIC_STORE(&server_thread_state, SERVER_BUSY);
+    if (count < 0) {
+      LOG_ERROR("Failed to poll sockets: %s\n",
+          xstrerror(ERROR_SYSTEM, socket_error));
+      break;
+    }
 
-    if (strncmp(request_target.ptr,
-                resource->path,
-                request_target.length) == 0) {
-      if (strncmp(http_method.ptr, "GET", http_method.length) == 0) {
-        http_send_content(sock,
-                          resource->data,
-                          resource->size,
-                          resource->content_type);
-      } else if (strncmp(http_method.ptr, "HEAD", http_method.length) == 0) {
-        http_send_ok(sock);
+    for (i = 0; i < count; i++) {
+      if (events[i].sock == server_sock) {
+        accept_connections();
       } else {
-        http_send_bad_request_error(sock);
+        process_socket_event(&events[i]);
       }
-      break;
     }
-  }
 
-  if (i == resource_count) {
-    http_send_bad_request_error(sock);
+    close_idle_connections();
+    process_pending_messages();
   }
-
-  return 0;
 }
 
-static void listen_http_connections(void *arg)
+static void listen_connections(void *arg)
 {
   UNUSED(arg);
+  serve((unsigned short)config_http_port);
+}
 
-  LOG("Listening for HTTP connections on port %d\n", config_http_port);
-  serve(
-    "http",
-    config_http_port,
-    &http_server_socket,
-    &http_server_active,
-    process_http_request);
+static int alloc_message_queue(void)
+{
+  return ring_alloc(&message_queue,
+                    MAX_MESSAGE_QUEUE_SIZE,
+                    sizeof(struct event_record));
 }
 
-static int init_ws_client(struct ws_client *client, socket_t sock)
+static void free_message_queue(void)
 {
-  struct sockaddr addr;
-  socklen_t addr_len = sizeof(addr);
-  char ip_str[INET6_ADDRSTRLEN] = {0};
-  int error;
+  struct event_record *record;
+  long pos;
 
-  error = getpeername(sock, &addr, &addr_len);
-  if (error != 0
-      || inet_ntop(addr.sa_family, &addr, ip_str, sizeof(ip_str)) == NULL) {
-    strncpy(ip_str, "(unknown address)", sizeof(ip_str));
-    ip_str[sizeof(ip_str) - 1] = '\0';
+  if (message_queue.slots == NULL) {
+    return;
   }
 
-  error = mutex_create(&client->mutex);
-  if (error != 0) {
-    return error;
+  while ((record = (struct event_record *)
+      ring_acquire(&message_queue, &pos)) != NULL) {
+    event_clear(record);
+    ring_release(&message_queue, pos);
   }
-
-  client->connected = true;
-  client->socket = sock;
-  client->address = addr;
-  client->address_str[0] = '\0';
-  strncpy(client->address_str, ip_str, sizeof(client->address_str));
-  client->address_str[sizeof(client->address_str) - 1] = '\0';
-
-  LOG("Client connected: %s\n", ip_str);
-
-  return 0;
+  ring_free(&message_queue);
 }
 
-static int free_ws_client(struct ws_client *client)
+static int alloc_streams(void)
 {
   int error;
+  int i;
 
-  error = mutex_destroy(&client->mutex);
-  if (error != 0) {
-    return error;
-  }
-
-  if (client->socket != INVALID_SOCKET) {
-    close_socket_nicely(client->socket);
+  event_encoder_init(&binary_encoder);
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    struct message_stream *stream = &streams[i];
+
+    stream->opcode = i == FORMAT_BINARY ? WS_OP_BINARY : WS_OP_TEXT;
+    stream->client_count = 0;
+    stream->deflate_client_count = 0;
+    stream->event_count = 0;
+    stream->deflate_reset_pending = false;
+    stream->record_spans = false;
+    stream->spans = NULL;
+    stream->span_capacity = 0;
+    if ((error = strbuf_alloc(&stream->message, MAX_WS_MESSAGE_LEN)) != 0
+        || (error = strbuf_alloc(&stream->deflated_message,
+                                 MAX_WS_MESSAGE_LEN)) != 0) {
+      return error;
+    }
   }
-
-  memset(client, 0, sizeof(*client));
-  client->socket = INVALID_SOCKET;
-
   return 0;
 }
 
-static int process_ws_request(socket_t sock)
+static int init_stream_deflaters(void)
 {
   int error;
   int i;
-  struct ws_client *client = NULL;
-
-  mutex_lock(&ws_clients_mutex);
-  {
-    for (i = 0; i < MAX_WS_CLIENTS; i++) {
-      if (ws_clients[i].connected && ws_clients[i].socket == sock) {
-        client = &ws_clients[i];
-        break;
-      }
-    }
-  }
-  mutex_unlock(&ws_clients_mutex);
 
-  if (client != NULL) {
-    /* Incoming request from a connected WebSocket client */
-    int opcode;
-    error = ws_recv(sock, &opcode, NULL, NULL, NULL);
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    error = deflater_init(&streams[i].deflater,
+                          config_deflate_level,
+                          config_deflate_window_bits);
     if (error != 0) {
-      LOG_ERROR("Could not receive WebSocket data from client %s: %s\n",
-          client->address_str,
-          xstrerror(ERROR_SYSTEM, socket_error));
-      return -1;
-    }
-    if (opcode == WS_OP_CLOSE) {
-      LOG("Client disconnected: %s\n", client->address_str);
-      free_ws_client(client);
-      return -1;
-    }
-    return 0;
-  }
-
-  error = ws_accept(sock);
-  if (error != 0) {
-    LOG("WebSocket handshake failed\n");
-    return -1;
-  }
-
-  mutex_lock(&ws_clients_mutex);
-  {
-    for (i = 0; i < MAX_WS_CLIENTS; i++) {
-      if (!ws_clients[i].connected) {
-        client = &ws_clients[i];
-        if ((error = init_ws_client(client, sock)) != 0) {
-          LOG("Could not initialize client: %s\n",
-              xstrerror(ERROR_SYSTEM, error));
-          ws_send_close(sock, 0, 0);
-          return -1;
-        }
-        break;
-      }
+      return error;
     }
   }
-  mutex_unlock(&ws_clients_mutex);
-
-  if (client == NULL) {
-    LOG("Client limit reached, closing connection\n");
-    ws_send_close(sock, 0, 0);
-    return -1;
-  }
-
   return 0;
 }
 
-static void listen_ws_connections(void *arg)
+static void free_streams(void)
 {
-  UNUSED(arg);
+  int i;
+
+  for (i = 0; i < FORMAT_COUNT; i++) {
+    strbuf_free(&streams[i].message);
+    strbuf_free(&streams[i].deflated_message);
+    deflater_free(&streams[i].deflater);
+    free(streams[i].spans);
+    streams[i].spans = NULL;
+    streams[i].span_capacity = 0;
+  }
+  event_encoder_reset(&binary_encoder);
 
-  LOG("Listening for WebSocket connections on port %d\n", config_ws_port);
-  serve(
-    "ws",
-    config_ws_port,
-    &ws_server_socket,
-    &ws_server_active,
-    process_ws_request);
+  for (i = 0; i < MAX_EVENT_FILTERS; i++) {
+    free_event_filter(&event_filters[i]);
+  }
+  memset(thread_matches, 0, sizeof(thread_matches));
 }
 
-static void send_event(const struct mysql_event_general *event_general)
+/*
+ * Splits max_connections evenly between sender_threads shards.
+ */
+static int alloc_sender_shards(void)
 {
-  bool ignore = false;
+  int max_clients;
   int error;
-  struct strbuf json;
+  int i;
 
-  mutex_lock(&message_queue_mutex);
-  {
-    if (pending_message_count >= MAX_MESSAGE_QUEUE_SIZE) {
-      ignore = true;
-    }
+  sender_shard_count = config_sender_threads;
+  sender_shards = (struct sender_shard *)
+    calloc(sender_shard_count, sizeof(*sender_shards));
+  if (sender_shards == NULL) {
+    sender_shard_count = 0;
+    return errno;
   }
-  mutex_unlock(&message_queue_mutex);
 
-  if (ignore) {
-    LOG_TRACE("Ignoring event because of message queue overflow");
-    return;
-  }
+  max_clients = (config_max_connections + sender_shard_count - 1)
+    / sender_shard_count;
+  for (i = 0; i < sender_shard_count; i++) {
+    struct sender_shard *shard = &sender_shards[i];
+
+    shard->max_clients = max_clients;
+    socket_map_init(&shard->client_map);
+    mutex_create(&shard->mutex);
+    if ((error = poller_create(&shard->poller, max_clients)) != 0) {
+      mutex_destroy(&shard->mutex);
+      sender_shard_count = i; /* only free the ones set up so far */
+      return error;
+    }
 
-  error = strbuf_alloc(&json, MAX_WS_MESSAGE_LEN);
-  if (error != 0) {
-    LOG_ERROR("Error allocating message JSON buffer",
-      xstrerror(ERROR_SYSTEM, error));
-    return;
+    if (config_use_io_uring) {
+      /* Larger sends are split into several submissions */
+      error = uring_init(&shard->send_ring,
+                         max_clients < MAX_URING_ENTRIES
+                           ? max_clients
+                           : MAX_URING_ENTRIES);
+      if (error == 0) {
+        shard->send_ring_active = true;
+      } else if (i == 0) {
+        LOG("io_uring is not available, using send(): %s\n",
+            xstrerror(ERROR_SYSTEM, error));
+      }
+    }
   }
+  return 0;
+}
 
-  strbuf_append(&json, "{");
+static int start_sender_threads(void)
+{
+  char name[32];
+  int error;
+  int i;
 
-  switch (event_general->event_subclass) {
-    case MYSQL_AUDIT_GENERAL_LOG: {
-      const char *query_str =
-        CSTR(event_general->general_query) != NULL
-          ? CSTR(event_general->general_query)
-          : CSTR(event_general->general_command);
-      json_encode(&json,
-        "\"type\": %s, ", "query_start");
-      json_encode(&json,
-        "\"user\": %s, ", CSTR(event_general->general_user));
-      json_encode(&json,
-        "\"query\": %s, ", query_str);
-      json_encode(&json,
-        "\"time\": %L, ", time_ms());
-      json_encode(&json,
-        "\"rows\": %L, ", event_general->general_rows);
-#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
-      json_encode(&json,
-        "\"query_id\": %L, ", event_general->query_id);
-      json_encode(&json,
-        "\"database\": %s", *(const char * const *)&event_general->database);
-#else
-      json_encode(&json,
-        "\"query_id\": %l", ATOMIC_INCREMENT(&query_id_counter));
-#endif
-      break;
+  for (i = 0; i < sender_shard_count; i++) {
+    struct sender_shard *shard = &sender_shards[i];
+
+    error = thread_create(&shard->thread, run_sender_shard, shard);
+    if (error != 0) {
+      return error;
     }
-    case MYSQL_AUDIT_GENERAL_ERROR:
-      json_encode(&json,
-        "\"type\": %s, ", "query_error");
-#if defined MariaDB_PLUGIN_MATURITY_STABLE && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
-      json_encode(&json,
-        "\"query_id\": %L, ", event_general->query_id);
-#endif
-      json_encode(&json,
-        "\"time\": %L, ", time_ms());
-      json_encode(&json,
-        "\"error_code\": %i, ", event_general->general_error_code);
-      json_encode(&json,
-        "\"error_message\": %s", CSTR(event_general->general_command));
-      break;
-    case MYSQL_AUDIT_GENERAL_RESULT:
-      json_encode(&json,
-        "\"type\": %s, ", "query_result");
-#if TARGET_MARIADB && MYSQL_AUDIT_INTERFACE_VERSION >= 0x0302
-      json_encode(&json,
-        "\"query_id\": %L, ", event_general->query_id);
-#endif
-      json_encode(&json,
-        "\"time\": %L, ", time_ms());
-      json_encode(&json,
-        "\"rows\": %L", event_general->general_rows);
-      break;
+    shard->thread_started = true;
+    snprintf(name, sizeof(name), "logger_send_%d", i);
+    thread_set_name(shard->thread, name);
   }
+  return 0;
+}
+
+static void stop_sender_threads(void)
+{
+  int i;
 
-  strbuf_append(&json, "}");
+  for (i = 0; i < sender_shard_count; i++) {
+    struct sender_shard *shard = &sender_shards[i];
 
-  mutex_lock(&message_queue_mutex);
-  {
-    struct ws_message *message = (struct ws_message *)malloc(sizeof(*message));
-    if (message != NULL) {
-      message->message = json;
-      message->next = NULL;
-      if (message_queue_tail != NULL) {
-        message_queue_tail->next = message;
-      }
-      message_queue_tail = message;
-      if (message_queue == NULL) {
-        message_queue = message;
-      }
-      pending_message_count++;
-    } else {
-      LOG_ERROR("Error allocating message: %s\n",
-        xstrerror(ERROR_SYSTEM, errno));
+    if (shard->thread_started) {
+      poller_wakeup(&shard->poller);
+      thread_join(shard->thread);
+      shard->thread_started = false;
     }
   }
-  mutex_unlock(&message_queue_mutex);
 }
 
-static void process_pending_messages(void *arg)
+static void free_sender_shards(void)
 {
-  struct ws_message *message;
   int i;
+  int j;
 
-  UNUSED(arg);
-
-  while (messaging_active) {
-    thread_sleep(10); /* sleep for 10 ms */
+  for (i = 0; i < sender_shard_count; i++) {
+    struct sender_shard *shard = &sender_shards[i];
 
-    if (message_queue == NULL) {
-      continue;
+    for (j = 0; j < shard->inbox_count; j++) {
+      frame_set_unref(shard->inbox[j]);
     }
-
-    mutex_lock(&message_queue_mutex);
-    {
-      message = message_queue;
-      message_queue = message->next;
-      message->next = NULL;
-      if (message_queue_tail == message) {
-        message_queue_tail = NULL; /* last message */
-      }
-      pending_message_count--;
-    }
-    mutex_unlock(&message_queue_mutex);
-
-    for (i = 0; i < MAX_WS_CLIENTS; i++) {
-      struct ws_client *client = &ws_clients[i];
-
-      if (client->connected) {
-        int result;
-
-        mutex_lock(&client->mutex);
-        {
-          LOG_TRACE("Sending message %s to %s\n",
-                    message->message.str, client->address_str);
-          result = ws_send_text(client->socket,
-                                message->message.str,
-                                WS_FLAG_FINAL,
-                                0);
-          if (result <= 0) {
-            LOG_ERROR("Failed to send message to %s: %s\n",
-                client->address_str,
-                xstrerror(ERROR_SYSTEM, socket_error));
-            free_ws_client(client);
-            client = NULL;
-          }
-        }
-        if (client != NULL) {
-          mutex_unlock(&client->mutex);
-        }
-      }
+    for (j = 0; j < shard->pending_count; j++) {
+      free(shard->pending[j].early_data);
+      close_socket_nicely(shard->pending[j].sock);
+    }
+    while (shard->connected_count > 0) {
+      socket_t sock = shard->clients[0]->socket;
+      free_ws_client(shard->clients[0]);
+      close_socket_nicely(sock);
     }
+    if (shard->send_ring_active) {
+      uring_free(&shard->send_ring);
+    }
+    free(shard->clients);
+    free(shard->ready_clients);
+    free(shard->sends);
+    socket_map_free(&shard->client_map);
+    poller_destroy(&shard->poller);
+    mutex_destroy(&shard->mutex);
+  }
+  free(sender_shards);
+  sender_shards = NULL;
+  sender_shard_count = 0;
+}
+
+/*
+ * What logger_plugin_init() has set up so far, in order.
+ */
+enum init_stage {
+  INIT_FILTER,
+  INIT_STAGING,
+  INIT_MESSAGE_QUEUE,
+  INIT_STREAMS,
+  INIT_SERVER_POLLER,
+  INIT_SENDER_SHARDS,
+  INIT_SENDER_THREADS
+};
 
-    strbuf_free(&message->message);
-    free(message);
+/*
+ * Undoes the setup up to and including the given stage, in reverse order.
+ */
+static void free_plugin_state(enum init_stage stage)
+{
+  switch (stage) {
+    case INIT_SENDER_THREADS:
+      server_active = false;
+      stop_sender_threads();
+      /* fall through */
+    case INIT_SENDER_SHARDS:
+      free_sender_shards();
+      /* fall through */
+    case INIT_SERVER_POLLER:
+      poller_destroy(&server_poller);
+      /* fall through */
+    case INIT_STREAMS:
+      free_streams();
+      /* fall through */
+    case INIT_MESSAGE_QUEUE:
+      free_message_queue();
+      /* fall through */
+    case INIT_STAGING:
+      /*
+       * Other threads' buffers are still referenced by the key; delete it
+       * first so that their destructors don't run after the buffers are
+       * gone.
+       */
+      thread_key_delete(staging_key);
+      free_event_staging();
+      mutex_destroy(&staging_mutex);
+      /* fall through */
+    case INIT_FILTER:
+      filter_free(&capture_filter);
+      break;
   }
 }
 
 static int logger_plugin_init(void *arg)
 {
   int error;
+  enum overflow_policy overflow_policy;
 
   UNUSED(arg);
 
@@ -704,35 +3289,111 @@ static int logger_plugin_init(void *arg)
 
   LOG("Logger plugin is initializing...\n");
 
-  mutex_create(&ws_clients_mutex);
-  mutex_create(&message_queue_mutex);
+  overflow_policy = OVERFLOW_DROP_NEWEST;
+  if (config_overflow_policy != NULL) {
+    size_t i;
+    for (i = 0; i < COUNT_OF(overflow_policy_names); i++) {
+      if (strcmp(config_overflow_policy, overflow_policy_names[i]) == 0) {
+        overflow_policy = (enum overflow_policy)i;
+        break;
+      }
+    }
+    if (i == COUNT_OF(overflow_policy_names)) {
+      LOG("Unknown overflow policy \"%s\", using \"%s\"\n",
+          config_overflow_policy,
+          overflow_policy_names[overflow_policy]);
+    }
+  }
+  publisher_init(&publisher, &message_queue, overflow_policy, wait_for_queue);
+
+  filter_init(&capture_filter);
+  if ((error = filter_parse_rules(&capture_filter,
+                                  false,
+                                  config_include)) != 0
+      || (error = filter_parse_rules(&capture_filter,
+                                     true,
+                                     config_exclude)) != 0) {
+    LOG("Invalid filter rules: %s\n", xstrerror(ERROR_C, error));
+    free_plugin_state(INIT_FILTER);
+    return error;
+  }
+  if (has_unsupported_rules(&capture_filter)) {
+    LOG("Filter rules on database are only supported on MariaDB\n");
+    free_plugin_state(INIT_FILTER);
+    return EINVAL;
+  }
+
+  sampler_init(&sampler);
+  socket_map_init(&http_connections);
+
+  error = thread_key_create(&staging_key, release_event_staging);
+  if (error != 0) {
+    LOG("Could not create thread key: %s\n",
+        xstrerror(ERROR_SYSTEM, error));
+    free_plugin_state(INIT_FILTER);
+    return error;
+  }
+  mutex_create(&staging_mutex);
+
+  error = alloc_message_queue();
+  if (error != 0) {
+    LOG("Could not allocate message queue: %s\n",
+        xstrerror(ERROR_C, error));
+    free_plugin_state(INIT_MESSAGE_QUEUE);
+    return error;
+  }
+
+  error = alloc_streams();
+  if (error != 0) {
+    LOG("Could not allocate message buffers: %s\n",
+        xstrerror(ERROR_C, error));
+    free_plugin_state(INIT_STREAMS);
+    return error;
+  }
+
+  /* One more for the listening socket */
+  error = poller_create(&server_poller, config_max_connections + 1);
+  if (error != 0) {
+    LOG("Could not create poller: %s\n", xstrerror(ERROR_SYSTEM, error));
+    free_plugin_state(INIT_STREAMS);
+    return error;
+  }
+
+  deflate_active = false;
+  if (config_deflate) {
+    error = init_stream_deflaters();
+    if (error == 0) {
+      deflate_active = true;
+    } else {
+      LOG("Compression is not available: %s\n", xstrerror(ERROR_C, error));
+    }
+  }
 
-  http_server_active = true;
-  error = thread_create(&http_server_thread, listen_http_connections, NULL);
+  error = alloc_sender_shards();
   if (error != 0) {
-    LOG("Failed to create HTTP server thread: %s\n",
+    LOG("Could not allocate sender threads: %s\n",
         xstrerror(ERROR_SYSTEM, error));
+    free_plugin_state(INIT_SENDER_SHARDS);
     return error;
   }
-  thread_set_name(ws_server_thread, "logger_http_server_thread");
 
-  ws_server_active = true;
-  error = thread_create(&ws_server_thread, listen_ws_connections, NULL);
+  server_active = true;
+  error = start_sender_threads();
   if (error != 0) {
-    LOG("Failed to create WebSocket server thread: %s\n",
+    LOG("Failed to create sender thread: %s\n",
         xstrerror(ERROR_SYSTEM, error));
+    free_plugin_state(INIT_SENDER_THREADS);
     return error;
   }
-  thread_set_name(ws_server_thread, "logger_ws_server_thread");
 
-  messaging_active = true;
-  error = thread_create(&message_thread, process_pending_messages, NULL);
+  error = thread_create(&server_thread, listen_connections, NULL);
   if (error != 0) {
-    LOG("Failed to create messaging thread: %s\n",
+    LOG("Failed to create server thread: %s\n",
         xstrerror(ERROR_SYSTEM, error));
+    free_plugin_state(INIT_SENDER_THREADS);
     return error;
   }
-  thread_set_name(message_thread, "logger_message_thread");
+  thread_set_name(server_thread, "logger_server_thread");
 
   LOG("Logger plugin started successfully\n");
 
@@ -741,52 +3402,21 @@ static int logger_plugin_init(void *arg)
 
 static int logger_plugin_deinit(void *arg)
 {
-  int i;
-
   UNUSED(arg);
 
   LOG("Logger plugin is being deinitialized...\n");
 
-  http_server_active = false;
-  thread_join(http_server_thread);
-  if (http_server_socket != INVALID_SOCKET) {
-    close_socket_nicely(http_server_socket);
-  }
-
-  ws_server_active = false;
-  thread_join(ws_server_thread);
-  if (ws_server_socket != INVALID_SOCKET) {
-    close_socket_nicely(ws_server_socket);
-  }
-
-  mutex_lock(&message_queue_mutex);
-  {
-    while (message_queue != NULL) {
-      struct ws_message *message = message_queue;
-      message_queue = message->next;
-      strbuf_free(&message->message);
-      free(message);
-    }
-    message_queue_tail = NULL;
+  server_active = false;
+  poller_wakeup(&server_poller);
+  thread_join(server_thread);
+  if (server_socket != INVALID_SOCKET) {
+    close_socket_nicely(server_socket);
   }
-  mutex_unlock(&message_queue_mutex);
-
-  messaging_active = false;
-  thread_join(message_thread);
-
-  mutex_lock(&ws_clients_mutex);
-  {
-    for (i = 0; i < MAX_WS_CLIENTS; i++) {
-      struct ws_client *client = &ws_clients[i];
-      if (client->connected) {
-        free_ws_client(client);
-      }
-    }
+  while (http_connections_head != NULL) {
+    close_connection(http_connections_head->sock);
   }
-  mutex_unlock(&ws_clients_mutex);
-
-  mutex_destroy(&ws_clients_mutex);
-  mutex_destroy(&message_queue_mutex);
+  socket_map_free(&http_connections);
+  free_plugin_state(INIT_SENDER_THREADS);
 
   fclose(log_file);
 
@@ -803,15 +3433,79 @@ logger_notify(MYSQL_THD thd,
               mysql_event_class_t event_class,
               const void *event)
 {
-  if (event_class == MYSQL_AUDIT_GENERAL_CLASS) {
+  struct event_staging *staging;
+
+  /*
+   * Don't spend any time on events that nobody is going to see. This check
+   * is just a load of a rarely written variable, so the plugin costs next
+   * to nothing while there are no clients. Events staged before the last
+   * client left would never be published, so they are dropped here.
+   */
+  if (!config_always_capture && ATOMIC_LOAD(&ws_client_count) == 0) {
+    staging = (struct event_staging *)thread_key_get(staging_key);
+    if (staging != NULL
+        && (staging->count > 0 || staging->statement_held)) {
+      clear_staged_events(staging);
+    }
+#if MYSQL_AUDIT_INTERFACE_VERSION >= 0x0400
+    return 0;
+#else
+    return;
+#endif
+  }
+
+  staging = get_event_staging();
+  if (staging != NULL && event_class == MYSQL_AUDIT_GENERAL_CLASS) {
     const struct mysql_event_general *
         event_general = (const struct mysql_event_general *)event;
     int event_subclass = event_general->event_subclass;
     switch (event_subclass) {
       case MYSQL_AUDIT_GENERAL_LOG:
+        /*
+         * Filters are evaluated once per statement, before anything is
+         * copied. The error and result events that follow share the
+         * decision.
+         */
+        if (staging->statement_held) {
+          discard_held_statement(staging);
+        }
+        staging->skip_statement =
+          !capture_filter.empty && !filter_event(event_general);
+        if (!staging->skip_statement) {
+          if (sample_statement(staging, event_general)) {
+            send_event(staging, event_general);
+          } else {
+            /* It never reaches the queue unless it fails */
+            ATOMIC_FETCH_ADD64(&statements_sampled_out, 1);
+            hold_statement(staging, event_general);
+          }
+        }
+        break;
       case MYSQL_AUDIT_GENERAL_ERROR:
+        if (staging->statement_held) {
+          release_held_statement(staging, event_general);
+        }
+        if (!staging->skip_statement) {
+          send_event(staging, event_general);
+        }
+        break;
       case MYSQL_AUDIT_GENERAL_RESULT:
-        send_event(event_general);
+        if (staging->statement_held) {
+          if (event_general->general_error_code != 0) {
+            release_held_statement(staging, event_general);
+          } else {
+            discard_held_statement(staging);
+          }
+        }
+        if (!staging->skip_statement) {
+          send_event(staging, event_general);
+        }
+        break;
+      case MYSQL_AUDIT_GENERAL_STATUS:
+        /* The statement is done, don't let its events linger */
+        if (staging->count > 0) {
+          publish_staged_events(staging);
+        }
         break;
     }
   }
@@ -834,17 +3528,168 @@ static struct st_mysql_audit logger_descriptor = {
 };
 
 static MYSQL_SYSVAR_INT(http_port, config_http_port,
-  PLUGIN_VAR_RQCMDARG, "Logger's HTTP server port (for the web UI)",
+  PLUGIN_VAR_RQCMDARG,
+  "Logger's HTTP server port (for the web UI and WebSocket connections)",
   NULL, NULL, MYSQL_LOGGER_PORT, 1, 65536, 0);
 
 static MYSQL_SYSVAR_INT(ws_port, config_ws_port,
-  PLUGIN_VAR_RQCMDARG, "Port for WebSocket connections to logger",
+  PLUGIN_VAR_RQCMDARG,
+  "Deprecated and ignored, WebSocket connections are accepted on http_port",
   NULL, NULL, MYSQL_LOGGER_PORT + 1, 1, 65536, 0);
 
+static MYSQL_SYSVAR_INT(max_connections, config_max_connections,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Maximum number of open connections per server (HTTP and WebSocket)",
+  NULL, NULL, 256, 1, 65536, 0);
+
+static MYSQL_SYSVAR_INT(http_keep_alive_timeout,
+  config_http_keep_alive_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Time (in milliseconds) after which an idle HTTP connection is closed; "
+  "0 = close connections after each request",
+  NULL, NULL, 5000, 0, 3600 * 1000, 0);
+
+static MYSQL_SYSVAR_INT(http_max_requests, config_http_max_requests,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum number of requests served over one HTTP connection",
+  NULL, NULL, 100, 1, 1000000, 0);
+
+static MYSQL_SYSVAR_INT(sender_threads, config_sender_threads,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Number of threads sending events to WebSocket clients, each one serving "
+  "its own share of max_connections",
+  NULL, NULL, 2, 1, MAX_SENDER_THREADS, 0);
+
 static MYSQL_SYSVAR_BOOL(trace, config_trace,
   PLUGIN_VAR_RQCMDARG, "Enable verbose logging",
   NULL, NULL, false);
 
+static MYSQL_SYSVAR_INT(staging_size, config_staging_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Number of events each server thread collects before publishing them "
+  "(they are also published when a statement completes); 1 = no staging",
+  NULL, NULL, 1, 1, MAX_STAGED_EVENTS, 0);
+
+static MYSQL_SYSVAR_STR(overflow_policy, config_overflow_policy,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "What to do with new events when the queue is full: drop_newest, "
+  "drop_oldest, sample (thin out events once the queue is half full) or "
+  "block (wait up to block_timeout ms for free space)",
+  NULL, NULL, "drop_newest");
+
+static MYSQL_SYSVAR_INT(block_timeout, config_block_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum time (in milliseconds) a query may wait for free space in the "
+  "queue with the \"block\" overflow policy",
+  NULL, NULL, 10, 1, 10000, 0);
+
+static MYSQL_SYSVAR_STR(include, config_include,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Capture only statements matching these comma-separated rules: "
+  "user:<name>, database:<name>, host:<name or IP>, command:<name> or "
+  "query:<prefix>; rules for different fields must all match. database "
+  "rules are only supported on MariaDB, elsewhere the plugin won't start",
+  NULL, NULL, NULL);
+
+static MYSQL_SYSVAR_STR(exclude, config_exclude,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Don't capture statements matching any of these comma-separated rules "
+  "(same syntax and restrictions as include)",
+  NULL, NULL, NULL);
+
+static MYSQL_SYSVAR_BOOL(always_capture, config_always_capture,
+  PLUGIN_VAR_RQCMDARG,
+  "Capture events even when no WebSocket clients are connected",
+  NULL, NULL, false);
+
+static MYSQL_SYSVAR_INT(flush_interval, config_flush_interval,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum time (in milliseconds) an event may wait before being sent",
+  NULL, NULL, 10, 1, 10000, 0);
+
+static MYSQL_SYSVAR_INT(batch_size, config_batch_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Number of pending events that wakes up the sender before flush_interval",
+  NULL, NULL, 64, 1, MAX_MESSAGE_QUEUE_SIZE, 0);
+
+static MYSQL_SYSVAR_BOOL(batch_frames, config_batch_frames,
+  PLUGIN_VAR_RQCMDARG,
+  "Send events to WebSocket clients in batches, as JSON arrays, instead "
+  "of one frame per event",
+  NULL, NULL, true);
+
+static MYSQL_SYSVAR_INT(max_frame_size, config_max_frame_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Size (in bytes) at which a batch of events is sent without waiting "
+  "for more",
+  NULL, NULL, 64 * 1024, 1024, MAX_WS_FRAME_SIZE, 0);
+
+static MYSQL_SYSVAR_BOOL(use_io_uring, config_use_io_uring,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Send events to all WebSocket clients with a single io_uring system call "
+  "(Linux 5.6 or later, send() is used where it's not available)",
+  NULL, NULL, false);
+
+static MYSQL_SYSVAR_BOOL(deflate, config_deflate,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Compress events for WebSocket clients that support permessage-deflate",
+  NULL, NULL, true);
+
+static MYSQL_SYSVAR_BOOL(binary_protocol, config_binary_protocol,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Let WebSocket clients ask for the compact binary encoding of events "
+  "(Sec-WebSocket-Protocol: " BINARY_PROTOCOL ")",
+  NULL, NULL, true);
+
+static MYSQL_SYSVAR_INT(deflate_level, config_deflate_level,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Compression level, from 1 (fastest) to 9 (smallest output)",
+  NULL, NULL, 6, 1, 9, 0);
+
+static MYSQL_SYSVAR_INT(deflate_window_bits, config_deflate_window_bits,
+  PLUGIN_VAR_RQCMDARG | PLUGIN_VAR_READONLY,
+  "Base two logarithm of the compression window size; larger windows find "
+  "more repetitions but take more memory on the server and in browsers",
+  NULL, NULL, DEFLATE_MAX_WINDOW_BITS,
+  DEFLATE_MIN_WINDOW_BITS, DEFLATE_MAX_WINDOW_BITS, 0);
+
+static MYSQL_SYSVAR_INT(client_queue_size, config_client_queue_size,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum amount of data (in bytes) waiting to be sent to a WebSocket "
+  "client; slower clients stop getting events until they catch up and "
+  "then get a count of the events they missed",
+  NULL, NULL, 4 * 1024 * 1024, 64 * 1024, 1024 * 1024 * 1024, 0);
+
+static MYSQL_SYSVAR_INT(client_lag_timeout, config_client_lag_timeout,
+  PLUGIN_VAR_RQCMDARG,
+  "Time (in milliseconds) after which a client that can't catch up is "
+  "disconnected; 0 = never",
+  NULL, NULL, 10000, 0, 3600 * 1000, 0);
+
+static MYSQL_SYSVAR_INT(sample_rate, config_sample_rate,
+  PLUGIN_VAR_RQCMDARG,
+  "Capture one in this many statements (failed statements are always "
+  "captured); 1 = capture all",
+  NULL, NULL, 1, 1, 1000000, 0);
+
+static MYSQL_SYSVAR_BOOL(adaptive_sampling, config_adaptive_sampling,
+  PLUGIN_VAR_RQCMDARG,
+  "Sample more aggressively as the queue fills up, doubling sample_rate "
+  "for every 1/8 of the queue filled above the first quarter",
+  NULL, NULL, true);
+
+static MYSQL_SYSVAR_INT(user_rate_limit, config_user_rate_limit,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum number of statements per second captured for each user; "
+  "0 = unlimited",
+  NULL, NULL, 0, 0, 1000000, 0);
+
+static MYSQL_SYSVAR_INT(database_rate_limit, config_database_rate_limit,
+  PLUGIN_VAR_RQCMDARG,
+  "Maximum number of statements per second captured for each database "
+  "(MariaDB only); 0 = unlimited",
+  NULL, NULL, 0, 0, 1000000, 0);
+
 #if MYSQL_AUDIT_INTERFACE_VERSION >= 0x0400
 static struct SYS_VAR *logger_sys_vars[] = {
 #else
@@ -852,10 +3697,55 @@ static struct st_mysql_sys_var *logger_sys_vars[] = {
 #endif
   MYSQL_SYSVAR(http_port),
   MYSQL_SYSVAR(ws_port),
+  MYSQL_SYSVAR(max_connections),
+  MYSQL_SYSVAR(http_keep_alive_timeout),
+  MYSQL_SYSVAR(http_max_requests),
+  MYSQL_SYSVAR(sender_threads),
   MYSQL_SYSVAR(trace),
+  MYSQL_SYSVAR(always_capture),
+  MYSQL_SYSVAR(flush_interval),
+  MYSQL_SYSVAR(batch_size),
+  MYSQL_SYSVAR(staging_size),
+  MYSQL_SYSVAR(overflow_policy),
+  MYSQL_SYSVAR(block_timeout),
+  MYSQL_SYSVAR(include),
+  MYSQL_SYSVAR(exclude),
+  MYSQL_SYSVAR(batch_frames),
+  MYSQL_SYSVAR(max_frame_size),
+  MYSQL_SYSVAR(use_io_uring),
+  MYSQL_SYSVAR(deflate),
+  MYSQL_SYSVAR(binary_protocol),
+  MYSQL_SYSVAR(deflate_level),
+  MYSQL_SYSVAR(deflate_window_bits),
+  MYSQL_SYSVAR(client_queue_size),
+  MYSQL_SYSVAR(client_lag_timeout),
+  MYSQL_SYSVAR(sample_rate),
+  MYSQL_SYSVAR(adaptive_sampling),
+  MYSQL_SYSVAR(user_rate_limit),
+  MYSQL_SYSVAR(database_rate_limit),
   NULL
 };
 
+static struct st_mysql_show_var logger_status_vars[] = {
+  STATUS_VAR("Logger_events_queued",
+             &publisher.events_queued,
+             SHOW_LONGLONG),
+  STATUS_VAR("Logger_events_dropped",
+             &publisher.events_dropped,
+             SHOW_LONGLONG),
+  STATUS_VAR("Logger_bytes_dropped",
+             &publisher.bytes_dropped,
+             SHOW_LONGLONG),
+  STATUS_VAR("Logger_queue_high_water",
+             &publisher.queue_high_water,
+             SHOW_LONG),
+  STATUS_VAR("Logger_statements_sampled_out",
+             &statements_sampled_out,
+             SHOW_LONGLONG),
+  STATUS_VAR("Logger_clients_evicted", &clients_evicted, SHOW_LONGLONG),
+  STATUS_VAR(NULL, NULL, SHOW_UNDEF)
+};
+
 #define NAME "LOGGER"
 #define AUTHOR "Sergey Zolotarev"
 #define DESCRIPTION "Nice query logger"
@@ -875,7 +3765,7 @@ maria_declare_plugin(logger) {
 #endif
   logger_plugin_deinit,
   0x0100,
-  NULL,
+  logger_status_vars,
   logger_sys_vars,
   "1.0",
   MariaDB_PLUGIN_MATURITY_GAMMA
@@ -897,7 +3787,7 @@ mysql_declare_plugin(logger) {
 #endif
     logger_plugin_deinit,
     0x0100,
-    NULL,
+    logger_status_vars,
     logger_sys_vars,
     NULL,
     0
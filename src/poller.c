@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+#include "poller.h"
+
+#ifdef POLLER_EPOLL
+
+static uint32_t to_epoll_events(unsigned int events)
+{
+  uint32_t epoll_events = EPOLLET | EPOLLRDHUP;
+
+  if ((events & POLLER_READ) != 0) {
+    epoll_events |= EPOLLIN;
+  }
+  if ((events & POLLER_WRITE) != 0) {
+    epoll_events |= EPOLLOUT;
+  }
+  return epoll_events;
+}
+
+int poller_create(struct poller *poller, int capacity)
+{
+  struct epoll_event event;
+  int error;
+
+  poller->capacity = capacity;
+  poller->count = 0;
+  poller->epoll_events = malloc(sizeof(struct epoll_event) * (capacity + 1));
+  if (poller->epoll_events == NULL) {
+    return ENOMEM;
+  }
+
+  poller->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (poller->epoll_fd < 0) {
+    error = errno;
+    free(poller->epoll_events);
+    return error;
+  }
+
+  poller->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (poller->wakeup_fd < 0) {
+    error = errno;
+    close(poller->epoll_fd);
+    free(poller->epoll_events);
+    return error;
+  }
+
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = poller->wakeup_fd;
+  if (epoll_ctl(poller->epoll_fd,
+                EPOLL_CTL_ADD,
+                poller->wakeup_fd,
+                &event) != 0) {
+    error = errno;
+    poller_destroy(poller);
+    return error;
+  }
+
+  return 0;
+}
+
+void poller_destroy(struct poller *poller)
+{
+  close(poller->wakeup_fd);
+  close(poller->epoll_fd);
+  free(poller->epoll_events);
+  poller->epoll_events = NULL;
+}
+
+int poller_add(struct poller *poller, socket_t sock, unsigned int events)
+{
+  struct epoll_event event;
+
+  if (poller->count >= poller->capacity) {
+    return ENOSPC;
+  }
+
+  event.events = to_epoll_events(events);
+  event.data.fd = sock;
+  if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+    return errno;
+  }
+  poller->count++;
+  return 0;
+}
+
+int poller_modify(struct poller *poller, socket_t sock, unsigned int events)
+{
+  struct epoll_event event;
+
+  event.events = to_epoll_events(events);
+  event.data.fd = sock;
+  if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_MOD, sock, &event) != 0) {
+    return errno;
+  }
+  return 0;
+}
+
+int poller_remove(struct poller *poller, socket_t sock)
+{
+  struct epoll_event event; /* non-NULL for kernels before 2.6.9 */
+
+  if (epoll_ctl(poller->epoll_fd, EPOLL_CTL_DEL, sock, &event) != 0) {
+    return errno;
+  }
+  poller->count--;
+  return 0;
+}
+
+int poller_wait(struct poller *poller,
+                struct poller_event *events,
+                int max_events,
+                long timeout_ms)
+{
+  struct epoll_event *epoll_events =
+    (struct epoll_event *)poller->epoll_events;
+  uint64_t value;
+  int count;
+  int i;
+  int n = 0;
+
+  if (max_events > poller->capacity + 1) {
+    max_events = poller->capacity + 1;
+  }
+
+  count = epoll_wait(poller->epoll_fd,
+                     epoll_events,
+                     max_events,
+                     (int)timeout_ms);
+  if (count < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    uint32_t ready = epoll_events[i].events;
+
+    if (epoll_events[i].data.fd == poller->wakeup_fd) {
+      while (read(poller->wakeup_fd, &value, sizeof(value)) > 0) {
+        continue;
+      }
+      continue;
+    }
+    events[n].sock = epoll_events[i].data.fd;
+    events[n].events = 0;
+    if ((ready & EPOLLIN) != 0) {
+      events[n].events |= POLLER_READ;
+    }
+    if ((ready & EPOLLOUT) != 0) {
+      events[n].events |= POLLER_WRITE;
+    }
+    if ((ready & (EPOLLHUP | EPOLLERR)) != 0) {
+      events[n].events |= POLLER_CLOSED;
+    }
+    n++;
+  }
+
+  return n;
+}
+
+int poller_wakeup(struct poller *poller)
+{
+  uint64_t value = 1;
+
+  if (write(poller->wakeup_fd, &value, sizeof(value)) < 0
+      && errno != EAGAIN) {
+    return errno;
+  }
+  return 0;
+}
+
+#else /* POLLER_EPOLL */
+
+/*
+ * The wakeup socket is a UDP socket connected to itself, which works with
+ * poll() on every platform, unlike pipes.
+ */
+static socket_t create_wakeup_socket(void)
+{
+  socket_t sock;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == INVALID_SOCKET) {
+    return INVALID_SOCKET;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0
+      || connect(sock, (struct sockaddr *)&addr, addr_len) != 0
+      || set_socket_nonblocking(sock, 1) != 0) {
+    close_socket(sock);
+    return INVALID_SOCKET;
+  }
+
+  return sock;
+}
+
+static short to_poll_events(unsigned int events)
+{
+  short poll_events = 0;
+
+  if ((events & POLLER_READ) != 0) {
+    poll_events |= POLLIN;
+  }
+  if ((events & POLLER_WRITE) != 0) {
+    poll_events |= POLLOUT;
+  }
+  return poll_events;
+}
+
+int poller_create(struct poller *poller, int capacity)
+{
+  int i;
+
+  poller->capacity = capacity;
+  poller->count = 0;
+  poller->pollfds = (pollfd_t *)malloc(sizeof(pollfd_t) * (capacity + 1));
+  if (poller->pollfds == NULL) {
+    return ENOMEM;
+  }
+
+  poller->wakeup_socket = create_wakeup_socket();
+  if (poller->wakeup_socket == INVALID_SOCKET) {
+    int error = socket_errno;
+    free(poller->pollfds);
+    return error;
+  }
+
+  /* The wakeup socket is always the last one */
+  for (i = 0; i < capacity; i++) {
+    poller->pollfds[i].fd = INVALID_SOCKET;
+    poller->pollfds[i].events = 0;
+    poller->pollfds[i].revents = 0;
+  }
+  poller->pollfds[capacity].fd = poller->wakeup_socket;
+  poller->pollfds[capacity].events = POLLIN;
+  poller->pollfds[capacity].revents = 0;
+
+  return 0;
+}
+
+void poller_destroy(struct poller *poller)
+{
+  close_socket(poller->wakeup_socket);
+  free(poller->pollfds);
+  poller->pollfds = NULL;
+}
+
+static pollfd_t *find_pollfd(struct poller *poller, socket_t sock)
+{
+  int i;
+
+  for (i = 0; i < poller->capacity; i++) {
+    if (poller->pollfds[i].fd == sock) {
+      return &poller->pollfds[i];
+    }
+  }
+  return NULL;
+}
+
+int poller_add(struct poller *poller, socket_t sock, unsigned int events)
+{
+  pollfd_t *pollfd;
+
+  pollfd = find_pollfd(poller, INVALID_SOCKET);
+  if (pollfd == NULL) {
+    return ENOSPC;
+  }
+  pollfd->fd = sock;
+  pollfd->events = to_poll_events(events);
+  pollfd->revents = 0;
+  poller->count++;
+  return 0;
+}
+
+int poller_modify(struct poller *poller, socket_t sock, unsigned int events)
+{
+  pollfd_t *pollfd;
+
+  pollfd = find_pollfd(poller, sock);
+  if (pollfd == NULL) {
+    return ENOENT;
+  }
+  pollfd->events = to_poll_events(events);
+  return 0;
+}
+
+int poller_remove(struct poller *poller, socket_t sock)
+{
+  pollfd_t *pollfd;
+
+  pollfd = find_pollfd(poller, sock);
+  if (pollfd == NULL) {
+    return ENOENT;
+  }
+  pollfd->fd = INVALID_SOCKET;
+  pollfd->events = 0;
+  pollfd->revents = 0;
+  poller->count--;
+  return 0;
+}
+
+int poller_wait(struct poller *poller,
+                struct poller_event *events,
+                int max_events,
+                long timeout_ms)
+{
+  pollfd_t *wakeup_pollfd = &poller->pollfds[poller->capacity];
+  char buf[16];
+  int count;
+  int i;
+  int n = 0;
+
+  count = poll(poller->pollfds, poller->capacity + 1, (int)timeout_ms);
+  if (count < 0) {
+    return socket_errno == EINTR ? 0 : -1;
+  }
+
+  if ((wakeup_pollfd->revents & POLLIN) != 0) {
+    while (recv(poller->wakeup_socket, buf, sizeof(buf), 0) > 0) {
+      continue;
+    }
+  }
+
+  for (i = 0; i < poller->capacity && n < max_events; i++) {
+    pollfd_t *pollfd = &poller->pollfds[i];
+
+    if (pollfd->fd == INVALID_SOCKET || pollfd->revents == 0) {
+      continue;
+    }
+    events[n].sock = pollfd->fd;
+    events[n].events = 0;
+    if ((pollfd->revents & POLLIN) != 0) {
+      events[n].events |= POLLER_READ;
+    }
+    if ((pollfd->revents & POLLOUT) != 0) {
+      events[n].events |= POLLER_WRITE;
+    }
+    if ((pollfd->revents & (POLLHUP | POLLERR | POLLNVAL)) != 0) {
+      events[n].events |= POLLER_CLOSED;
+    }
+    pollfd->revents = 0;
+    n++;
+  }
+
+  return n;
+}
+
+int poller_wakeup(struct poller *poller)
+{
+  char c = 0;
+
+  if (send(poller->wakeup_socket, &c, 1, 0) < 0
+      && socket_errno != EWOULDBLOCK) {
+    return socket_errno;
+  }
+  return 0;
+}
+
+#endif /* POLLER_EPOLL */
+
+int socket_bytes_available(socket_t sock)
+{
+#ifdef _WIN32
+  u_long count = 0;
+#else
+  int count = 0;
+#endif
+
+  if (ioctl_socket(sock, FIONREAD, &count) != 0) {
+    return -1;
+  }
+  return (int)count;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "defs.h"
+#include "socket_ext.h"
+
+#ifdef __linux__
+  #define POLLER_EPOLL 1
+#endif
+
+enum {
+  POLLER_READ = 1,
+  POLLER_WRITE = 2,
+  POLLER_CLOSED = 4 /* hang-up or error */
+};
+
+struct poller_event {
+  socket_t sock;
+  unsigned int events;
+};
+
+/*
+ * Waits for socket readiness: edge-triggered epoll on Linux, poll()
+ * elsewhere. Either way, readers must consume everything that is available
+ * before waiting again. poller_wakeup() interrupts a poller_wait() in
+ * progress from any thread.
+ */
+struct poller {
+  int capacity;
+  int count;
+#ifdef POLLER_EPOLL
+  int epoll_fd;
+  int wakeup_fd;
+  void *epoll_events;
+#else
+  pollfd_t *pollfds;
+  socket_t wakeup_socket;
+#endif
+};
+
+int poller_create(struct poller *poller, int capacity);
+void poller_destroy(struct poller *poller);
+
+int poller_add(struct poller *poller, socket_t sock, unsigned int events);
+int poller_modify(struct poller *poller, socket_t sock, unsigned int events);
+int poller_remove(struct poller *poller, socket_t sock);
+
+int poller_wait(struct poller *poller,
+                struct poller_event *events,
+                int max_events,
+                long timeout_ms);
+int poller_wakeup(struct poller *poller);
+
+int socket_bytes_available(socket_t sock);
+
+#endif /* POLLER_H */
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "publisher.h"
+#include "sampler.h"
+#include "thread.h"
+
+static void drop_event(struct publisher *publisher,
+                       struct event_record *record)
+{
+  ATOMIC_FETCH_ADD64(&publisher->events_dropped, 1);
+  ATOMIC_FETCH_ADD64(&publisher->bytes_dropped,
+                     (long long)event_size(record));
+  event_clear(record);
+}
+
+/*
+ * Frees the slot of the oldest queued event so that a newer one could take
+ * its place. Returns false if there was nothing to drop.
+ */
+static bool drop_oldest_event(struct publisher *publisher)
+{
+  struct event_record *record;
+  long pos;
+
+  record = (struct event_record *)ring_acquire(publisher->queue, &pos);
+  if (record == NULL) {
+    return false;
+  }
+  drop_event(publisher, record);
+  ring_release(publisher->queue, pos);
+  return true;
+}
+
+static void update_queue_high_water(struct publisher *publisher)
+{
+  long count = (long)ring_count(publisher->queue);
+  long high_water;
+
+  while (count > (high_water = publisher->queue_high_water)) {
+    if (ATOMIC_COMPARE_EXCHANGE(&publisher->queue_high_water,
+                                high_water,
+                                count) == high_water) {
+      break;
+    }
+  }
+}
+
+void publisher_init(struct publisher *publisher,
+                    struct ring *queue,
+                    enum overflow_policy policy,
+                    bool (*wait)(long long *deadline))
+{
+  memset(publisher, 0, sizeof(*publisher));
+  publisher->queue = queue;
+  publisher->policy = policy;
+  publisher->wait = wait;
+}
+
+/*
+ * Queues the records, reserving as many slots as possible at once. The
+ * records are left empty. Returns the number of records queued, the rest
+ * are counted as dropped.
+ */
+int publisher_publish(struct publisher *publisher,
+                      struct event_record *records,
+                      int count,
+                      uint32_t *random_state)
+{
+  struct ring *queue = publisher->queue;
+  int published = 0;
+  int kept;
+  int i;
+  size_t reserved;
+  size_t j;
+  long pos;
+  long long deadline = 0;
+
+  if (publisher->policy == OVERFLOW_SAMPLE) {
+    for (i = 0, kept = 0; i < count; i++) {
+      /* Count the ones already kept, they are going to be queued too */
+      if (sampler_keep_event(ring_count(queue) + (size_t)kept,
+                             ring_capacity(queue),
+                             sampler_random(random_state))) {
+        if (kept != i) {
+          event_move(&records[kept], &records[i]);
+        }
+        kept++;
+      } else {
+        drop_event(publisher, &records[i]);
+      }
+    }
+    count = kept;
+  }
+
+  while (published < count) {
+    reserved = ring_reserve_n(queue, (size_t)(count - published), &pos);
+    if (reserved == 0) {
+      if (publisher->policy == OVERFLOW_DROP_OLDEST
+          && drop_oldest_event(publisher)) {
+        continue;
+      }
+      if (publisher->policy == OVERFLOW_BLOCK
+          && publisher->wait != NULL
+          && publisher->wait(&deadline)) {
+        continue;
+      }
+      for (i = published; i < count; i++) {
+        drop_event(publisher, &records[i]);
+      }
+      break;
+    }
+    for (j = 0; j < reserved; j++, published++) {
+      event_move((struct event_record *)ring_at(queue, pos + (long)j),
+                 &records[published]);
+      ring_commit(queue, pos + (long)j);
+    }
+    ATOMIC_FETCH_ADD64(&publisher->events_queued, (long long)reserved);
+  }
+
+  update_queue_high_water(publisher);
+  return published;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include "defs.h"
+#include "event.h"
+#include "ring.h"
+
+enum overflow_policy {
+  OVERFLOW_DROP_NEWEST,
+  OVERFLOW_DROP_OLDEST,
+  OVERFLOW_SAMPLE,
+  OVERFLOW_BLOCK
+};
+
+/*
+ * Moves event records to a ring of struct event_record. What happens to the
+ * ones that don't fit depends on the overflow policy.
+ *
+ * With OVERFLOW_BLOCK, wait is called for as long as the queue stays full
+ * and returns false to give up. *deadline is 0 on its first call in every
+ * publisher_publish() and is left for wait to use.
+ */
+struct publisher {
+  struct ring *queue;
+  enum overflow_policy policy;
+  bool (*wait)(long long *deadline);
+  volatile long long events_queued;
+  volatile long long events_dropped;
+  volatile long long bytes_dropped;
+  volatile long queue_high_water;
+};
+
+void publisher_init(struct publisher *publisher,
+                    struct ring *queue,
+                    enum overflow_policy policy,
+                    bool (*wait)(long long *deadline));
+
+int publisher_publish(struct publisher *publisher,
+                      struct event_record *records,
+                      int count,
+                      uint32_t *random_state);
+
+#endif /* PUBLISHER_H */
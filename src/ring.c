@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "thread.h"
+
+#define SLOT_SEQ(ring, pos) \
+  ((volatile long *)((ring)->slots + ((pos) & (ring)->mask) * (ring)->slot_size))
+#define SLOT_DATA(ring, pos) ((void *)(SLOT_SEQ(ring, pos) + 1))
+
+static long seq_diff(long seq, long pos)
+{
+  return (long)((unsigned long)seq - (unsigned long)pos);
+}
+
+int ring_alloc(struct ring *ring, size_t capacity, size_t elem_size)
+{
+  size_t count = 2;
+  size_t i;
+
+  while (count < capacity) {
+    count *= 2;
+  }
+
+  memset(ring, 0, sizeof(*ring));
+  ring->elem_size = elem_size;
+  ring->slot_size = (sizeof(long) + elem_size + sizeof(void *) - 1)
+    & ~(sizeof(void *) - 1);
+  ring->slots = (char *)calloc(count, ring->slot_size);
+  if (ring->slots == NULL) {
+    return ENOMEM;
+  }
+
+  ring->mask = (unsigned long)count - 1;
+  for (i = 0; i < count; i++) {
+    *SLOT_SEQ(ring, i) = (long)i;
+  }
+
+  return 0;
+}
+
+void ring_free(struct ring *ring)
+{
+  free(ring->slots);
+  ring->slots = NULL;
+  ring->mask = 0;
+}
+
+void *ring_reserve(struct ring *ring, long *pos)
+{
+  long tail = ATOMIC_LOAD(&ring->tail);
+  long seq;
+  long prev;
+
+  for (;;) {
+    seq = ATOMIC_LOAD(SLOT_SEQ(ring, tail));
+    if (seq_diff(seq, tail) == 0) {
+      prev = ATOMIC_COMPARE_EXCHANGE(&ring->tail, tail, tail + 1);
+      if (prev == tail) {
+        break;
+      }
+      tail = prev;
+    } else if (seq_diff(seq, tail) < 0) {
+      return NULL; /* full */
+    } else {
+      tail = ATOMIC_LOAD(&ring->tail);
+    }
+  }
+
+  *pos = tail;
+  return SLOT_DATA(ring, tail);
+}
+
+/*
+ * Reserve up to count consecutive slots with a single update of the tail.
+ * Returns the number of slots reserved, each of them must be committed.
+ */
+size_t ring_reserve_n(struct ring *ring, size_t count, long *pos)
+{
+  long tail = ATOMIC_LOAD(&ring->tail);
+  long prev;
+  size_t n;
+
+  for (;;) {
+    for (n = 0; n < count; n++) {
+      long seq = ATOMIC_LOAD(SLOT_SEQ(ring, tail + (long)n));
+      if (seq_diff(seq, tail + (long)n) != 0) {
+        break;
+      }
+    }
+    if (n == 0) {
+      long seq = ATOMIC_LOAD(SLOT_SEQ(ring, tail));
+      if (seq_diff(seq, tail) < 0) {
+        return 0; /* full */
+      }
+      tail = ATOMIC_LOAD(&ring->tail);
+      continue;
+    }
+    prev = ATOMIC_COMPARE_EXCHANGE(&ring->tail, tail, tail + (long)n);
+    if (prev == tail) {
+      break;
+    }
+    tail = prev;
+  }
+
+  *pos = tail;
+  return n;
+}
+
+void ring_commit(struct ring *ring, long pos)
+{
+  ATOMIC_STORE(SLOT_SEQ(ring, pos), pos + 1);
+}
+
+void *ring_acquire(struct ring *ring, long *pos)
+{
+  long head = ATOMIC_LOAD(&ring->head);
+  long seq;
+  long prev;
+
+  for (;;) {
+    seq = ATOMIC_LOAD(SLOT_SEQ(ring, head));
+    if (seq_diff(seq, head + 1) == 0) {
+      prev = ATOMIC_COMPARE_EXCHANGE(&ring->head, head, head + 1);
+      if (prev == head) {
+        break;
+      }
+      head = prev;
+    } else if (seq_diff(seq, head + 1) < 0) {
+      return NULL; /* empty or next element is not committed yet */
+    } else {
+      head = ATOMIC_LOAD(&ring->head);
+    }
+  }
+
+  *pos = head;
+  return SLOT_DATA(ring, head);
+}
+
+void ring_release(struct ring *ring, long pos)
+{
+  ATOMIC_STORE(SLOT_SEQ(ring, pos), pos + (long)ring->mask + 1);
+}
+
+void *ring_at(struct ring *ring, long pos)
+{
+  return SLOT_DATA(ring, pos);
+}
+
+int ring_push(struct ring *ring, const void *elem)
+{
+  long pos;
+  void *data;
+
+  data = ring_reserve(ring, &pos);
+  if (data == NULL) {
+    return ENOBUFS;
+  }
+  memcpy(data, elem, ring->elem_size);
+  ring_commit(ring, pos);
+  return 0;
+}
+
+int ring_pop(struct ring *ring, void *elem)
+{
+  long pos;
+  void *data;
+
+  data = ring_acquire(ring, &pos);
+  if (data == NULL) {
+    return EAGAIN;
+  }
+  memcpy(elem, data, ring->elem_size);
+  ring_release(ring, pos);
+  return 0;
+}
+
+size_t ring_capacity(const struct ring *ring)
+{
+  return (size_t)ring->mask + 1;
+}
+
+size_t ring_count(struct ring *ring)
+{
+  long count = seq_diff(ATOMIC_LOAD(&ring->tail), ATOMIC_LOAD(&ring->head));
+  if (count < 0) {
+    return 0;
+  }
+  if ((size_t)count > ring_capacity(ring)) {
+    return ring_capacity(ring);
+  }
+  return (size_t)count;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include "defs.h"
+
+/*
+ * Bounded lock-free queue of fixed-size elements (Dmitry Vyukov's array
+ * based queue). Any number of threads may push and pop concurrently; each
+ * slot carries a sequence number that tells whether it's free, filled or
+ * in use, so neither side ever takes a lock or calls the allocator.
+ */
+struct ring {
+  char *slots;
+  size_t slot_size;
+  size_t elem_size;
+  unsigned long mask;
+  char pad0[CACHE_LINE_SIZE];
+  volatile long head; /* next position to read */
+  char pad1[CACHE_LINE_SIZE];
+  volatile long tail; /* next position to write */
+  char pad2[CACHE_LINE_SIZE];
+};
+
+int ring_alloc(struct ring *ring, size_t capacity, size_t elem_size);
+void ring_free(struct ring *ring);
+
+void *ring_reserve(struct ring *ring, long *pos);
+size_t ring_reserve_n(struct ring *ring, size_t count, long *pos);
+void ring_commit(struct ring *ring, long pos);
+
+void *ring_acquire(struct ring *ring, long *pos);
+void ring_release(struct ring *ring, long pos);
+
+void *ring_at(struct ring *ring, long pos);
+
+int ring_push(struct ring *ring, const void *elem);
+int ring_pop(struct ring *ring, void *elem);
+
+size_t ring_capacity(const struct ring *ring);
+size_t ring_count(struct ring *ring);
+
+#endif /* RING_H */
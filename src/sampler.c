@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "sampler.h"
+#include "thread.h"
+
+static uint32_t hash_name(const char *name, size_t len)
+{
+  uint32_t hash = 2166136261u; /* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static long exchange(volatile long *value, long new_value)
+{
+  long old_value;
+
+  do {
+    old_value = *value;
+  } while (ATOMIC_COMPARE_EXCHANGE(value, old_value, new_value) != old_value);
+
+  return old_value;
+}
+
+/*
+ * Takes a token from the bucket if there is one. Buckets hold up to limit
+ * tokens (one second worth of events) and are refilled lazily.
+ */
+static bool bucket_take(struct token_bucket *bucket, long limit, long long now)
+{
+  long long refill_time = bucket->refill_time;
+  long long elapsed = now - refill_time;
+  long tokens;
+  long new_tokens;
+
+  if (elapsed > 0) {
+    long long refill = elapsed >= 1000 ? limit : elapsed * limit / 1000;
+    if (refill > 0) {
+      /* Only advance the clock by the time the whole tokens took */
+      long long new_refill_time = elapsed >= 1000
+        ? now
+        : refill_time + refill * 1000 / limit;
+      if (ATOMIC_COMPARE_EXCHANGE64(&bucket->refill_time,
+                                    refill_time,
+                                    new_refill_time) == refill_time) {
+        do {
+          tokens = bucket->tokens;
+          new_tokens = tokens + (long)refill;
+          if (new_tokens > limit) {
+            new_tokens = limit;
+          }
+        } while (ATOMIC_COMPARE_EXCHANGE(&bucket->tokens,
+                                         tokens,
+                                         new_tokens) != tokens);
+      }
+    }
+  }
+
+  do {
+    tokens = bucket->tokens;
+    if (tokens <= 0) {
+      return false;
+    }
+  } while (ATOMIC_COMPARE_EXCHANGE(&bucket->tokens,
+                                   tokens,
+                                   tokens - 1) != tokens);
+
+  return true;
+}
+
+void sampler_init(struct sampler *sampler)
+{
+  memset(sampler, 0, sizeof(*sampler));
+}
+
+/* xorshift32; a zero state is replaced with a fixed seed */
+uint32_t sampler_random(uint32_t *state)
+{
+  uint32_t x = *state;
+
+  if (x == 0) {
+    x = 0x9E3779B9u;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/*
+ * Once the queue is more than half full keep each event with a probability
+ * that falls linearly to zero as the queue fills up.
+ */
+bool sampler_keep_event(size_t queue_count,
+                        size_t queue_capacity,
+                        uint32_t random)
+{
+  size_t threshold = queue_capacity / SAMPLER_QUEUE_THRESHOLD;
+
+  if (queue_count <= threshold) {
+    return true;
+  }
+  if (queue_count >= queue_capacity) {
+    return false;
+  }
+  return random % (queue_capacity - threshold) < queue_capacity - queue_count;
+}
+
+/*
+ * Returns N for 1-in-N sampling. In adaptive mode the base rate doubles for
+ * every 1/8 of the queue filled above the first quarter, up to 64 times.
+ */
+long sampler_rate(long base_rate,
+                  bool adaptive,
+                  size_t queue_count,
+                  size_t queue_capacity)
+{
+  size_t eighths;
+  int shift;
+
+  if (base_rate < 1) {
+    base_rate = 1;
+  }
+  if (!adaptive || queue_capacity == 0) {
+    return base_rate;
+  }
+
+  eighths = queue_count * 8 / queue_capacity;
+  if (eighths <= 2) {
+    return base_rate;
+  }
+  shift = (int)(eighths - 2);
+  if (shift > SAMPLER_MAX_RATE_SHIFT) {
+    shift = SAMPLER_MAX_RATE_SHIFT;
+  }
+  return base_rate << shift;
+}
+
+/*
+ * Applies the per-user and per-database limits to an event that passed
+ * 1-in-N sampling with the given weight. Returns the weight the event should
+ * carry (including that of earlier events rejected by the same buckets), or
+ * 0 if the event must be dropped.
+ */
+long sampler_limit(struct sampler *sampler,
+                   const char *user,
+                   size_t user_len,
+                   long user_limit,
+                   const char *database,
+                   size_t database_len,
+                   long database_limit,
+                   long weight,
+                   long long now)
+{
+  struct token_bucket *user_bucket = NULL;
+  struct token_bucket *database_bucket = NULL;
+
+  if (user_limit > 0 && user != NULL) {
+    user_bucket = &sampler->users[
+      hash_name(user, user_len) % SAMPLER_BUCKETS];
+    if (!bucket_take(user_bucket, user_limit, now)) {
+      ATOMIC_FETCH_ADD(&user_bucket->skipped_weight, weight);
+      return 0;
+    }
+  }
+
+  if (database_limit > 0 && database != NULL) {
+    database_bucket = &sampler->databases[
+      hash_name(database, database_len) % SAMPLER_BUCKETS];
+    if (!bucket_take(database_bucket, database_limit, now)) {
+      ATOMIC_FETCH_ADD(&database_bucket->skipped_weight, weight);
+      return 0;
+    }
+  }
+
+  if (user_bucket != NULL && user_bucket->skipped_weight != 0) {
+    weight += exchange(&user_bucket->skipped_weight, 0);
+  }
+  if (database_bucket != NULL && database_bucket->skipped_weight != 0) {
+    weight += exchange(&database_bucket->skipped_weight, 0);
+  }
+
+  return weight;
+}
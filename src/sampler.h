@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "defs.h"
+
+#define SAMPLER_BUCKETS 256
+#define SAMPLER_MAX_RATE_SHIFT 6
+#define SAMPLER_QUEUE_THRESHOLD 2 /* sample events once 1/2 of queue is full */
+
+struct token_bucket {
+  volatile long tokens;
+  volatile long long refill_time;
+  volatile long skipped_weight;
+};
+
+/*
+ * Per-user and per-database rate limits. Names are hashed into a fixed
+ * number of buckets, so names that collide share a bucket.
+ */
+struct sampler {
+  struct token_bucket users[SAMPLER_BUCKETS];
+  struct token_bucket databases[SAMPLER_BUCKETS];
+};
+
+void sampler_init(struct sampler *sampler);
+
+uint32_t sampler_random(uint32_t *state);
+
+bool sampler_keep_event(size_t queue_count,
+                        size_t queue_capacity,
+                        uint32_t random);
+
+long sampler_rate(long base_rate,
+                  bool adaptive,
+                  size_t queue_count,
+                  size_t queue_capacity);
+
+long sampler_limit(struct sampler *sampler,
+                   const char *user,
+                   size_t user_len,
+                   long user_limit,
+                   const char *database,
+                   size_t database_len,
+                   long database_limit,
+                   long weight,
+                   long long now);
+
+#endif /* SAMPLER_H */
@@ -155,6 +155,26 @@ int get_socket_errno(void)
 #endif
 }
 
+static int would_block(void)
+{
+  int error = socket_errno;
+  return error == EWOULDBLOCK || error == EAGAIN;
+}
+
+/*
+ * Lets recv_n() and send_n() work on non-blocking sockets by waiting until
+ * the socket is ready. Returns a positive number when it is.
+ */
+static int wait_socket(socket_t sock, short events)
+{
+  pollfd_t pollfd;
+
+  pollfd.fd = sock;
+  pollfd.events = events;
+  pollfd.revents = 0;
+  return poll(&pollfd, 1, SOCKET_WAIT_TIMEOUT);
+}
+
 int recv_n(socket_t sock, char *buf, int size, int flags, recv_handler_t handler)
 {
   int len = 0;
@@ -166,6 +186,9 @@ int recv_n(socket_t sock, char *buf, int size, int flags, recv_handler_t handler
     }
     recv_len = recv(sock, buf + len, size - len, flags);
     if (recv_len < 0) {
+      if (would_block() && wait_socket(sock, POLLIN) > 0) {
+        continue;
+      }
       return recv_len;
     }
     if (recv_len == 0) {
@@ -191,6 +214,9 @@ int send_n(socket_t sock, const char *buf, int size, int flags)
     }
     send_len = send(sock, buf + len, size - len, flags);
     if (send_len < 0) {
+      if (would_block() && wait_socket(sock, POLLOUT) > 0) {
+        continue;
+      }
       return send_len;
     }
     if (send_len == 0) {
@@ -202,6 +228,137 @@ int send_n(socket_t sock, const char *buf, int size, int flags)
   return len;
 }
 
+int send_nb(socket_t sock, const char *buf, int size, int flags)
+{
+  int len = 0;
+  int send_len;
+
+  while (len < size) {
+    send_len = send(sock, buf + len, size - len, flags);
+    if (send_len < 0) {
+      if (would_block()) {
+        break;
+      }
+      return send_len;
+    }
+    if (send_len == 0) {
+      break;
+    }
+    len += send_len;
+  }
+
+  return len;
+}
+
+/*
+ * Sends up to MAX_SOCKET_BUFS buffers with one system call. Returns the
+ * number of bytes sent.
+ */
+static long send_bufs(socket_t sock,
+                      const struct socket_buf *bufs,
+                      int count,
+                      size_t offset,
+                      int flags)
+{
+#ifdef _WIN32
+  WSABUF wsa_bufs[MAX_SOCKET_BUFS];
+  DWORD sent;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    wsa_bufs[i].buf = (CHAR *)bufs[i].data;
+    wsa_bufs[i].len = (ULONG)bufs[i].len;
+  }
+  wsa_bufs[0].buf += offset;
+  wsa_bufs[0].len -= (ULONG)offset;
+  if (WSASend(sock, wsa_bufs, count, &sent, flags, NULL, NULL) != 0) {
+    return -1;
+  }
+  return (long)sent;
+#else
+  struct iovec iov[MAX_SOCKET_BUFS];
+  struct msghdr msg;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = (void *)bufs[i].data;
+    iov[i].iov_len = bufs[i].len;
+  }
+  iov[0].iov_base = (char *)iov[0].iov_base + offset;
+  iov[0].iov_len -= offset;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  return (long)sendmsg(sock, &msg, flags);
+#endif
+}
+
+/*
+ * Sends all of the buffers, or as much as the socket takes without blocking
+ * if wait is 0. Returns the number of bytes sent.
+ */
+static int send_all_bufs(socket_t sock,
+                         const struct socket_buf *bufs,
+                         int count,
+                         int flags,
+                         int wait)
+{
+  size_t offset = 0; /* into the first unsent buffer */
+  long len = 0;
+  long send_len;
+
+  while (count > 0) {
+    if (offset == bufs[0].len) {
+      bufs++;
+      count--;
+      offset = 0;
+      continue;
+    }
+    send_len = send_bufs(sock,
+                         bufs,
+                         count < MAX_SOCKET_BUFS ? count : MAX_SOCKET_BUFS,
+                         offset,
+                         flags);
+    if (send_len < 0) {
+      if (would_block()) {
+        if (!wait) {
+          break;
+        }
+        if (wait_socket(sock, POLLOUT) > 0) {
+          continue;
+        }
+      }
+      return -1;
+    }
+    if (send_len == 0) {
+      break;
+    }
+    len += send_len;
+    while (count > 0 && (size_t)send_len >= bufs[0].len - offset) {
+      send_len -= (long)(bufs[0].len - offset);
+      bufs++;
+      count--;
+      offset = 0;
+    }
+    offset += (size_t)send_len;
+  }
+
+  return (int)len;
+}
+
+int send_v(socket_t sock, const struct socket_buf *bufs, int count, int flags)
+{
+  return send_all_bufs(sock, bufs, count, flags, 1);
+}
+
+int send_v_nb(socket_t sock,
+              const struct socket_buf *bufs,
+              int count,
+              int flags)
+{
+  return send_all_bufs(sock, bufs, count, flags, 0);
+}
+
 int send_string(socket_t sock, const char *s)
 {
   size_t len = strlen(s);
@@ -212,6 +369,16 @@ int send_string(socket_t sock, const char *s)
   return send_n(sock, s, (int)len, 0);
 }
 
+int set_socket_nonblocking(socket_t sock, int nonblocking)
+{
+#ifdef _WIN32
+  u_long arg = nonblocking != 0;
+#else
+  int arg = nonblocking != 0;
+#endif
+  return ioctl_socket(sock, FIONBIO, &arg);
+}
+
 int close_socket_nicely(socket_t sock)
 {
   int error;
@@ -48,6 +48,7 @@
   #include <sys/ioctl.h>
   #include <sys/select.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
   #include <netdb.h>
   #include <netinet/in.h>
   #include <arpa/inet.h>
@@ -59,11 +60,19 @@
   typedef struct pollfd pollfd_t;
 #endif
 
+#define SOCKET_WAIT_TIMEOUT 5000 /* ms */
+#define MAX_SOCKET_BUFS 16 /* per gathered send() call */
+
 #undef socket_error
 #define socket_error get_socket_error()
 #undef socket_errno
 #define socket_errno get_socket_errno()
 
+struct socket_buf {
+  const char *data;
+  size_t len;
+};
+
 typedef int (*recv_handler_t)(
   const char *buf, int len, int chunk_offset, int chunk_len);
 
@@ -73,7 +82,13 @@ int get_socket_errno(void);
 int recv_n(
   socket_t sock, char *buf, int size, int flags, recv_handler_t handler);
 int send_n(socket_t sock, const char *buf, int size, int flags);
+int send_nb(socket_t sock, const char *buf, int size, int flags);
 int send_string(socket_t sock, const char *s);
+int send_v(socket_t sock, const struct socket_buf *bufs, int count, int flags);
+int send_v_nb(
+  socket_t sock, const struct socket_buf *bufs, int count, int flags);
+
+int set_socket_nonblocking(socket_t sock, int nonblocking);
 
 int close_socket_nicely(socket_t sock);
 
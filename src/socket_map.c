@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include "socket_map.h"
+
+#define SOCKET_MAP_MIN_CAPACITY 16
+
+static size_t hash_socket(socket_t sock)
+{
+  /* Windows socket handles are multiples of 4, mix the high bits in */
+  uint32_t hash = (uint32_t)sock * 2654435769u;
+  return (size_t)(hash ^ (hash >> 16));
+}
+
+static size_t find_slot(const struct socket_map *map, socket_t sock)
+{
+  size_t mask = map->capacity - 1;
+  size_t i;
+
+  /* Open addressing with linear probing */
+  i = hash_socket(sock) & mask;
+  while (map->entries[i].sock != INVALID_SOCKET
+         && map->entries[i].sock != sock) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int socket_map_grow(struct socket_map *map)
+{
+  struct socket_map old = *map;
+  size_t i;
+
+  map->capacity = old.capacity != 0
+    ? old.capacity * 2
+    : SOCKET_MAP_MIN_CAPACITY;
+  map->entries = (struct socket_map_entry *)malloc(map->capacity
+                                                   * sizeof(*map->entries));
+  if (map->entries == NULL) {
+    *map = old;
+    return ENOMEM;
+  }
+  for (i = 0; i < map->capacity; i++) {
+    map->entries[i].sock = INVALID_SOCKET;
+    map->entries[i].value = NULL;
+  }
+
+  for (i = 0; i < old.capacity; i++) {
+    if (old.entries[i].sock != INVALID_SOCKET) {
+      map->entries[find_slot(map, old.entries[i].sock)] = old.entries[i];
+    }
+  }
+  free(old.entries);
+
+  return 0;
+}
+
+void socket_map_init(struct socket_map *map)
+{
+  map->entries = NULL;
+  map->capacity = 0;
+  map->count = 0;
+}
+
+void socket_map_free(struct socket_map *map)
+{
+  free(map->entries);
+  socket_map_init(map);
+}
+
+int socket_map_put(struct socket_map *map, socket_t sock, void *value)
+{
+  size_t i;
+  int error;
+
+  /* Keep the load factor under 3/4 */
+  if ((map->count + 1) * 4 > map->capacity * 3) {
+    error = socket_map_grow(map);
+    if (error != 0) {
+      return error;
+    }
+  }
+
+  i = find_slot(map, sock);
+  if (map->entries[i].sock == INVALID_SOCKET) {
+    map->entries[i].sock = sock;
+    map->count++;
+  }
+  map->entries[i].value = value;
+
+  return 0;
+}
+
+void *socket_map_get(const struct socket_map *map, socket_t sock)
+{
+  size_t i;
+
+  if (map->count == 0) {
+    return NULL;
+  }
+  i = find_slot(map, sock);
+  return map->entries[i].sock != INVALID_SOCKET
+    ? map->entries[i].value
+    : NULL;
+}
+
+void *socket_map_remove(struct socket_map *map, socket_t sock)
+{
+  size_t mask = map->capacity - 1;
+  size_t i;
+  size_t j;
+  size_t home;
+  void *value;
+
+  if (map->count == 0) {
+    return NULL;
+  }
+  i = find_slot(map, sock);
+  if (map->entries[i].sock == INVALID_SOCKET) {
+    return NULL;
+  }
+  value = map->entries[i].value;
+  map->count--;
+
+  /*
+   * Move back entries that would become unreachable because of the hole,
+   * so that lookups never need tombstones.
+   */
+  for (j = (i + 1) & mask;
+       map->entries[j].sock != INVALID_SOCKET;
+       j = (j + 1) & mask) {
+    home = hash_socket(map->entries[j].sock) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      map->entries[i] = map->entries[j];
+      i = j;
+    }
+  }
+  map->entries[i].sock = INVALID_SOCKET;
+  map->entries[i].value = NULL;
+
+  return value;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SOCKET_MAP_H
+#define SOCKET_MAP_H
+
+#include "defs.h"
+#include "socket_ext.h"
+
+struct socket_map_entry {
+  socket_t sock;
+  void *value;
+};
+
+/*
+ * Maps sockets to pointers in O(1). Grows as needed, starting empty.
+ */
+struct socket_map {
+  struct socket_map_entry *entries;
+  size_t capacity; /* always a power of two */
+  size_t count;
+};
+
+void socket_map_init(struct socket_map *map);
+void socket_map_free(struct socket_map *map);
+
+int socket_map_put(struct socket_map *map, socket_t sock, void *value);
+void *socket_map_get(const struct socket_map *map, socket_t sock);
+void *socket_map_remove(struct socket_map *map, socket_t sock);
+
+#endif /* SOCKET_MAP_H */
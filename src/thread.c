@@ -218,3 +218,46 @@ int mutex_destroy(mutex_t *mutex)
   return pthread_mutex_destroy(mutex);
 #endif
 }
+
+/*
+ * The destructor is called with the thread's value when a thread that set
+ * one exits. On Windows it is also called for every thread's value when
+ * the key is deleted.
+ */
+
+int thread_key_create(thread_key_t *key, void (*destructor)(void *))
+{
+#ifdef _WIN32
+  *key = FlsAlloc((PFLS_CALLBACK_FUNCTION)destructor);
+  return *key == FLS_OUT_OF_INDEXES ? GetLastError() : 0;
+#else
+  return pthread_key_create(key, destructor);
+#endif
+}
+
+void *thread_key_get(thread_key_t key)
+{
+#ifdef _WIN32
+  return FlsGetValue(key);
+#else
+  return pthread_getspecific(key);
+#endif
+}
+
+int thread_key_set(thread_key_t key, void *value)
+{
+#ifdef _WIN32
+  return FlsSetValue(key, value) ? 0 : GetLastError();
+#else
+  return pthread_setspecific(key, value);
+#endif
+}
+
+int thread_key_delete(thread_key_t key)
+{
+#ifdef _WIN32
+  return FlsFree(key) ? 0 : GetLastError();
+#else
+  return pthread_key_delete(key);
+#endif
+}
@@ -37,16 +37,34 @@
   typedef pthread_mutex_t mutex_t;
 #endif
 
+#ifdef _WIN32
+  typedef DWORD thread_key_t;
+#else
+  typedef pthread_key_t thread_key_t;
+#endif
+
 #if defined _WIN32
   #define ATOMIC_INCREMENT(x) InterlockedIncrement(x)
   #define ATOMIC_DECREMENT(x) InterlockedDecrement(x)
+  #define ATOMIC_FETCH_ADD(x, value) InterlockedExchangeAdd(x, value)
+  #define ATOMIC_FETCH_ADD64(x, value) InterlockedExchangeAdd64(x, value)
   #define ATOMIC_COMPARE_EXCHANGE(dest, oldval, newval) \
       InterlockedCompareExchange(dest, newval, oldval)
+  #define ATOMIC_COMPARE_EXCHANGE64(dest, oldval, newval) \
+      InterlockedCompareExchange64(dest, newval, oldval)
+  #define ATOMIC_LOAD(x) InterlockedCompareExchange(x, 0, 0)
+  #define ATOMIC_STORE(x, value) InterlockedExchange(x, value)
 #elif defined __GNUC__
   #define ATOMIC_INCREMENT(x) __sync_fetch_and_add(x, 1)
   #define ATOMIC_DECREMENT(x) __sync_fetch_and_sub(x, 1)
+  #define ATOMIC_FETCH_ADD(x, value) __sync_fetch_and_add(x, value)
+  #define ATOMIC_FETCH_ADD64(x, value) __sync_fetch_and_add(x, value)
   #define ATOMIC_COMPARE_EXCHANGE(dest, oldval, newval) \
       __sync_val_compare_and_swap(dest, oldval, newval)
+  #define ATOMIC_COMPARE_EXCHANGE64(dest, oldval, newval) \
+      __sync_val_compare_and_swap(dest, oldval, newval)
+  #define ATOMIC_LOAD(x) __atomic_load_n(x, __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE(x, value) __atomic_store_n(x, value, __ATOMIC_RELEASE)
 #endif
 
 int thread_create(thread_t *handle,
@@ -62,4 +80,9 @@ int mutex_lock(mutex_t *mutex);
 int mutex_unlock(mutex_t *mutex);
 int mutex_destroy(mutex_t *mutex);
 
+int thread_key_create(thread_key_t *key, void (*destructor)(void *));
+void *thread_key_get(thread_key_t key);
+int thread_key_set(thread_key_t key, void *value);
+int thread_key_delete(thread_key_t key);
+
 #endif /* THREAD_H */
@@ -20,25 +20,142 @@
  * IN THE SOFTWARE.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
+static unsigned char *read_file(FILE *file, size_t *size)
+{
+  unsigned char *data = NULL;
+  unsigned char *new_data;
+  size_t capacity = 0;
+  size_t n;
+
+  *size = 0;
+  do {
+    if (*size == capacity) {
+      capacity = capacity != 0 ? capacity * 2 : 4096;
+      new_data = realloc(data, capacity);
+      if (new_data == NULL) {
+        free(data);
+        return NULL;
+      }
+      data = new_data;
+    }
+    n = fread(data + *size, 1, capacity - *size, file);
+    *size += n;
+  } while (n != 0);
+
+  return data;
+}
+
+/*
+ * 64-bit FNV-1a, good enough to tell versions of a file apart in URLs and
+ * ETags.
+ */
+static void hash_data(const unsigned char *data, size_t size, char *hash)
+{
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  sprintf(hash, "%016llx", h);
+}
+
+#ifdef HAVE_ZLIB
+
+/*
+ * Compresses data into a gzip stream. zlib leaves the modification time
+ * in the header zeroed, so the output only depends on the input.
+ */
+static unsigned char *gzip(const unsigned char *data,
+                           size_t size,
+                           size_t *out_size)
+{
+  z_stream stream;
+  unsigned char *out;
+  size_t out_capacity;
+
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream,
+                   Z_BEST_COMPRESSION,
+                   Z_DEFLATED,
+                   MAX_WBITS + 16, /* gzip wrapper */
+                   9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+
+  out_capacity = deflateBound(&stream, (uLong)size);
+  out = malloc(out_capacity);
+  if (out == NULL) {
+    deflateEnd(&stream);
+    return NULL;
+  }
+
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = (uInt)size;
+  stream.next_out = out;
+  stream.avail_out = (uInt)out_capacity;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&stream);
+    free(out);
+    return NULL;
+  }
+  *out_size = stream.total_out;
+  deflateEnd(&stream);
+
+  return out;
+}
+
+#endif /* HAVE_ZLIB */
 
 int main(int argc, char **argv)
 {
   FILE *file;
   FILE *out_file;
-  unsigned char c;
+  unsigned char *data;
+  size_t size;
+  size_t j;
+  int compress = 0;
+  int hash_only = 0;
+  char hash[17];
   int i;
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: cdump file var_name [out_file]\n");
+  if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
+    compress = 1;
+    argc--;
+    argv++;
+  } else if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+    hash_only = 1;
+    argc--;
+    argv++;
+  }
+
+  if (argc < (hash_only ? 2 : 3)) {
+    fprintf(stderr,
+            "Usage: cdump [-z] file var_name [out_file]\n"
+            "       cdump -s file [out_file]\n");
     return EXIT_FAILURE;
   }
 
-  if (argc >= 4) {
-    out_file = fopen(argv[3], "w");
+#ifndef HAVE_ZLIB
+  if (compress) {
+    fprintf(stderr, "Compression is not supported (built without zlib)\n");
+    return EXIT_FAILURE;
+  }
+#endif
+
+  if (argc >= (hash_only ? 3 : 4)) {
+    out_file = fopen(argv[hash_only ? 2 : 3], "w");
     if (out_file == NULL) {
       fprintf(stderr, "Could not open output file: %s\n", strerror(errno));
       return EXIT_FAILURE;
@@ -53,16 +170,46 @@ int main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  data = read_file(file, &size);
+  if (data == NULL) {
+    fprintf(stderr, "Could not read input file: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  /* The hash is of the original content, compressed or not */
+  hash_data(data, size, hash);
+  if (hash_only) {
+    fputs(hash, out_file);
+    free(data);
+    return EXIT_SUCCESS;
+  }
+
+#ifdef HAVE_ZLIB
+  if (compress) {
+    unsigned char *compressed_data;
+    size_t compressed_size;
+
+    compressed_data = gzip(data, size, &compressed_size);
+    if (compressed_data == NULL) {
+      fprintf(stderr, "Could not compress input file\n");
+      return EXIT_FAILURE;
+    }
+    free(data);
+    data = compressed_data;
+    size = compressed_size;
+  }
+#endif
+
   fprintf(out_file,
       "/* This file was automatically generated by cdump. DO NOT EDIT. */\n\n");
   fprintf(out_file, "static const char %s[] = {\n", argv[2]);
 
   i = 0;
-  while ((fread(&c, sizeof(c), 1, file)) != 0) {
+  for (j = 0; j < size; j++) {
     if (i == 0) {
       fprintf(out_file, "\t\"");
     }
-    fprintf(out_file, "\\x%02x", c);
+    fprintf(out_file, "\\x%02x", data[j]);
     i += 4;
     if (i >= 68) {
       fputs("\"\n", out_file);
@@ -75,5 +222,15 @@ int main(int argc, char **argv)
   }
   fprintf(out_file, "\n};\n");
 
+  if (!compress) {
+    fprintf(out_file, "\n#define ");
+    for (j = 0; argv[2][j] != '\0'; j++) {
+      fputc(toupper((unsigned char)argv[2][j]), out_file);
+    }
+    fprintf(out_file, "_HASH \"%s\"\n", hash);
+  }
+
+  free(data);
+
   return EXIT_SUCCESS;
 }
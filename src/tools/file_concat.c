@@ -81,6 +81,7 @@ int main(int argc, char **argv)
 
   for (;;) {
     char *start, *end;
+    size_t offset;
     char *path;
     struct strbuf subst_buf;
 
@@ -94,10 +95,11 @@ int main(int argc, char **argv)
       break;
     }
 
-    pos = end - buf.str;
+    offset = start - buf.str;
     path = strndup(start + 4, end - start - 4);
     if (path == NULL) {
       fprintf(stderr, "Could not allocate memory\n");
+      error = ENOMEM;
       break;
     }
 
@@ -110,14 +112,19 @@ int main(int argc, char **argv)
 
     free(path);
 
-    if ((error = strbuf_delete(&buf, start - buf.str, end - start + 4)) != 0
+    if ((error = strbuf_delete(&buf, offset, end - start + 4)) != 0
         || (error = strbuf_insertn(&buf,
-                                   start - buf.str,
+                                   offset,
                                    subst_buf.str,
                                    subst_buf.length)) != 0) {
       fprintf(stderr, "Error: %s\n", strerror(error));
+      strbuf_free(&subst_buf);
       break;
     }
+
+    /* Continue after the inserted text, it's not scanned for markers */
+    pos = offset + subst_buf.length;
+    strbuf_free(&subst_buf);
   }
 
   fwrite(buf.str, sizeof(char), buf.length, out_file);
@@ -125,5 +132,5 @@ int main(int argc, char **argv)
 
   strbuf_free(&buf);
 
-  return EXIT_SUCCESS;
+  return error == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -203,13 +203,123 @@ function onQueryEnd(event) {
   }
 }
 
+var BINARY_PROTOCOL = 'mysql-logger.binary';
+var EVENT_TYPES = ['query_start', 'query_error', 'query_result'];
+
+/*
+ * Decodes the binary event stream (see struct event_encoder in event.h).
+ * The decoder keeps state between messages, so it must see all of them.
+ */
+function BinaryDecoder() {
+  this.textDecoder = new TextDecoder('utf-8');
+  this.reset();
+}
+
+BinaryDecoder.prototype.reset = function() {
+  this.time = 0;
+  this.queryId = 0;
+  this.users = [];
+  this.databases = [];
+};
+
+BinaryDecoder.prototype.decode = function(buffer) {
+  var bytes = new Uint8Array(buffer);
+  var pos = 0;
+  var self = this;
+
+  function readVarint() {
+    var value = 0;
+    var scale = 1;
+    var b;
+    do {
+      b = bytes[pos++];
+      value += (b & 0x7F) * scale;
+      scale *= 128;
+    } while (b & 0x80);
+    return value;
+  }
+
+  function readZigzag() {
+    var value = readVarint();
+    return value % 2 ? -(value + 1) / 2 : value / 2;
+  }
+
+  function readBytes(length) {
+    var str = self.textDecoder.decode(bytes.subarray(pos, pos + length));
+    pos += length;
+    return str;
+  }
+
+  function readString() {
+    var length = readVarint();
+    return length > 0 ? readBytes(length - 1) : null;
+  }
+
+  function readDictionaryString(dictionary) {
+    var value = readVarint();
+    if (value == 0) {
+      return null;
+    }
+    if (value % 2 == 0) {
+      return dictionary[value / 2 - 1];
+    }
+    var str = readBytes((value - 1) / 2);
+    dictionary.push(str);
+    return str;
+  }
+
+  if (bytes[pos++] & 1) {
+    this.reset();
+  }
+
+  var events = [];
+  while (pos < bytes.length) {
+    var tag = bytes[pos++];
+    var event = {type: EVENT_TYPES[tag & 3]};
+    this.time += readZigzag();
+    event.time = this.time;
+    event.thread_id = readVarint();
+    event.seq = readVarint();
+    if (tag & 4) {
+      this.queryId += readZigzag();
+      event.query_id = this.queryId;
+    }
+    switch (event.type) {
+      case 'query_start':
+        event.user = readDictionaryString(this.users);
+        event.query = readString();
+        event.rows = readZigzag();
+        event.database = tag & 8
+          ? readDictionaryString(this.databases)
+          : null;
+        break;
+      case 'query_error':
+        event.error_code = readVarint();
+        event.error_message = readString();
+        break;
+      case 'query_result':
+        event.rows = readZigzag();
+        break;
+    }
+    if (tag & 16) {
+      event.weight = readVarint();
+    }
+    events.push(event);
+  }
+  return events;
+};
+
 window.addEventListener('DOMContentLoaded', function() {
   var params = getQueryStringParams();
   var host = params.host || window.location.hostname || 'localhost';
   var uiPort = window.location.port ? +window.location.port : 13306;
-  var port = params.port || uiPort + 1;
+  var port = params.port || uiPort;
   var url = 'ws://' + host + ':' + port;
-  var socket = new WebSocket(url);
+  var protocols = params.format == 'json' ? [] : [BINARY_PROTOCOL];
+  var socket = new WebSocket(url, protocols);
+  var binaryDecoder = new BinaryDecoder();
+
+  socket.binaryType = 'arraybuffer';
 
   socket.addEventListener('open', function(event) {
     console.log('WebSocket opened!');
@@ -222,17 +332,27 @@ window.addEventListener('DOMContentLoaded', function() {
   socket.addEventListener('message', function(event) {
     console.log('WebSocket message:', event);
 
-    var eventData = JSON.parse(event.data);
-    switch (eventData.type) {
-      case 'query_start':
-        onQueryStart(eventData, {
-          maxQueryCount: params.logSize || 100
-        });
-        break;
-      case 'query_error':
-      case 'query_result':
-        onQueryEnd(eventData);
-        break;
+    var data = typeof event.data == 'string'
+      ? JSON.parse(event.data)
+      : binaryDecoder.decode(event.data);
+    var events = Array.isArray(data) ? data : [data];
+    for (var i = 0; i < events.length; i++) {
+      var eventData = events[i];
+      switch (eventData.type) {
+        case 'query_start':
+          onQueryStart(eventData, {
+            maxQueryCount: params.logSize || 100
+          });
+          break;
+        case 'query_error':
+        case 'query_result':
+          onQueryEnd(eventData);
+          break;
+        case 'events_skipped':
+          console.warn('Server skipped ' + eventData.count
+            + ' events because the connection was too slow');
+          break;
+      }
     }
   });
 });
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "uring.h"
+
+#ifdef URING_SUPPORTED
+
+#include <stdlib.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "thread.h"
+
+#ifndef __NR_io_uring_setup
+  #define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+  #define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+  #define __NR_io_uring_register 427
+#endif
+
+#define URING_PROBE_OPS 256
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd,
+                          unsigned int to_submit,
+                          unsigned int min_complete,
+                          unsigned int flags)
+{
+  return (int)syscall(__NR_io_uring_enter,
+                      fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd,
+                             unsigned int opcode,
+                             void *arg,
+                             unsigned int nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool supports_send(int fd)
+{
+  struct io_uring_probe *probe;
+  bool supported;
+
+  probe = (struct io_uring_probe *)calloc(1,
+    sizeof(*probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+  if (probe == NULL) {
+    return false;
+  }
+  supported =
+    io_uring_register(fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0
+    && probe->last_op >= IORING_OP_SEND
+    && (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) != 0;
+  free(probe);
+
+  return supported;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+  void *ptr;
+
+  ptr = mmap(NULL,
+             size,
+             PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE,
+             fd,
+             offset);
+  return ptr != MAP_FAILED ? ptr : NULL;
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+  struct io_uring_params params;
+  char *sq;
+  char *cq;
+  int error;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = -1;
+
+  ring->fd = io_uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    return errno;
+  }
+  if (!supports_send(ring->fd)) {
+    uring_free(ring);
+    return ENOSYS;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array
+    + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+  ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+    error = errno;
+    uring_free(ring);
+    return error;
+  }
+
+  sq = (char *)ring->sq_ring;
+  ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+  cq = (char *)ring->cq_ring;
+  ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+  ring->cqes = cq + params.cq_off.cqes;
+
+  return 0;
+}
+
+void uring_free(struct uring *ring)
+{
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+static int reap_completions(struct uring *ring, struct uring_send *sends)
+{
+  struct io_uring_cqe *cqes = (struct io_uring_cqe *)ring->cqes;
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = ATOMIC_LOAD(ring->cq_tail);
+  int count = 0;
+
+  for (; head != tail; head++, count++) {
+    struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+    sends[cqe->user_data].result = cqe->res;
+  }
+  ATOMIC_STORE(ring->cq_head, head);
+
+  return count;
+}
+
+/*
+ * Sends each buffer to its socket without waiting for the socket to become
+ * writable, like send_nb(). All sends are submitted and completed in one
+ * io_uring_enter() call per ring's worth of entries. If this fails the ring
+ * may still hold submissions and must be freed.
+ */
+int uring_send_all(struct uring *ring, struct uring_send *sends, int count)
+{
+  struct io_uring_sqe *sqes = (struct io_uring_sqe *)ring->sqes;
+  unsigned int tail;
+  unsigned int n;
+  unsigned int i;
+  unsigned int submitted;
+  unsigned int completed;
+  int result;
+  int j;
+
+  /*
+   * Sends in later batches must not look done (or failed with a stale
+   * result) if an earlier batch fails.
+   */
+  for (j = 0; j < count; j++) {
+    sends[j].result = -EINPROGRESS;
+  }
+
+  while (count > 0) {
+    n = (unsigned int)count < ring->entries
+      ? (unsigned int)count
+      : ring->entries;
+
+    tail = *ring->sq_tail;
+    for (i = 0; i < n; i++) {
+      unsigned int index = (tail + i) & *ring->sq_mask;
+      struct io_uring_sqe *sqe = &sqes[index];
+
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sends[i].sock;
+      sqe->addr = (unsigned long)sends[i].data;
+      sqe->len = (unsigned int)sends[i].len;
+      sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+      sqe->user_data = i;
+      ring->sq_array[index] = index;
+    }
+    ATOMIC_STORE(ring->sq_tail, tail + n);
+
+    submitted = 0;
+    completed = 0;
+    while (completed < n) {
+      result = io_uring_enter(ring->fd,
+                              n - submitted,
+                              n - completed,
+                              IORING_ENTER_GETEVENTS);
+      if (result < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+          continue;
+        }
+        return errno;
+      }
+      submitted += (unsigned int)result;
+      completed += (unsigned int)reap_completions(ring, sends);
+    }
+
+    sends += n;
+    count -= (int)n;
+  }
+
+  return 0;
+}
+
+#else /* URING_SUPPORTED */
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+  UNUSED(entries);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  return ENOSYS;
+}
+
+void uring_free(struct uring *ring)
+{
+  UNUSED(ring);
+}
+
+int uring_send_all(struct uring *ring, struct uring_send *sends, int count)
+{
+  UNUSED(ring);
+  UNUSED(sends);
+  UNUSED(count);
+  return ENOSYS;
+}
+
+#endif /* URING_SUPPORTED */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019-2020 Sergey Zolotarev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "defs.h"
+#include "socket_ext.h"
+
+#if defined __linux__ && defined __has_include
+  #if __has_include(<linux/io_uring.h>)
+    #define URING_SUPPORTED 1
+  #endif
+#endif
+
+struct uring_send {
+  socket_t sock;
+  const void *data;
+  size_t len;
+  long result; /* bytes sent or negated errno */
+};
+
+/*
+ * A minimal io_uring (Linux 5.6+) used to send data to many sockets with a
+ * single system call. Talks to the kernel directly, without liburing.
+ */
+struct uring {
+  int fd;
+  unsigned int entries;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *sqes;
+  size_t sqes_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  volatile unsigned int *sq_head;
+  volatile unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  volatile unsigned int *cq_head;
+  volatile unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  void *cqes;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_free(struct uring *ring);
+
+int uring_send_all(struct uring *ring, struct uring_send *sends, int count);
+
+#endif /* URING_H */
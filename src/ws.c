@@ -20,7 +20,6 @@
  * IN THE SOFTWARE.
  */
 
-#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +30,7 @@
 #include "sha1.h"
 #include "socket_ext.h"
 #include "string_ext.h"
+#include "thread.h"
 #include "ws.h"
 
 #define count_of(a) (sizeof(a) / sizeof(a[0]))
@@ -52,6 +52,10 @@ struct ws_http_handshake_state {
   int websocket_version;
   const char *websocket_key;
   size_t websocket_key_length;
+  const char *extensions;
+  size_t extensions_length;
+  const char *protocols;
+  size_t protocols_length;
 };
 
 static const char
@@ -66,14 +70,15 @@ static const char *ws_error_messages[] = {
   "Unsupported version of HTTP protocol",
   "Unsupported version of WebSocket protocol",
   "Request does not include valid conneciton upgrade headers",
-  "Request does not include \"Sec-WebSocket-Key\" header"
+  "Request does not include \"Sec-WebSocket-Key\" header",
+  "Invalid WebSocket frame"
 };
 
 const char *ws_error_message(int error) {
-  if (error <= 0 || error >= count_of(ws_error_messages)) {
+  if (error <= 0 || error > (int)count_of(ws_error_messages)) {
     return "Unknown error";
   }
-  return ws_error_messages[error];
+  return ws_error_messages[error - 1];
 }
 
 static void on_handshake_header(
@@ -113,14 +118,122 @@ static void on_handshake_header(
                          name->length) == 0) {
     state->websocket_key = value->ptr;
     state->websocket_key_length = value->length;
+  } else if (strncasecmp(name->ptr,
+                         "Sec-WebSocket-Extensions",
+                         name->length) == 0) {
+    state->extensions = value->ptr;
+    state->extensions_length = value->length;
+  } else if (strncasecmp(name->ptr,
+                         "Sec-WebSocket-Protocol",
+                         name->length) == 0) {
+    state->protocols = value->ptr;
+    state->protocols_length = value->length;
   }
 }
 
+/*
+ * Checks the parameters of a permessage-deflate offer. The server keeps one
+ * compression context for everyone, so it can't give up context takeover or
+ * use a smaller window for a single client.
+ */
+static bool ws_check_deflate_params(char *params,
+                                    char **tok_context,
+                                    int window_bits)
+{
+  char *param;
+  char *value;
+
+  while ((param = strtok_r(params, "; \t", tok_context)) != NULL) {
+    params = NULL;
+    value = strchr(param, '=');
+    if (value != NULL) {
+      *value++ = '\0';
+      if (*value == '"') {
+        value++;
+      }
+    }
+    if (strcasecmp(param, "server_max_window_bits") == 0) {
+      if (value == NULL || atoi(value) < window_bits) {
+        return false;
+      }
+    } else if (strcasecmp(param, "server_no_context_takeover") == 0) {
+      return false;
+    } else if (strcasecmp(param, "client_no_context_takeover") != 0
+        && strcasecmp(param, "client_max_window_bits") != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool ws_negotiate_deflate(const char *header,
+                                 size_t len,
+                                 int window_bits)
+{
+  char *offers = strndup(header, len);
+  char *src = offers;
+  char *offers_context = NULL;
+  char *offer;
+  bool accepted = false;
+
+  if (offers == NULL) {
+    return false;
+  }
+  while (!accepted && (offer = strtok_r(src, ",", &offers_context)) != NULL) {
+    char *params_context = NULL;
+    char *name = strtok_r(offer, "; \t", &params_context);
+
+    src = NULL;
+    accepted = name != NULL
+      && strcasecmp(name, "permessage-deflate") == 0
+      && ws_check_deflate_params(NULL, &params_context, window_bits);
+  }
+  free(offers);
+
+  return accepted;
+}
+
+/*
+ * Returns the index of the first of our protocols that the client asked
+ * for, or -1.
+ */
+static int ws_select_protocol(const char *header,
+                              size_t len,
+                              const char *const *protocols)
+{
+  char *offers = strndup(header, len);
+  char *src;
+  char *tok_context;
+  char *offer;
+  int i;
+
+  if (offers == NULL) {
+    return -1;
+  }
+  for (i = 0; protocols[i] != NULL; i++) {
+    /* strtok_r() modifies the string, so start from a fresh copy */
+    memcpy(offers, header, len);
+    src = offers;
+    tok_context = NULL;
+    while ((offer = strtok_r(src, ", \t", &tok_context)) != NULL) {
+      src = NULL;
+      if (strcmp(offer, protocols[i]) == 0) {
+        free(offers);
+        return i;
+      }
+    }
+  }
+  free(offers);
+
+  return -1;
+}
+
 static int ws_parse_connect_request(
   const char *buf,
   size_t len,
   const char **key,
-  size_t *key_len)
+  size_t *key_len,
+  struct ws_options *options)
 {
   struct ws_http_handshake_state parse_state = {0};
   const char *result;
@@ -137,15 +250,16 @@ static int ws_parse_connect_request(
     return WS_ERROR_HTTP_REQUEST;
   }
 
-  if (strncmp(http_method.ptr, "GET", http_method.length) != 0) {
+  /* Checked first to tell WebSocket requests from plain HTTP */
+  if (!parse_state.has_upgrade_connection
+      || !parse_state.upgrade_to_websocket) {
+    return WS_ERROR_NO_UPGRADE;
+  } else if (strncmp(http_method.ptr, "GET", http_method.length) != 0) {
     return WS_ERROR_HTTP_METHOD;
   } else if (http_version > 0x01FF) {
     return WS_ERROR_HTTP_VERSION;
   } else if (parse_state.websocket_version != WS_PROTOCOL_VERSION) {
     return WS_ERROR_WEBSOCKET_VERSION;
-  } else if (!parse_state.has_upgrade_connection
-      || !parse_state.upgrade_to_websocket) {
-    return WS_ERROR_NO_UPGRADE;
   } else if (parse_state.websocket_key == NULL
       || strlen(parse_state.websocket_key) == 0) {
     return WS_ERROR_NO_KEY;
@@ -154,10 +268,27 @@ static int ws_parse_connect_request(
   *key = parse_state.websocket_key;
   *key_len = parse_state.websocket_key_length;
 
+  if (options != NULL && options->protocols != NULL) {
+    options->protocol = parse_state.protocols != NULL
+      ? ws_select_protocol(parse_state.protocols,
+                           parse_state.protocols_length,
+                           options->protocols)
+      : -1;
+  }
+  if (options != NULL && options->deflate) {
+    options->deflate = parse_state.extensions != NULL
+      && ws_negotiate_deflate(parse_state.extensions,
+                              parse_state.extensions_length,
+                              options->deflate_window_bits);
+  }
+
   return 0;
 }
 
-static int ws_send_handshake_accept(socket_t sock, const char *key)
+static int ws_format_handshake_accept(
+  struct http_response *response,
+  const char *key,
+  const struct ws_options *options)
 {
   size_t key_len;
   char *key_hash_input;
@@ -165,7 +296,9 @@ static int ws_send_handshake_accept(socket_t sock, const char *key)
   char key_hash[SHA1_HASH_SIZE];
   char accept[SHA1_HASH_SIZE * 2];
   size_t accept_len;
-  char response[256];
+  char extensions_header[96] = {0};
+  char protocol_header[96] = {0};
+  int len;
 
   key_len = strlen(key);
   key_hash_input = (char *)malloc(sizeof(*key_hash_input)
@@ -192,34 +325,62 @@ static int ws_send_handshake_accept(socket_t sock, const char *key)
                              sizeof(accept) - 1);
   accept[accept_len] = '\0';
 
-  snprintf(response, sizeof(response),
+  if (options != NULL && options->deflate) {
+    if (options->deflate_window_bits < 15) {
+      snprintf(extensions_header, sizeof(extensions_header),
+        "Sec-WebSocket-Extensions: permessage-deflate; "
+        "server_max_window_bits=%d\r\n",
+        options->deflate_window_bits);
+    } else {
+      snprintf(extensions_header, sizeof(extensions_header),
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n");
+    }
+  }
+
+  if (options != NULL
+      && options->protocols != NULL
+      && options->protocol >= 0) {
+    snprintf(protocol_header, sizeof(protocol_header),
+      "Sec-WebSocket-Protocol: %s\r\n",
+      options->protocols[options->protocol]);
+  }
+
+  len = snprintf(response->headers, sizeof(response->headers),
     "HTTP/1.1 101 Switching Protocols\r\n"
     "Upgrade: websocket\r\n"
     "Connection: Upgrade\r\n"
-    "Sec-WebSocket-Accept: %s\r\n\r\n",
-    accept);
-  if (send_string(sock, response) < 0) {
-    return WS_ERROR_SEND;
+    "Sec-WebSocket-Accept: %s\r\n"
+    "%s%s\r\n",
+    accept,
+    protocol_header,
+    extensions_header);
+  if (len < 0 || (size_t)len >= sizeof(response->headers)) {
+    return WS_ERROR_MEMORY;
   }
+  response->headers_length = (size_t)len;
+  response->content = NULL;
+  response->content_length = 0;
+  response->sent = 0;
 
   return 0;
 }
 
-int ws_accept(socket_t sock)
+/*
+ * Checks a WebSocket connection request and prepares the response that
+ * accepts it, agreeing on the options.
+ */
+int ws_accept_request(
+  const char *buf,
+  size_t len,
+  struct ws_options *options,
+  struct http_response *response)
 {
   int error;
-  char buf[MAX_HTTP_HEADERS] = {0};
-  int len;
   const char *key;
   size_t key_len;
   char *key_copy;
 
-  len = http_recv_headers(sock, buf, sizeof(buf));
-  if (len <= 0) {
-    return WS_ERROR_RECV;
-  }
-
-  error = ws_parse_connect_request(buf, (size_t)len, &key, &key_len);
+  error = ws_parse_connect_request(buf, len, &key, &key_len, options);
   if (error != 0) {
     return error;
   }
@@ -229,7 +390,7 @@ int ws_accept(socket_t sock)
     return WS_ERROR_MEMORY;
   }
 
-  error = ws_send_handshake_accept(sock, key_copy);
+  error = ws_format_handshake_accept(response, key_copy, options);
   free(key_copy);
   if (error != 0) {
     return error;
@@ -238,22 +399,33 @@ int ws_accept(socket_t sock)
   return 0;
 }
 
-static uint8_t *ws_alloc_frame(
+static size_t ws_frame_header_size(uint16_t flags, size_t payload_len)
+{
+  size_t size = sizeof(uint16_t);
+
+  if (payload_len >= PAYLOAD_LENGTH_16) {
+    size += payload_len <= (uint64_t)0xFFFF
+      ? sizeof(uint16_t)
+      : sizeof(uint64_t);
+  }
+  if ((flags & WS_FLAG_MASK) != 0) {
+    size += sizeof(uint32_t);
+  }
+
+  return size;
+}
+
+static size_t ws_write_frame_header(
+  uint8_t *data,
   uint16_t flags,
   uint8_t opcode,
   uint32_t masking_key,
-  const char *payload,
-  size_t payload_len,
-  size_t *size)
+  size_t payload_len)
 {
   uint8_t payload_len_high;
   uint8_t payload_ext_len_size;
   uint16_t header;
-  uint8_t *data;
-  uint16_t offset = 0;
-  size_t frame_size;
-
-  (void)masking_key; /* TODO: Implement masking */
+  size_t offset = 0;
 
   if (payload_len < PAYLOAD_LENGTH_16) {
     payload_len_high = (uint8_t)payload_len;
@@ -266,17 +438,6 @@ static uint8_t *ws_alloc_frame(
     payload_ext_len_size = (uint8_t)sizeof(uint64_t);
   }
 
-  frame_size = sizeof(header)
-    + payload_ext_len_size
-    + ((flags & WS_FLAG_MASK) != 0 ? sizeof(masking_key) : 0)
-    + payload_len;
-  data = (uint8_t *)malloc(frame_size);
-  if (data == NULL) {
-    return NULL;
-  }
-
-  *size = frame_size;
-
   header = htons(
     (flags & 0xF080) | ((opcode & 0x0F) << 8) | (payload_len_high & 0x7F));
   memcpy(data, &header, sizeof(header));
@@ -284,48 +445,174 @@ static uint8_t *ws_alloc_frame(
 
   if (payload_ext_len_size != 0) {
     switch (payload_ext_len_size) {
-      case sizeof(uint16_t):
-        *(uint16_t *)(data + offset) = htons((uint16_t)payload_len);
+      case sizeof(uint16_t): {
+        uint16_t len = htons((uint16_t)payload_len);
+        memcpy(data + offset, &len, sizeof(len));
         break;
-      case sizeof(uint64_t):
-        *(uint64_t *)(data + offset) = htonll(payload_len);
+      }
+      case sizeof(uint64_t): {
+        uint64_t len = htonll((uint64_t)payload_len);
+        memcpy(data + offset, &len, sizeof(len));
         break;
+      }
     }
     offset += payload_ext_len_size;
   }
 
   if ((flags & WS_FLAG_MASK) != 0) {
-    *(uint16_t *)(data + offset) = htons(masking_key);
-    offset += sizeof(uint16_t);
+    uint32_t key = htonl(masking_key);
+    memcpy(data + offset, &key, sizeof(key));
+    offset += sizeof(key);
   }
 
-  memcpy(data + offset, payload, payload_len);
+  return offset;
+}
 
-  return data;
+struct ws_frame *ws_frame_create(
+  int opcode,
+  const char *payload,
+  size_t payload_len,
+  uint16_t flags)
+{
+  struct ws_frame *frame;
+  size_t header_size;
+
+  flags &= ~WS_FLAG_MASK; /* servers don't mask their frames */
+  header_size = ws_frame_header_size(flags, payload_len);
+  frame = (struct ws_frame *)malloc(
+    sizeof(*frame) + header_size + payload_len);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  frame->refs = 1;
+  frame->data = (uint8_t *)(frame + 1);
+  frame->size = header_size + payload_len;
+  ws_write_frame_header(frame->data, flags, (uint8_t)opcode, 0, payload_len);
+  if (payload_len > 0) {
+    memcpy(frame->data + header_size, payload, payload_len);
+  }
+
+  return frame;
 }
 
-int ws_send(
+/*
+ * Allocates a reference-counted buffer of the given size for the caller to
+ * fill in. Lets data that is not a WebSocket frame share the same queues.
+ */
+struct ws_frame *ws_frame_alloc(size_t size)
+{
+  struct ws_frame *frame;
+
+  frame = (struct ws_frame *)malloc(sizeof(*frame) + size);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  frame->refs = 1;
+  frame->data = (uint8_t *)(frame + 1);
+  frame->size = size;
+
+  return frame;
+}
+
+struct ws_frame *ws_frame_create_close(uint16_t code, const char *reason)
+{
+  char payload[125]; /* control frames can't be longer */
+  size_t reason_len = reason != NULL ? strlen(reason) : 0;
+
+  if (reason_len > sizeof(payload) - sizeof(code)) {
+    reason_len = sizeof(payload) - sizeof(code);
+  }
+  payload[0] = (char)(code >> 8);
+  payload[1] = (char)(code & 0xFF);
+  if (reason_len > 0) {
+    memcpy(payload + sizeof(code), reason, reason_len);
+  }
+
+  return ws_frame_create(WS_OP_CLOSE,
+                         payload,
+                         sizeof(code) + reason_len,
+                         WS_FLAG_FINAL);
+}
+
+struct ws_frame *ws_frame_ref(struct ws_frame *frame)
+{
+  ATOMIC_INCREMENT(&frame->refs);
+  return frame;
+}
+
+void ws_frame_unref(struct ws_frame *frame)
+{
+  if (frame != NULL && ATOMIC_FETCH_ADD(&frame->refs, -1) == 1) {
+    free(frame);
+  }
+}
+
+int ws_send_frame(socket_t sock, const struct ws_frame *frame)
+{
+  return send_n(sock, (const char *)frame->data, (int)frame->size, 0);
+}
+
+/*
+ * The header is built on the stack and goes out with the payload segments
+ * in a single gathered send, nothing is allocated or copied.
+ */
+int ws_sendv(
   socket_t sock,
   int opcode,
-  const char *data,
-  size_t len,
+  const struct socket_buf *segments,
+  int count,
   uint32_t flags,
   uint32_t masking_key)
 {
-  uint8_t *frame;
-  size_t frame_size;
-  int error;
+  uint8_t header[WS_MAX_HEADER_SIZE];
+  struct socket_buf bufs[MAX_SOCKET_BUFS];
+  size_t payload_len = 0;
+  int head_count;
+  int result;
+  int rest;
+  int i;
 
-  frame = ws_alloc_frame(
-    flags, opcode, masking_key, data, len, &frame_size);
-  if (frame == NULL) {
-    return -1;
+  (void)masking_key; /* TODO: Implement masking */
+
+  for (i = 0; i < count; i++) {
+    payload_len += segments[i].len;
   }
 
-  error = send_n(sock, (const char *)frame, (int)frame_size, 0);
-  free(frame);
+  bufs[0].data = (const char *)header;
+  bufs[0].len = ws_write_frame_header(
+    header, (uint16_t)flags, (uint8_t)opcode, masking_key, payload_len);
+  head_count = count < MAX_SOCKET_BUFS - 1 ? count : MAX_SOCKET_BUFS - 1;
+  for (i = 0; i < head_count; i++) {
+    bufs[i + 1] = segments[i];
+  }
+
+  result = send_v(sock, bufs, head_count + 1, 0);
+  if (result < 0 || count == head_count) {
+    return result;
+  }
+
+  rest = send_v(sock, segments + head_count, count - head_count, 0);
+  if (rest < 0) {
+    return rest;
+  }
+  return result + rest;
+}
+
+int ws_send(
+  socket_t sock,
+  int opcode,
+  const char *data,
+  size_t len,
+  uint32_t flags,
+  uint32_t masking_key)
+{
+  struct socket_buf payload;
 
-  return error;
+  payload.data = data;
+  payload.len = len;
+  return ws_sendv(sock, opcode, &payload, 1, flags, masking_key);
 }
 
 int ws_send_text(
@@ -340,93 +627,205 @@ int ws_send_close(
   return ws_send(sock, WS_OP_CLOSE, NULL, 0, 0, 0);
 }
 
-int ws_recv(
-    socket_t sock,
-    int *out_opcode,
-    int *out_flags,
-    void **data,
-    size_t *len)
+/*
+ * XORs data with the masking key, eight bytes at a time. offset is the
+ * position of data within the payload, so that a payload can be unmasked
+ * in pieces.
+ */
+void ws_mask(uint8_t *data,
+             size_t len,
+             const uint8_t masking_key[4],
+             size_t offset)
 {
-  int error;
-  uint16_t header;
-  int opcode;
-  int mask;
-  char *payload;
-  size_t payload_len = 0;
-  char masking_key[4];
+  uint8_t key_bytes[8];
+  uint64_t key;
+  uint64_t word;
   size_t i;
 
-  assert(out_opcode != NULL);
-  assert(data == NULL || len != NULL);
-
-  error = recv_n(sock, (char *)&header, sizeof(header), 0, NULL);
-  if (error <= 0) {
-    return error;
+  for (i = 0; i < sizeof(key_bytes); i++) {
+    key_bytes[i] = masking_key[(offset + i) % 4];
   }
+  memcpy(&key, key_bytes, sizeof(key));
 
-  header = ntohs(header);
-  opcode = (header & 0x0F00) >> 8;
-  mask = (header & WS_FLAG_MASK) != 0;
-  payload_len = header & 0x7F;
+  for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, data + i, sizeof(word));
+    word ^= key;
+    memcpy(data + i, &word, sizeof(word));
+  }
+  for (; i < len; i++) {
+    data[i] ^= masking_key[(offset + i) % 4];
+  }
+}
 
-  *out_opcode = opcode;
+static size_t ws_parsed_header_size(const uint8_t *header)
+{
+  size_t size = 2;
 
-  if (out_flags != NULL) {
-    *out_flags = header & 0xFF00;
+  if ((header[1] & 0x7F) == PAYLOAD_LENGTH_16) {
+    size += sizeof(uint16_t);
+  } else if ((header[1] & 0x7F) == PAYLOAD_LENGTH_64) {
+    size += sizeof(uint64_t);
+  }
+  if ((header[1] & 0x80) != 0) {
+    size += 4;
   }
+  return size;
+}
+
+void ws_parser_init(struct ws_parser *parser)
+{
+  parser->header_length = 0;
+  parser->in_payload = false;
+  parser->extension_flags = 0;
+}
+
+static int ws_parser_begin_payload(struct ws_parser *parser)
+{
+  const uint8_t *header = parser->header;
+  size_t offset = 2;
 
-  if (payload_len == PAYLOAD_LENGTH_16) {
+  parser->opcode = header[0] & 0x0F;
+  parser->flags = ((header[0] & 0xF0) << 8) | (header[1] & 0x80);
+  parser->payload_length = header[1] & 0x7F;
+  if (parser->payload_length == PAYLOAD_LENGTH_16) {
     uint16_t len;
-    error = recv_n(sock, (char *)&len, sizeof(len), 0, NULL);
-    if (error <= 0) {
-      return error;
-    }
-    payload_len = ntohs(len);
-  } else if (payload_len == PAYLOAD_LENGTH_64) {
+    memcpy(&len, header + offset, sizeof(len));
+    parser->payload_length = ntohs(len);
+    offset += sizeof(len);
+  } else if (parser->payload_length == PAYLOAD_LENGTH_64) {
     uint64_t len;
-    error = recv_n(sock, (char *)&len, sizeof(len), 0, NULL);
-    if (error <= 0) {
-      return error;
+    memcpy(&len, header + offset, sizeof(len));
+    parser->payload_length = ntohll(len);
+    offset += sizeof(len);
+    if ((parser->payload_length >> 63) != 0) {
+      return WS_ERROR_PROTOCOL;
     }
-    payload_len = ntohll(len) & 0x7FFFFFFF; /* Clear MSB */
+  }
+  if ((parser->flags & WS_FLAG_MASK) == 0) {
+    return WS_ERROR_PROTOCOL; /* clients must mask every frame */
+  }
+  memcpy(parser->masking_key, header + offset, 4);
+
+  /* RSV bits are only for negotiated extensions, on data frames */
+  if ((parser->flags
+       & (WS_FLAG_RSV1 | WS_FLAG_RSV2 | WS_FLAG_RSV3)
+       & ~((parser->opcode & 0x08) == 0 ? parser->extension_flags : 0))
+      != 0) {
+    return WS_ERROR_PROTOCOL;
   }
 
-  if (mask) {
-    error = recv_n(sock, masking_key, sizeof(masking_key), 0, NULL);
-    if (error <= 0) {
-      return error;
+  if ((parser->opcode > WS_OP_BINARY && parser->opcode < WS_OP_CLOSE)
+      || parser->opcode > WS_OP_PONG) {
+    return WS_ERROR_PROTOCOL; /* reserved */
+  }
+
+  /* Control frames can't be fragmented or long */
+  if ((parser->opcode & 0x08) != 0
+      && ((parser->flags & WS_FLAG_FINAL) == 0
+          || parser->payload_length > WS_MAX_CONTROL_PAYLOAD)) {
+    return WS_ERROR_PROTOCOL;
+  }
+
+  parser->payload_offset = 0;
+  parser->in_payload = true;
+  return 0;
+}
+
+/*
+ * Codes that a peer may send in a close frame (RFC 6455, section 7.4).
+ * 1005, 1006 and 1015 are only for reporting, never sent.
+ */
+static bool ws_close_code_valid(uint16_t code)
+{
+  return (code >= 1000 && code <= 1003)
+    || (code >= 1007 && code <= 1014)
+    || (code >= 3000 && code <= 4999);
+}
+
+static int ws_parser_end_frame(
+  struct ws_parser *parser,
+  ws_frame_handler_t handler,
+  void *data)
+{
+  bool control = (parser->opcode & 0x08) != 0;
+  size_t len = (size_t)parser->payload_length;
+
+  parser->header_length = 0;
+  parser->in_payload = false;
+
+  if (control) {
+    ws_mask((uint8_t *)parser->control_payload,
+            len,
+            parser->masking_key,
+            0);
+  }
+  if (parser->opcode == WS_OP_CLOSE && len > 0) {
+    /* The body starts with a status code, if there is one */
+    if (len < 2
+        || !ws_close_code_valid(
+             (uint16_t)(((uint8_t)parser->control_payload[0] << 8)
+                        | (uint8_t)parser->control_payload[1]))) {
+      return WS_ERROR_PROTOCOL;
     }
   }
+  return handler(parser->opcode,
+                 parser->flags,
+                 control ? parser->control_payload : NULL,
+                 len,
+                 data);
+}
+
+int ws_parser_feed(
+  struct ws_parser *parser,
+  const char *buf,
+  size_t len,
+  ws_frame_handler_t handler,
+  void *data)
+{
+  size_t needed;
+  size_t n;
+  int error;
 
-  if (data != NULL) {
-    if (payload_len > 0) {
-      payload = (char *)malloc(payload_len);
-      if (payload == NULL) {
-        return errno;
+  while (len > 0) {
+    if (!parser->in_payload) {
+      needed = parser->header_length < 2
+        ? 2
+        : ws_parsed_header_size(parser->header);
+      n = needed - parser->header_length;
+      if (n > len) {
+        n = len;
       }
-      error = recv_n(sock, payload, (int)payload_len, 0, NULL);
-      if (error <= 0) {
-        free(payload);
-        return error;
+      memcpy(parser->header + parser->header_length, buf, n);
+      parser->header_length += n;
+      buf += n;
+      len -= n;
+      if (parser->header_length < 2
+          || parser->header_length < ws_parsed_header_size(parser->header)) {
+        continue;
       }
-      if (mask) {
-        for (i = 0; i < payload_len; i++) {
-          payload[i] ^= masking_key[i % 4];
-        }
+      if ((error = ws_parser_begin_payload(parser)) != 0) {
+        return error;
       }
-      *data = payload;
-    }
-    *len = payload_len;
-  } else {
-    char buf[1];
-    for (i = 0; i < payload_len; i++) {
-      error = recv(sock, buf, 1, 0);
-      if (error <= 0) {
+      if (parser->payload_length == 0
+          && (error = ws_parser_end_frame(parser, handler, data)) != 0) {
         return error;
       }
+      continue;
+    }
+
+    n = len;
+    if (n > parser->payload_length - parser->payload_offset) {
+      n = (size_t)(parser->payload_length - parser->payload_offset);
+    }
+    if ((parser->opcode & 0x08) != 0) {
+      memcpy(parser->control_payload + parser->payload_offset, buf, n);
     }
-    if (len != NULL) {
-      *len = payload_len;
+    parser->payload_offset += n;
+    buf += n;
+    len -= n;
+    if (parser->payload_offset == parser->payload_length
+        && (error = ws_parser_end_frame(parser, handler, data)) != 0) {
+      return error;
     }
   }
 
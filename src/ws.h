@@ -24,12 +24,15 @@
 #define WS_H
 
 #include "defs.h"
+#include "http.h"
 #include "socket_ext.h"
 
 #define WS_PROTOCOL_VERSION 13
+#define WS_MAX_HEADER_SIZE 14
+#define WS_MAX_CONTROL_PAYLOAD 125
 
 enum {
-  WS_ERROR_MEMORY,
+  WS_ERROR_MEMORY = 1,
   WS_ERROR_SEND,
   WS_ERROR_RECV,
   WS_ERROR_HTTP_REQUEST,
@@ -37,7 +40,8 @@ enum {
   WS_ERROR_HTTP_VERSION,
   WS_ERROR_WEBSOCKET_VERSION,
   WS_ERROR_NO_UPGRADE,
-  WS_ERROR_NO_KEY
+  WS_ERROR_NO_KEY,
+  WS_ERROR_PROTOCOL
 };
 
 enum {
@@ -49,6 +53,14 @@ enum {
   WS_OP_PONG = 10
 };
 
+enum {
+  WS_CLOSE_NORMAL = 1000,
+  WS_CLOSE_GOING_AWAY = 1001,
+  WS_CLOSE_PROTOCOL_ERROR = 1002,
+  WS_CLOSE_POLICY_VIOLATION = 1008,
+  WS_CLOSE_MESSAGE_TOO_BIG = 1009
+};
+
 enum {
   WS_FLAG_FINAL = 1u << 15,
   WS_FLAG_RSV1 = 1u << 14,
@@ -57,10 +69,73 @@ enum {
   WS_FLAG_MASK = 1u << 7
 };
 
+/*
+ * A complete server frame that can be sent to any number of clients.
+ */
+struct ws_frame {
+  volatile long refs;
+  size_t size;
+  uint8_t *data;
+};
+
+/*
+ * Extensions and subprotocols that the server is willing to use when passed
+ * to ws_accept_request(), and the ones the client agreed to when it returns.
+ */
+struct ws_options {
+  bool deflate; /* permessage-deflate */
+  int deflate_window_bits;
+  const char *const *protocols; /* NULL-terminated, in order of preference */
+  int protocol; /* index into protocols or -1 */
+};
+
+/*
+ * Called by ws_parser_feed() for every complete frame. Control frames come
+ * with their (unmasked) payload. The payload of data frames is skipped and
+ * only its length is reported. A non-zero return value stops the parser
+ * and is passed on to the caller.
+ */
+typedef int (*ws_frame_handler_t)(
+  int opcode,
+  int flags,
+  const char *payload,
+  size_t len,
+  void *data);
+
+/*
+ * Incremental frame parser for non-blocking sockets: it accepts data in
+ * pieces of any size, as it arrives. It parses client frames, so unmasked
+ * frames, reserved opcodes and RSV bits that no extension allows are
+ * protocol errors.
+ */
+struct ws_parser {
+  uint8_t header[WS_MAX_HEADER_SIZE];
+  size_t header_length;
+  bool in_payload;
+  int opcode;
+  int flags;
+  int extension_flags; /* RSV bits allowed in data frames */
+  uint8_t masking_key[4];
+  uint64_t payload_length;
+  uint64_t payload_offset;
+  char control_payload[WS_MAX_CONTROL_PAYLOAD];
+};
+
 const char *ws_error_message(int error);
 
-int ws_accept(socket_t sock);
+int ws_accept_request(
+  const char *buf,
+  size_t len,
+  struct ws_options *options,
+  struct http_response *response);
 
+int ws_sendv(
+  socket_t sock,
+  int opcode,
+  const struct socket_buf *segments,
+  int count,
+  uint32_t flags,
+  uint32_t masking_key);
 int ws_send(
   socket_t sock,
   int opcode,
@@ -73,15 +148,32 @@ int ws_send_text(
   const char *text,
   uint16_t flags,
   uint32_t masking_key);
+struct ws_frame *ws_frame_create(
+  int opcode,
+  const char *payload,
+  size_t payload_len,
+  uint16_t flags);
+struct ws_frame *ws_frame_create_close(uint16_t code, const char *reason);
+struct ws_frame *ws_frame_alloc(size_t size);
+struct ws_frame *ws_frame_ref(struct ws_frame *frame);
+void ws_frame_unref(struct ws_frame *frame);
+int ws_send_frame(socket_t sock, const struct ws_frame *frame);
+
 int ws_send_close(socket_t sock,
   uint16_t flags,
   uint32_t masking_key);
 
-int ws_recv(
-  socket_t sock,
-  int *opcode,
-  int *flags,
-  void **data,
-  size_t *len);
+void ws_mask(uint8_t *data,
+             size_t len,
+             const uint8_t masking_key[4],
+             size_t offset);
+
+void ws_parser_init(struct ws_parser *parser);
+int ws_parser_feed(
+  struct ws_parser *parser,
+  const char *buf,
+  size_t len,
+  ws_frame_handler_t handler,
+  void *data);
 
 #endif /* WS_H */
@@ -1,9 +1,19 @@
 #include <stdio.h>
 #include "config_tests.h"
+#include "deflate_tests.h"
+#include "event_tests.h"
+#include "filter_tests.h"
 #include "http_tests.h"
 #include "json_tests.h"
+#include "poller_tests.h"
+#include "publisher_tests.h"
+#include "ring_tests.h"
+#include "sampler_tests.h"
+#include "socket_map_tests.h"
 #include "strbuf_tests.h"
 #include "string_ext_tests.h"
+#include "uring_tests.h"
+#include "ws_tests.h"
 
 int main(void)
 {
@@ -18,8 +28,57 @@ int main(void)
   test_json_encode();
   test_json_control_char_escaping();
 
+  test_event_text();
+  test_event_text_overflow();
+  test_event_encode_json();
+  test_event_encode_binary();
+  test_event_move();
+
+  test_filter_parse_rules();
+  test_filter_match();
+  test_filter_query_prefixes();
+  test_filter_split_user_host();
+
+  test_ring_push_pop();
+  test_ring_overflow();
+  test_ring_wrap_around();
+  test_ring_reserve_n();
+
+  test_deflater_compress();
+
+  test_sampler_rate();
+  test_sampler_limit();
+  test_sampler_keep_event();
+
+  test_publisher_drop_newest();
+  test_publisher_drop_oldest();
+  test_publisher_block();
+  test_publisher_sample();
+
+  test_socket_map_put_get();
+  test_socket_map_remove();
+
+  test_poller_wakeup();
+  test_poller_read();
+
   test_http_request_line_parsing();
   test_http_header_parsing();
+  test_http_accepts_encoding();
+  test_http_has_token();
+  test_http_etag_matches();
+  test_http_scan_headers();
+  test_http_get_query_param();
+  test_http_url_decode();
+
+  test_ws_frame_create();
+  test_ws_sendv();
+  test_ws_accept_deflate();
+  test_ws_accept_protocol();
+  test_ws_mask();
+  test_ws_parser();
+  test_ws_parser_close();
+
+  test_uring_send_all();
 
   test_read_config();
   test_read_config_file();
@@ -0,0 +1,78 @@
+#include <string.h>
+#ifdef HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#include "deflate.h"
+#include "test.h"
+
+#ifdef HAVE_ZLIB
+
+static size_t inflate_message(z_stream *stream,
+                              const struct strbuf *input,
+                              char *output,
+                              size_t size)
+{
+  static const unsigned char tail[] = {0x00, 0x00, 0xFF, 0xFF};
+
+  stream->next_in = (Bytef *)input->str;
+  stream->avail_in = (uInt)input->length;
+  stream->next_out = (Bytef *)output;
+  stream->avail_out = (uInt)size;
+  inflate(stream, Z_SYNC_FLUSH);
+  stream->next_in = (Bytef *)tail;
+  stream->avail_in = sizeof(tail);
+  inflate(stream, Z_SYNC_FLUSH);
+  return size - stream->avail_out;
+}
+
+#endif
+
+void test_deflater_compress(void)
+{
+#ifdef HAVE_ZLIB
+  const char *query =
+    "{\"type\": \"query\", \"text\": \"SELECT id, name FROM users "
+    "WHERE id = 1\"}";
+  size_t query_len = strlen(query);
+  struct deflater deflater;
+  struct strbuf output;
+  z_stream stream;
+  char buf[256];
+  size_t first_len;
+
+  TEST(deflater_init(&deflater, 6, 8) != 0);
+  TEST(deflater_init(&deflater, 6, 15) == 0);
+  TEST(strbuf_alloc(&output, 16) == 0);
+
+  memset(&stream, 0, sizeof(stream));
+  TEST(inflateInit2(&stream, -15) == Z_OK);
+
+  TEST(deflater_compress(&deflater, query, query_len, &output) == 0);
+  first_len = output.length;
+  TEST(first_len > 0);
+  TEST(inflate_message(&stream, &output, buf, sizeof(buf)) == query_len);
+  TEST(memcmp(buf, query, query_len) == 0);
+
+  /* The second message refers back to the first one */
+  output.length = 0;
+  TEST(deflater_compress(&deflater, query, query_len, &output) == 0);
+  TEST(output.length < first_len / 2);
+  TEST(inflate_message(&stream, &output, buf, sizeof(buf)) == query_len);
+  TEST(memcmp(buf, query, query_len) == 0);
+
+  /* After a reset it can be decoded without the earlier messages */
+  TEST(deflater_reset(&deflater) == 0);
+  output.length = 0;
+  TEST(deflater_compress(&deflater, query, query_len, &output) == 0);
+  TEST(output.length == first_len);
+  inflateEnd(&stream);
+  memset(&stream, 0, sizeof(stream));
+  TEST(inflateInit2(&stream, -15) == Z_OK);
+  TEST(inflate_message(&stream, &output, buf, sizeof(buf)) == query_len);
+  TEST(memcmp(buf, query, query_len) == 0);
+
+  inflateEnd(&stream);
+  strbuf_free(&output);
+  deflater_free(&deflater);
+#endif
+}
@@ -0,0 +1 @@
+void test_deflater_compress(void);
@@ -0,0 +1,183 @@
+#include <string.h>
+#include "event.h"
+#include "test.h"
+
+void test_event_text(void)
+{
+  struct event_record record;
+  const char *text;
+  size_t len;
+
+  event_init(&record, EVENT_QUERY_START);
+  TEST(event_get_text(&record, EVENT_USER, NULL) == NULL);
+
+  TEST(event_set_text(&record, EVENT_USER, "root", 4) == 0);
+  TEST(event_set_text(&record, EVENT_QUERY, "SELECT 1; -- ignored", 8) == 0);
+  TEST(event_set_text(&record, EVENT_DATABASE, NULL, 0) == 0);
+  TEST(record.heap_text == NULL);
+
+  text = event_get_text(&record, EVENT_USER, &len);
+  TEST(len == 4);
+  TEST(strcmp(text, "root") == 0);
+  text = event_get_text(&record, EVENT_QUERY, &len);
+  TEST(len == 8);
+  TEST(strcmp(text, "SELECT 1") == 0);
+  TEST(event_get_text(&record, EVENT_DATABASE, NULL) == NULL);
+
+  event_clear(&record);
+}
+
+void test_event_text_overflow(void)
+{
+  struct event_record record;
+  char query[EVENT_INLINE_TEXT_SIZE * 2];
+
+  memset(query, 'x', sizeof(query) - 1);
+  query[sizeof(query) - 1] = '\0';
+
+  event_init(&record, EVENT_QUERY_START);
+  TEST(event_set_text(&record, EVENT_USER, "root", 4) == 0);
+  TEST(event_set_text(&record, EVENT_QUERY, query, strlen(query)) == 0);
+  TEST(record.heap_text != NULL);
+  TEST(strcmp(event_get_text(&record, EVENT_USER, NULL), "root") == 0);
+  TEST(strcmp(event_get_text(&record, EVENT_QUERY, NULL), query) == 0);
+
+  event_clear(&record);
+  TEST(record.heap_text == NULL);
+}
+
+void test_event_encode_json(void)
+{
+  struct event_record record;
+  struct strbuf json;
+
+  event_init(&record, EVENT_QUERY_START);
+  event_set_text(&record, EVENT_USER, "root", 4);
+  event_set_text(&record, EVENT_QUERY, "SELECT \"a\"", 10);
+  record.time = 1500000000000LL;
+  record.query_id = 7;
+  record.flags = EVENT_HAS_QUERY_ID | EVENT_HAS_DATABASE;
+  record.thread_id = 3;
+  record.seq = 12;
+  record.weight = 4;
+
+  strbuf_alloc_default(&json);
+  TEST(event_encode_json(&record, &json) == 0);
+  TEST(strcmp(json.str,
+    "{\"type\": \"query_start\", \"user\": \"root\", "
+    "\"query\": \"SELECT \\\"a\\\"\", \"time\": 1500000000000, "
+    "\"rows\": 0, \"query_id\": 7, \"database\": null, "
+    "\"thread_id\": 3, \"seq\": 12, \"weight\": 4}") == 0);
+  strbuf_free(&json);
+  event_clear(&record);
+
+  event_init(&record, EVENT_QUERY_ERROR);
+  event_set_text(&record, EVENT_ERROR_MESSAGE, "Oops", 4);
+  record.time = 1;
+  record.error_code = 1064;
+
+  strbuf_alloc_default(&json);
+  TEST(event_encode_json(&record, &json) == 0);
+  TEST(strcmp(json.str,
+    "{\"type\": \"query_error\", \"time\": 1, "
+    "\"error_code\": 1064, \"error_message\": \"Oops\", "
+    "\"thread_id\": 0, \"seq\": 0}") == 0);
+  strbuf_free(&json);
+  event_clear(&record);
+}
+
+void test_event_move(void)
+{
+  struct event_record src;
+  struct event_record dst;
+  char query[EVENT_INLINE_TEXT_SIZE * 2];
+
+  event_init(&src, EVENT_QUERY_START);
+  event_set_text(&src, EVENT_USER, "root", 4);
+  src.seq = 5;
+  event_move(&dst, &src);
+  TEST(dst.seq == 5);
+  TEST(strcmp(event_get_text(&dst, EVENT_USER, NULL), "root") == 0);
+  event_clear(&dst);
+
+  memset(query, 'x', sizeof(query) - 1);
+  query[sizeof(query) - 1] = '\0';
+  event_init(&src, EVENT_QUERY_START);
+  event_set_text(&src, EVENT_QUERY, query, strlen(query));
+  event_move(&dst, &src);
+  TEST(src.heap_text == NULL);
+  TEST(strcmp(event_get_text(&dst, EVENT_QUERY, NULL), query) == 0);
+  event_clear(&dst);
+}
+
+static void init_binary_test_record(struct event_record *record,
+                                    long long time,
+                                    long long query_id,
+                                    unsigned long long seq)
+{
+  event_init(record, EVENT_QUERY_START);
+  event_set_text(record, EVENT_USER, "root", 4);
+  event_set_text(record, EVENT_QUERY, "SELECT 1", 8);
+  event_set_text(record, EVENT_DATABASE, "db", 2);
+  record->flags = EVENT_HAS_QUERY_ID | EVENT_HAS_DATABASE;
+  record->time = time;
+  record->query_id = query_id;
+  record->thread_id = 3;
+  record->seq = seq;
+}
+
+void test_event_encode_binary(void)
+{
+  static struct event_encoder encoder;
+  static const char expected[] =
+    "\x01"
+    "\x0C\xD0\x0F\x03\x0C\x0E\x09root\x09SELECT 1\x00\x05" "db"
+    "\x0C\x06\x03\x0D\x02\x02\x09SELECT 1\x00\x02"
+    "\x16\x01\x03\x0E\x00\x0A\x02";
+  struct event_record record;
+  struct strbuf output;
+
+  event_encoder_init(&encoder);
+  strbuf_alloc_default(&output);
+  TEST(event_encoder_begin(&encoder, &output) == 0);
+
+  init_binary_test_record(&record, 1000, 7, 12);
+  TEST(event_encode_binary(&encoder, &record, &output) == 0);
+  event_clear(&record);
+
+  /* Names that were sent before are referred to by number */
+  init_binary_test_record(&record, 1003, 8, 13);
+  TEST(event_encode_binary(&encoder, &record, &output) == 0);
+  event_clear(&record);
+
+  event_init(&record, EVENT_QUERY_RESULT);
+  record.flags = EVENT_HAS_QUERY_ID;
+  record.time = 1002;
+  record.query_id = 8;
+  record.rows = 5;
+  record.thread_id = 3;
+  record.seq = 14;
+  record.weight = 2;
+  TEST(event_encode_binary(&encoder, &record, &output) == 0);
+  event_clear(&record);
+
+  TEST(output.length == sizeof(expected) - 1);
+  TEST(memcmp(output.str, expected, output.length) == 0);
+
+  output.length = 0;
+  TEST(event_encoder_begin(&encoder, &output) == 0);
+  TEST(output.length == 1 && output.str[0] == 0);
+
+  /* After a reset everything is sent in full again */
+  encoder.reset = true;
+  output.length = 0;
+  TEST(event_encoder_begin(&encoder, &output) == 0);
+  init_binary_test_record(&record, 1000, 7, 12);
+  TEST(event_encode_binary(&encoder, &record, &output) == 0);
+  event_clear(&record);
+  TEST(output.length == 25);
+  TEST(memcmp(output.str, expected, output.length) == 0);
+
+  event_encoder_reset(&encoder);
+  strbuf_free(&output);
+}
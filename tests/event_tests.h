@@ -0,0 +1,5 @@
+void test_event_text(void);
+void test_event_text_overflow(void);
+void test_event_encode_json(void);
+void test_event_move(void);
+void test_event_encode_binary(void);
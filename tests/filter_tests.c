@@ -0,0 +1,117 @@
+#include <string.h>
+#include "filter.h"
+#include "test.h"
+
+static void set_input(struct filter_input *input, int field, const char *value)
+{
+  input->values[field] = value;
+  input->lengths[field] = value != NULL ? strlen(value) : 0;
+}
+
+void test_filter_parse_rules(void)
+{
+  struct filter filter;
+
+  filter_init(&filter);
+  TEST(filter.empty);
+  TEST(filter_parse_rules(&filter, false, NULL) == 0);
+  TEST(filter_parse_rules(&filter, false, "  ") == 0);
+  TEST(filter.empty);
+
+  TEST(filter_parse_rules(&filter, true,
+    "user:repl, db : test,command:Binlog Dump,query:SELECT 1") == 0);
+  TEST(!filter.empty);
+  TEST(filter.exclude[FILTER_USER].count == 1);
+  TEST(filter.exclude[FILTER_DATABASE].count == 1);
+  TEST(filter.exclude[FILTER_COMMAND].count == 1);
+  TEST(filter.exclude_prefixes != NULL);
+
+  TEST(filter_parse_rules(&filter, false, "nonsense") != 0);
+  TEST(filter_parse_rules(&filter, false, "color:red") != 0);
+  TEST(filter_parse_rules(&filter, false, "user:") != 0);
+
+  filter_free(&filter);
+}
+
+void test_filter_match(void)
+{
+  struct filter filter;
+  struct filter_input input;
+  char name[16];
+  int i;
+
+  memset(&input, 0, sizeof(input));
+  filter_init(&filter);
+  TEST(filter_match(&filter, &input));
+
+  /* Enough entries to make the set grow a few times */
+  for (i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "user%d", i);
+    TEST(filter_add_rule(&filter, false, FILTER_USER, name, strlen(name)) == 0);
+  }
+  TEST(filter_parse_rules(&filter, true, "host:Monitor.local") == 0);
+
+  set_input(&input, FILTER_USER, "user7");
+  TEST(filter_match(&filter, &input));
+  set_input(&input, FILTER_USER, "user77");
+  TEST(!filter_match(&filter, &input));
+  set_input(&input, FILTER_USER, NULL);
+  TEST(!filter_match(&filter, &input));
+
+  set_input(&input, FILTER_USER, "user19");
+  set_input(&input, FILTER_HOST, "monitor.LOCAL");
+  TEST(!filter_match(&filter, &input));
+  set_input(&input, FILTER_HOST, "app.local");
+  TEST(filter_match(&filter, &input));
+
+  filter_free(&filter);
+}
+
+void test_filter_query_prefixes(void)
+{
+  struct filter filter;
+  struct filter_input input;
+
+  memset(&input, 0, sizeof(input));
+  filter_init(&filter);
+  TEST(filter_parse_rules(&filter, false, "query:select,query:update") == 0);
+  TEST(filter_parse_rules(&filter, true, "query:SELECT 1") == 0);
+
+  set_input(&input, FILTER_QUERY, "  SELECT * FROM t");
+  TEST(filter_match(&filter, &input));
+  set_input(&input, FILTER_QUERY, "Update t SET a = 1");
+  TEST(filter_match(&filter, &input));
+  set_input(&input, FILTER_QUERY, "select 1");
+  TEST(!filter_match(&filter, &input));
+  set_input(&input, FILTER_QUERY, "INSERT INTO t VALUES (1)");
+  TEST(!filter_match(&filter, &input));
+  set_input(&input, FILTER_QUERY, "sel");
+  TEST(!filter_match(&filter, &input));
+  set_input(&input, FILTER_QUERY, NULL);
+  TEST(!filter_match(&filter, &input));
+
+  filter_free(&filter);
+}
+
+void test_filter_split_user_host(void)
+{
+  struct filter_input input;
+
+  filter_split_user_host("root[root] @ localhost []", &input);
+  TEST(input.lengths[FILTER_USER] == 4);
+  TEST(strncmp(input.values[FILTER_USER], "root", 4) == 0);
+  TEST(input.lengths[FILTER_HOST] == 9);
+  TEST(strncmp(input.values[FILTER_HOST], "localhost", 9) == 0);
+
+  filter_split_user_host("app[app] @  [10.0.0.5]", &input);
+  TEST(input.lengths[FILTER_USER] == 3);
+  TEST(input.lengths[FILTER_HOST] == 8);
+  TEST(strncmp(input.values[FILTER_HOST], "10.0.0.5", 8) == 0);
+
+  filter_split_user_host("bob", &input);
+  TEST(input.lengths[FILTER_USER] == 3);
+  TEST(input.values[FILTER_HOST] == NULL);
+
+  filter_split_user_host(NULL, &input);
+  TEST(input.values[FILTER_USER] == NULL);
+}
@@ -0,0 +1,4 @@
+void test_filter_parse_rules(void);
+void test_filter_match(void);
+void test_filter_query_prefixes(void);
+void test_filter_split_user_host(void);
@@ -140,3 +140,161 @@ void test_http_header_parsing(void)
   TEST(result == headers3 + sizeof(headers3) - 1);
   TEST(d3.have_header1);
 }
+
+static bool accepts(const char *value, const char *coding)
+{
+  struct http_fragment fragment;
+
+  fragment.ptr = value;
+  fragment.length = strlen(value);
+  return http_accepts_encoding(&fragment, coding);
+}
+
+void test_http_accepts_encoding(void)
+{
+  TEST(accepts("gzip", "gzip"));
+  TEST(accepts("gzip, deflate, br", "gzip"));
+  TEST(accepts("deflate,GZIP", "gzip"));
+  TEST(accepts("gzip;q=0.5", "gzip"));
+  TEST(accepts("br;q=1.0, gzip; q=0.8", "gzip"));
+  TEST(accepts("*", "gzip"));
+  TEST(accepts("br, *;q=0.1", "gzip"));
+
+  TEST(!accepts("", "gzip"));
+  TEST(!accepts("identity", "gzip"));
+  TEST(!accepts("x-gzip2, gzipped", "gzip"));
+  TEST(!accepts("gzip;q=0", "gzip"));
+  TEST(!accepts("gzip;q=0.000, deflate", "gzip"));
+  TEST(!accepts("*, gzip;q=0", "gzip"));
+  TEST(!accepts("*;q=0", "gzip"));
+}
+
+static bool has_token(const char *value, const char *token)
+{
+  struct http_fragment fragment;
+
+  fragment.ptr = value;
+  fragment.length = strlen(value);
+  return http_has_token(&fragment, token);
+}
+
+void test_http_has_token(void)
+{
+  TEST(has_token("close", "close"));
+  TEST(has_token("Keep-Alive", "keep-alive"));
+  TEST(has_token("keep-alive, Upgrade", "upgrade"));
+  TEST(has_token(" TE ,close", "close"));
+  TEST(!has_token("", "close"));
+  TEST(!has_token("closed", "close"));
+  TEST(!has_token("keep-alive", "close"));
+}
+
+static bool etag_matches(const char *if_none_match, const char *etag)
+{
+  struct http_fragment fragment;
+
+  fragment.ptr = if_none_match;
+  fragment.length = strlen(if_none_match);
+  return http_etag_matches(&fragment, etag);
+}
+
+void test_http_etag_matches(void)
+{
+  TEST(etag_matches("\"abc\"", "\"abc\""));
+  TEST(etag_matches("W/\"abc\"", "\"abc\""));
+  TEST(etag_matches("\"abc\"", "W/\"abc\""));
+  TEST(etag_matches("\"x\", W/\"abc\"", "W/\"abc\""));
+  TEST(etag_matches("\"a,b\", \"abc\"", "\"abc\""));
+  TEST(etag_matches("*", "\"abc\""));
+  TEST(!etag_matches("\"abcd\"", "\"abc\""));
+  TEST(!etag_matches("\"ab\"", "\"abc\""));
+  TEST(!etag_matches("abc", "\"abc\""));
+  TEST(!etag_matches("", "\"abc\""));
+}
+
+void test_http_scan_headers(void)
+{
+  const char *request = "GET / HTTP/1.1\r\nHost: a\r\n\r\nGET";
+  struct http_header_scanner scanner;
+  size_t len;
+
+  http_header_scanner_init(&scanner);
+  TEST(http_scan_headers(&scanner, request, 24) == 0);
+  TEST(http_scan_headers(&scanner, request, 25) == 0);
+  TEST(http_scan_headers(&scanner, request, 26) == 0);
+  TEST(http_scan_headers(&scanner, request, 30) == 27);
+  TEST(scanner.offset == 27);
+
+  /* Byte by byte, with a stray CR */
+  request = "GET / HTTP/1.1\r\r\n\r\n";
+  http_header_scanner_init(&scanner);
+  for (len = 1; len < strlen(request); len++) {
+    TEST(http_scan_headers(&scanner, request, len) == 0);
+  }
+  TEST(http_scan_headers(&scanner, request, len) == len);
+
+  http_header_scanner_init(&scanner);
+  TEST(http_scan_headers(&scanner, "GET /\n\n\r\n", 9) == 0);
+}
+
+static bool get_query_param(const char *target,
+                            const char *name,
+                            const char *expected_value)
+{
+  struct http_fragment fragment;
+  struct http_fragment value;
+
+  fragment.ptr = target;
+  fragment.length = strlen(target);
+  if (!http_get_query_param(&fragment, name, &value)) {
+    return expected_value == NULL;
+  }
+  return expected_value != NULL
+    && value.length == strlen(expected_value)
+    && strncmp(value.ptr, expected_value, value.length) == 0;
+}
+
+void test_http_get_query_param(void)
+{
+  struct http_fragment target;
+
+  target.ptr = "/events?a=1";
+  target.length = strlen(target.ptr);
+  TEST(http_path_length(&target) == 7);
+  target.ptr = "/events";
+  target.length = strlen(target.ptr);
+  TEST(http_path_length(&target) == 7);
+
+  TEST(get_query_param("/events?include=user:root", "include", "user:root"));
+  TEST(get_query_param("/events?a=1&include=&b=2", "include", ""));
+  TEST(get_query_param("/events?a=1&b=2", "b", "2"));
+  TEST(get_query_param("/events?ab=1&a=2", "a", "2"));
+  TEST(get_query_param("/events?a", "a", NULL));
+  TEST(get_query_param("/events", "a", NULL));
+  TEST(get_query_param("/a=1", "a", NULL));
+}
+
+void test_http_url_decode(void)
+{
+  static const char *const inputs[] = {
+    "user%3Aroot",
+    "query:SELECT+1%2c",
+    "100%",
+    "%zz%4"
+  };
+  static const char *const outputs[] = {
+    "user:root",
+    "query:SELECT 1,",
+    "100%",
+    "%zz%4"
+  };
+  char buf[64];
+  size_t len;
+  size_t i;
+
+  for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    len = http_url_decode(inputs[i], strlen(inputs[i]), buf);
+    TEST(len == strlen(outputs[i]));
+    TEST(strcmp(buf, outputs[i]) == 0);
+  }
+}
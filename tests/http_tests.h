@@ -1,2 +1,8 @@
 void test_http_request_line_parsing(void);
 void test_http_header_parsing(void);
+void test_http_accepts_encoding(void);
+void test_http_has_token(void);
+void test_http_etag_matches(void);
+void test_http_scan_headers(void);
+void test_http_get_query_param(void);
+void test_http_url_decode(void);
@@ -0,0 +1,51 @@
+#include <errno.h>
+#include "poller.h"
+#include "test.h"
+
+void test_poller_wakeup(void)
+{
+  struct poller poller;
+  struct poller_event events[4];
+
+  TEST(poller_create(&poller, 4) == 0);
+  TEST(poller_wait(&poller, events, 4, 0) == 0);
+  TEST(poller_wakeup(&poller) == 0);
+  TEST(poller_wakeup(&poller) == 0);
+  /* Returns right away without reporting the wakeup itself */
+  TEST(poller_wait(&poller, events, 4, 10000) == 0);
+  TEST(poller_wait(&poller, events, 4, 0) == 0);
+  poller_destroy(&poller);
+}
+
+void test_poller_read(void)
+{
+#ifndef _WIN32
+  struct poller poller;
+  struct poller_event events[4];
+  socket_t socks[2];
+  char buf[8];
+
+  TEST(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+  TEST(poller_create(&poller, 1) == 0);
+  TEST(poller_add(&poller, socks[0], POLLER_READ) == 0);
+  TEST(poller_add(&poller, socks[1], POLLER_READ) == ENOSPC);
+
+  TEST(send(socks[1], "abc", 3, 0) == 3);
+  TEST(poller_wait(&poller, events, 4, 1000) == 1);
+  TEST(events[0].sock == socks[0]);
+  TEST(events[0].events == POLLER_READ);
+  TEST(socket_bytes_available(socks[0]) == 3);
+  TEST(recv(socks[0], buf, sizeof(buf), 0) == 3);
+  TEST(socket_bytes_available(socks[0]) == 0);
+
+  close_socket(socks[1]);
+  TEST(poller_wait(&poller, events, 4, 1000) == 1);
+  TEST((events[0].events & POLLER_READ) != 0);
+
+  TEST(poller_remove(&poller, socks[0]) == 0);
+  TEST(poller_wait(&poller, events, 4, 0) == 0);
+
+  poller_destroy(&poller);
+  close_socket(socks[0]);
+#endif
+}
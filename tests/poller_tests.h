@@ -0,0 +1,2 @@
+void test_poller_wakeup(void);
+void test_poller_read(void);
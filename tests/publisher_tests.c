@@ -0,0 +1,177 @@
+#include <string.h>
+#include "publisher.h"
+#include "test.h"
+
+static struct ring *wait_queue;
+static int wait_count;
+
+static void make_records(struct event_record *records, int count, int seq)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    event_init(&records[i], EVENT_QUERY_START);
+    records[i].seq = (unsigned long long)(seq + i);
+  }
+}
+
+static unsigned long long pop_seq(struct ring *queue)
+{
+  struct event_record *record;
+  unsigned long long seq;
+  long pos;
+
+  record = (struct event_record *)ring_acquire(queue, &pos);
+  if (record == NULL) {
+    return (unsigned long long)-1;
+  }
+  seq = record->seq;
+  event_clear(record);
+  ring_release(queue, pos);
+  return seq;
+}
+
+/* Makes room by consuming one event every other call, then gives up */
+static bool wait_and_pop(long long *deadline)
+{
+  wait_count++;
+  if (*deadline == 0) {
+    *deadline = 3;
+  }
+  if (--*deadline == 0) {
+    return false;
+  }
+  if (wait_count % 2 == 0) {
+    pop_seq(wait_queue);
+  }
+  return true;
+}
+
+void test_publisher_drop_newest(void)
+{
+  struct ring queue;
+  struct publisher publisher;
+  struct event_record records[6];
+  uint32_t state = 1;
+
+  TEST(ring_alloc(&queue, 4, sizeof(struct event_record)) == 0);
+  publisher_init(&publisher, &queue, OVERFLOW_DROP_NEWEST, NULL);
+
+  make_records(records, 6, 0);
+  TEST(publisher_publish(&publisher, records, 6, &state) == 4);
+  TEST(publisher.events_queued == 4);
+  TEST(publisher.events_dropped == 2);
+  TEST(publisher.bytes_dropped == 2 * (long long)event_size(&records[0]));
+  TEST(publisher.queue_high_water == 4);
+
+  TEST(pop_seq(&queue) == 0);
+  TEST(pop_seq(&queue) == 1);
+  TEST(pop_seq(&queue) == 2);
+  TEST(pop_seq(&queue) == 3);
+  TEST(ring_count(&queue) == 0);
+
+  ring_free(&queue);
+}
+
+void test_publisher_drop_oldest(void)
+{
+  struct ring queue;
+  struct publisher publisher;
+  struct event_record records[6];
+  uint32_t state = 1;
+
+  TEST(ring_alloc(&queue, 4, sizeof(struct event_record)) == 0);
+  publisher_init(&publisher, &queue, OVERFLOW_DROP_OLDEST, NULL);
+
+  make_records(records, 3, 0);
+  TEST(publisher_publish(&publisher, records, 3, &state) == 3);
+  make_records(records, 3, 3);
+  TEST(publisher_publish(&publisher, records, 3, &state) == 3);
+  TEST(publisher.events_queued == 6);
+  TEST(publisher.events_dropped == 2);
+
+  TEST(pop_seq(&queue) == 2);
+  TEST(pop_seq(&queue) == 3);
+  TEST(pop_seq(&queue) == 4);
+  TEST(pop_seq(&queue) == 5);
+
+  ring_free(&queue);
+}
+
+void test_publisher_block(void)
+{
+  struct ring queue;
+  struct publisher publisher;
+  struct event_record records[6];
+  uint32_t state = 1;
+
+  TEST(ring_alloc(&queue, 4, sizeof(struct event_record)) == 0);
+  publisher_init(&publisher, &queue, OVERFLOW_BLOCK, wait_and_pop);
+  wait_queue = &queue;
+
+  /* Waits until the consumer makes room */
+  wait_count = 0;
+  make_records(records, 5, 0);
+  TEST(publisher_publish(&publisher, records, 5, &state) == 5);
+  TEST(wait_count == 2);
+  TEST(publisher.events_dropped == 0);
+  TEST(pop_seq(&queue) == 1);
+
+  /* Drops what is left once the wait times out */
+  wait_count = 1;
+  make_records(records, 6, 5);
+  TEST(publisher_publish(&publisher, records, 6, &state) == 2);
+  TEST(wait_count == 4);
+  TEST(publisher.events_queued == 7);
+  TEST(publisher.events_dropped == 4);
+
+  ring_free(&queue);
+}
+
+void test_publisher_sample(void)
+{
+  struct ring queue;
+  struct publisher publisher;
+  struct event_record records[16];
+  uint32_t state = 1;
+  unsigned long long seq;
+  unsigned long long last_seq;
+  int published;
+  int i;
+
+  TEST(ring_alloc(&queue, 16, sizeof(struct event_record)) == 0);
+  publisher_init(&publisher, &queue, OVERFLOW_SAMPLE, NULL);
+
+  /* Nothing is sampled out below half of the queue */
+  make_records(records, 8, 0);
+  TEST(publisher_publish(&publisher, records, 8, &state) == 8);
+  TEST(publisher.events_dropped == 0);
+
+  /* Above it fewer and fewer events get through, in order */
+  make_records(records, 16, 8);
+  published = publisher_publish(&publisher, records, 16, &state);
+  TEST(published > 0 && published < 8);
+  TEST(publisher.events_queued == 8 + published);
+  TEST(publisher.events_dropped == 16 - published);
+  TEST(publisher.queue_high_water == 8 + published);
+  TEST(ring_count(&queue) == (size_t)(8 + published));
+  for (i = 0, last_seq = 0; i < 8 + published; i++) {
+    seq = pop_seq(&queue);
+    TEST(i == 0 || seq > last_seq);
+    last_seq = seq;
+  }
+
+  /* A full queue takes nothing */
+  make_records(records, 8, 100);
+  TEST(publisher_publish(&publisher, records, 8, &state) == 8);
+  while (ring_count(&queue) < 16) {
+    make_records(records, 1, 100);
+    publisher.policy = OVERFLOW_DROP_NEWEST;
+    publisher_publish(&publisher, records, 1, &state);
+  }
+  publisher.policy = OVERFLOW_SAMPLE;
+  make_records(records, 4, 200);
+  TEST(publisher_publish(&publisher, records, 4, &state) == 0);
+
+  ring_free(&queue);
+}
@@ -0,0 +1,4 @@
+void test_publisher_drop_newest(void);
+void test_publisher_drop_oldest(void);
+void test_publisher_block(void);
+void test_publisher_sample(void);
@@ -0,0 +1,119 @@
+#include "ring.h"
+#include "test.h"
+
+void test_ring_push_pop(void)
+{
+  struct ring ring;
+  int value;
+
+  TEST(ring_alloc(&ring, 4, sizeof(int)) == 0);
+  TEST(ring_capacity(&ring) == 4);
+  TEST(ring_count(&ring) == 0);
+  TEST(ring_pop(&ring, &value) != 0);
+
+  value = 1;
+  TEST(ring_push(&ring, &value) == 0);
+  value = 2;
+  TEST(ring_push(&ring, &value) == 0);
+  TEST(ring_count(&ring) == 2);
+
+  TEST(ring_pop(&ring, &value) == 0);
+  TEST(value == 1);
+  TEST(ring_pop(&ring, &value) == 0);
+  TEST(value == 2);
+  TEST(ring_pop(&ring, &value) != 0);
+  TEST(ring_count(&ring) == 0);
+
+  ring_free(&ring);
+}
+
+void test_ring_overflow(void)
+{
+  struct ring ring;
+  int value;
+  int i;
+
+  TEST(ring_alloc(&ring, 3, sizeof(int)) == 0);
+  TEST(ring_capacity(&ring) == 4); /* rounded up to a power of two */
+
+  for (i = 0; i < 4; i++) {
+    TEST(ring_push(&ring, &i) == 0);
+  }
+  TEST(ring_push(&ring, &i) != 0);
+  TEST(ring_count(&ring) == 4);
+
+  TEST(ring_pop(&ring, &value) == 0);
+  TEST(value == 0);
+  TEST(ring_push(&ring, &i) == 0);
+
+  ring_free(&ring);
+}
+
+void test_ring_wrap_around(void)
+{
+  struct ring ring;
+  long pos;
+  long pos2;
+  int *slot;
+  int value;
+  int i;
+
+  TEST(ring_alloc(&ring, 2, sizeof(int)) == 0);
+
+  for (i = 0; i < 100; i++) {
+    TEST(ring_push(&ring, &i) == 0);
+    TEST(ring_pop(&ring, &value) == 0);
+    TEST(value == i);
+  }
+
+  /* Reserved but not yet committed slots are invisible to readers */
+  slot = (int *)ring_reserve(&ring, &pos);
+  TEST(slot != NULL);
+  *slot = 42;
+  TEST(ring_acquire(&ring, &pos2) == NULL);
+  ring_commit(&ring, pos);
+  slot = (int *)ring_acquire(&ring, &pos2);
+  TEST(slot != NULL);
+  TEST(pos2 == pos);
+  TEST(*slot == 42);
+  ring_release(&ring, pos2);
+
+  ring_free(&ring);
+}
+
+void test_ring_reserve_n(void)
+{
+  struct ring ring;
+  long pos;
+  int value;
+  size_t i;
+  size_t n;
+
+  TEST(ring_alloc(&ring, 8, sizeof(int)) == 0);
+
+  value = 0;
+  TEST(ring_push(&ring, &value) == 0);
+
+  n = ring_reserve_n(&ring, 4, &pos);
+  TEST(n == 4);
+  for (i = 0; i < n; i++) {
+    *(int *)ring_at(&ring, pos + (long)i) = (int)i + 1;
+    ring_commit(&ring, pos + (long)i);
+  }
+
+  /* Only 3 free slots are left */
+  n = ring_reserve_n(&ring, 5, &pos);
+  TEST(n == 3);
+  for (i = 0; i < n; i++) {
+    *(int *)ring_at(&ring, pos + (long)i) = (int)i + 5;
+    ring_commit(&ring, pos + (long)i);
+  }
+  TEST(ring_reserve_n(&ring, 1, &pos) == 0);
+
+  for (i = 0; i < 8; i++) {
+    TEST(ring_pop(&ring, &value) == 0);
+    TEST(value == (int)i);
+  }
+
+  ring_free(&ring);
+}
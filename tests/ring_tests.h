@@ -0,0 +1,4 @@
+void test_ring_push_pop(void);
+void test_ring_overflow(void);
+void test_ring_wrap_around(void);
+void test_ring_reserve_n(void);
@@ -0,0 +1,80 @@
+#include <string.h>
+#include "sampler.h"
+#include "test.h"
+
+void test_sampler_rate(void)
+{
+  TEST(sampler_rate(0, false, 0, 100) == 1);
+  TEST(sampler_rate(10, false, 100, 100) == 10);
+
+  TEST(sampler_rate(1, true, 0, 800) == 1);
+  TEST(sampler_rate(1, true, 299, 800) == 1);
+  TEST(sampler_rate(1, true, 300, 800) == 2);
+  TEST(sampler_rate(3, true, 400, 800) == 12);
+  TEST(sampler_rate(1, true, 800, 800) == 64);
+}
+
+void test_sampler_limit(void)
+{
+  static struct sampler sampler;
+  long long now = 1000000;
+  int i;
+
+  sampler_init(&sampler);
+
+  /* No limits */
+  TEST(sampler_limit(&sampler, "root", 4, 0, "db", 2, 0, 1, now) == 1);
+
+  /* The bucket starts full */
+  for (i = 0; i < 5; i++) {
+    TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now) == 2);
+  }
+  TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now) == 0);
+  TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now) == 0);
+
+  /* Other users have their own buckets */
+  TEST(sampler_limit(&sampler, "app", 3, 5, NULL, 0, 0, 1, now) == 1);
+
+  /* 5 events per second = 1 token per 200 ms */
+  TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now + 100) == 0);
+  TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now + 200) == 8);
+  TEST(sampler_limit(&sampler, "root", 4, 5, NULL, 0, 0, 2, now + 250) == 0);
+
+  /* Database limits */
+  TEST(sampler_limit(&sampler, NULL, 0, 0, "shop", 4, 1, 1, now) == 1);
+  TEST(sampler_limit(&sampler, NULL, 0, 0, "shop", 4, 1, 1, now) == 0);
+  TEST(sampler_limit(&sampler, NULL, 0, 0, "shop", 4, 1, 1, now + 1000) == 2);
+}
+
+void test_sampler_keep_event(void)
+{
+  uint32_t state = 0;
+  uint32_t random;
+  int kept;
+
+  /* Everything is kept until the queue is half full */
+  TEST(sampler_keep_event(0, 8, 0));
+  TEST(sampler_keep_event(4, 8, 3));
+
+  /* The chance of keeping an event falls linearly as the queue fills up */
+  for (random = 0, kept = 0; random < 4; random++) {
+    kept += sampler_keep_event(5, 8, random);
+  }
+  TEST(kept == 3);
+  for (random = 0, kept = 0; random < 4; random++) {
+    kept += sampler_keep_event(6, 8, random);
+  }
+  TEST(kept == 2);
+  for (random = 0, kept = 0; random < 4; random++) {
+    kept += sampler_keep_event(7, 8, random);
+  }
+  TEST(kept == 1);
+  TEST(!sampler_keep_event(8, 8, 0));
+
+  /* With a real random source, about half of them at 3/4 full */
+  for (random = 0, kept = 0; random < 10000; random++) {
+    kept += sampler_keep_event(750, 1000, sampler_random(&state));
+  }
+  TEST(kept > 4500 && kept < 5500);
+  TEST(state != 0);
+}
@@ -0,0 +1,3 @@
+void test_sampler_rate(void);
+void test_sampler_limit(void);
+void test_sampler_keep_event(void);
@@ -0,0 +1,62 @@
+#include "socket_map.h"
+#include "test.h"
+
+void test_socket_map_put_get(void)
+{
+  struct socket_map map;
+  int values[100];
+  int i;
+
+  socket_map_init(&map);
+  TEST(socket_map_get(&map, 5) == NULL);
+
+  /* Enough to make it grow a few times */
+  for (i = 0; i < 100; i++) {
+    TEST(socket_map_put(&map, (socket_t)(i * 4), &values[i]) == 0);
+  }
+  TEST(map.count == 100);
+  TEST(map.capacity * 3 >= map.count * 4);
+  for (i = 0; i < 100; i++) {
+    TEST(socket_map_get(&map, (socket_t)(i * 4)) == &values[i]);
+  }
+  TEST(socket_map_get(&map, 1) == NULL);
+
+  /* Replacing a value doesn't add an entry */
+  TEST(socket_map_put(&map, 8, &values[0]) == 0);
+  TEST(map.count == 100);
+  TEST(socket_map_get(&map, 8) == &values[0]);
+
+  socket_map_free(&map);
+}
+
+void test_socket_map_remove(void)
+{
+  struct socket_map map;
+  int values[200];
+  int i;
+
+  socket_map_init(&map);
+  TEST(socket_map_remove(&map, 3) == NULL);
+
+  for (i = 0; i < 200; i++) {
+    TEST(socket_map_put(&map, (socket_t)i, &values[i]) == 0);
+  }
+
+  /* Every other entry, so that the remaining ones have to be moved back */
+  for (i = 0; i < 200; i += 2) {
+    TEST(socket_map_remove(&map, (socket_t)i) == &values[i]);
+  }
+  TEST(map.count == 100);
+  TEST(socket_map_remove(&map, 0) == NULL);
+  for (i = 0; i < 200; i += 2) {
+    TEST(socket_map_get(&map, (socket_t)i) == NULL);
+    TEST(socket_map_get(&map, (socket_t)(i + 1)) == &values[i + 1]);
+  }
+
+  for (i = 1; i < 200; i += 2) {
+    TEST(socket_map_remove(&map, (socket_t)i) == &values[i]);
+  }
+  TEST(map.count == 0);
+
+  socket_map_free(&map);
+}
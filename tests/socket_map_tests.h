@@ -0,0 +1,2 @@
+void test_socket_map_put_get(void);
+void test_socket_map_remove(void);
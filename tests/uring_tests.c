@@ -0,0 +1,67 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+#include "test.h"
+
+void test_uring_send_all(void)
+{
+#ifdef URING_SUPPORTED
+  struct uring ring;
+  struct uring_send sends[3];
+  socket_t socks[2][2];
+  char buf[16];
+  int i;
+
+  if (uring_init(&ring, 2) != 0) {
+    return; /* not available on this kernel */
+  }
+
+  for (i = 0; i < 2; i++) {
+    TEST(socketpair(AF_UNIX, SOCK_STREAM, 0, socks[i]) == 0);
+  }
+  sends[0].sock = socks[0][0];
+  sends[0].data = "hello";
+  sends[0].len = 5;
+  sends[1].sock = socks[1][0];
+  sends[1].data = "world";
+  sends[1].len = 5;
+  sends[2].sock = socks[0][0];
+  sends[2].data = "!";
+  sends[2].len = 1;
+
+  /* More sends than ring entries */
+  TEST(uring_send_all(&ring, sends, 3) == 0);
+  TEST(sends[0].result == 5);
+  TEST(sends[1].result == 5);
+  TEST(sends[2].result == 1);
+
+  TEST(recv(socks[0][1], buf, sizeof(buf), 0) == 6);
+  TEST(memcmp(buf, "hello!", 6) == 0);
+  TEST(recv(socks[1][1], buf, sizeof(buf), 0) == 5);
+  TEST(memcmp(buf, "world", 5) == 0);
+
+  close_socket(socks[1][1]);
+  sends[0].sock = socks[1][0];
+  TEST(uring_send_all(&ring, sends, 1) == 0);
+  TEST(sends[0].result < 0);
+
+  /* None of the results are left over from a previous call on failure */
+  for (i = 0; i < 3; i++) {
+    sends[i].sock = socks[0][0];
+    sends[i].result = 5;
+  }
+  close(ring.fd);
+  TEST(uring_send_all(&ring, sends, 3) != 0);
+  for (i = 0; i < 3; i++) {
+    TEST(sends[i].result == -EINPROGRESS);
+  }
+  ring.fd = -1;
+
+  for (i = 0; i < 2; i++) {
+    close_socket(socks[i][0]);
+  }
+  close_socket(socks[0][1]);
+  uring_free(&ring);
+#endif
+}
@@ -0,0 +1 @@
+void test_uring_send_all(void);
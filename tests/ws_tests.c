@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws.h"
+#include "test.h"
+
+void test_ws_frame_create(void)
+{
+  struct ws_frame *frame;
+  char *payload;
+
+  frame = ws_frame_create(WS_OP_TEXT, "hello", 5, WS_FLAG_FINAL);
+  TEST(frame != NULL);
+  TEST(frame->refs == 1);
+  TEST(frame->size == 7);
+  TEST(frame->data[0] == 0x81);
+  TEST(frame->data[1] == 5);
+  TEST(memcmp(frame->data + 2, "hello", 5) == 0);
+  TEST(ws_frame_ref(frame) == frame);
+  TEST(frame->refs == 2);
+  ws_frame_unref(frame);
+  ws_frame_unref(frame);
+
+  payload = (char *)malloc(70000);
+  memset(payload, 'x', 70000);
+
+  frame = ws_frame_create(WS_OP_TEXT, payload, 200, WS_FLAG_FINAL);
+  TEST(frame->size == 4 + 200);
+  TEST(frame->data[1] == 126);
+  TEST(frame->data[2] == 0 && frame->data[3] == 200);
+  ws_frame_unref(frame);
+
+  frame = ws_frame_create(WS_OP_BINARY, payload, 70000, WS_FLAG_FINAL);
+  TEST(frame->size == 10 + 70000);
+  TEST(frame->data[0] == 0x82);
+  TEST(frame->data[1] == 127);
+  TEST(frame->data[7] == 0x01
+       && frame->data[8] == 0x11
+       && frame->data[9] == 0x70);
+  TEST(frame->data[10] == 'x' && frame->data[10 + 69999] == 'x');
+  ws_frame_unref(frame);
+
+  free(payload);
+
+  frame = ws_frame_create_close(WS_CLOSE_POLICY_VIOLATION, "slow");
+  TEST(frame->size == 2 + 2 + 4);
+  TEST(frame->data[0] == 0x88);
+  TEST(frame->data[1] == 6);
+  TEST(frame->data[2] == 0x03 && frame->data[3] == 0xF0);
+  TEST(memcmp(frame->data + 4, "slow", 4) == 0);
+  ws_frame_unref(frame);
+}
+
+void test_ws_sendv(void)
+{
+#ifndef _WIN32
+  socket_t socks[2];
+  struct socket_buf segments[20];
+  char buf[64];
+  int len = 0;
+  int result;
+  int i;
+
+  TEST(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+
+  /* More segments than fit into one call */
+  for (i = 0; i < 20; i++) {
+    segments[i].data = i % 2 == 0 ? "ab" : "c";
+    segments[i].len = i % 2 == 0 ? 2 : 1;
+  }
+  TEST(ws_sendv(socks[0], WS_OP_TEXT, segments, 20, WS_FLAG_FINAL, 0) == 32);
+
+  while (len < 32
+         && (result = recv(socks[1], buf + len, sizeof(buf) - len, 0)) > 0) {
+    len += result;
+  }
+  TEST(len == 32);
+  TEST((uint8_t)buf[0] == 0x81);
+  TEST(buf[1] == 30);
+  TEST(memcmp(buf + 2, "abcabc", 6) == 0);
+  TEST(memcmp(buf + 26, "abcabc", 6) == 0);
+
+  TEST(ws_send(socks[0], WS_OP_BINARY, NULL, 0, WS_FLAG_FINAL, 0) == 2);
+  TEST(recv(socks[1], buf, sizeof(buf), 0) == 2);
+  TEST((uint8_t)buf[0] == 0x82 && buf[1] == 0);
+
+  close_socket(socks[0]);
+  close_socket(socks[1]);
+#endif
+}
+
+static bool accept_options(const char *offer,
+                           struct ws_options *options,
+                           char *response,
+                           size_t size)
+{
+  struct http_response accept_response;
+  char request[512];
+
+  snprintf(request, sizeof(request),
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "%s\r\n",
+    offer);
+  if (ws_accept_request(request,
+                        strlen(request),
+                        options,
+                        &accept_response) != 0) {
+    return false;
+  }
+  snprintf(response, size, "%s", accept_response.headers);
+  return true;
+}
+
+void test_ws_accept_deflate(void)
+{
+  struct ws_options options = {0};
+  char response[512];
+
+  options.deflate = true;
+  options.deflate_window_bits = 15;
+  TEST(accept_options(
+    "Sec-WebSocket-Extensions: permessage-deflate; "
+    "client_max_window_bits\r\n",
+    &options, response, sizeof(response)));
+  TEST(options.deflate);
+  TEST(strstr(response,
+               "Sec-WebSocket-Extensions: permessage-deflate\r\n") != NULL);
+
+  /* The compression context is shared, so it can't be reset per client */
+  options.deflate = true;
+  TEST(accept_options(
+    "Sec-WebSocket-Extensions: "
+    "permessage-deflate; server_no_context_takeover, "
+    "permessage-deflate; server_max_window_bits=\"15\"\r\n",
+    &options, response, sizeof(response)));
+  TEST(options.deflate);
+
+  options.deflate = true;
+  options.deflate_window_bits = 12;
+  TEST(accept_options(
+    "Sec-WebSocket-Extensions: permessage-deflate\r\n",
+    &options, response, sizeof(response)));
+  TEST(options.deflate);
+  TEST(strstr(response, "server_max_window_bits=12\r\n") != NULL);
+
+  options.deflate = true;
+  TEST(accept_options(
+    "Sec-WebSocket-Extensions: permessage-deflate; "
+    "server_max_window_bits=10\r\n",
+    &options, response, sizeof(response)));
+  TEST(!options.deflate);
+  TEST(strstr(response, "Sec-WebSocket-Extensions") == NULL);
+
+  options.deflate = true;
+  TEST(accept_options("", &options, response, sizeof(response)));
+  TEST(!options.deflate);
+}
+
+void test_ws_accept_protocol(void)
+{
+  static const char *const protocols[] = {"b", "a", NULL};
+  struct ws_options options = {0};
+  char response[512];
+
+  options.protocols = protocols;
+  TEST(accept_options("Sec-WebSocket-Protocol: x, a, b\r\n",
+                      &options, response, sizeof(response)));
+  TEST(options.protocol == 0);
+  TEST(strstr(response, "Sec-WebSocket-Protocol: b\r\n") != NULL);
+
+  TEST(accept_options("Sec-WebSocket-Protocol: x,a\r\n",
+                      &options, response, sizeof(response)));
+  TEST(options.protocol == 1);
+
+  TEST(accept_options("Sec-WebSocket-Protocol: ab\r\n",
+                      &options, response, sizeof(response)));
+  TEST(options.protocol == -1);
+  TEST(strstr(response, "Sec-WebSocket-Protocol") == NULL);
+}
+
+void test_ws_mask(void)
+{
+  static const uint8_t key[4] = {0x12, 0x34, 0x56, 0x78};
+  uint8_t data[37];
+  uint8_t expected[37];
+  size_t offset;
+  size_t i;
+
+  for (offset = 0; offset < 4; offset++) {
+    for (i = 0; i < sizeof(data); i++) {
+      data[i] = (uint8_t)(i * 7);
+      expected[i] = data[i] ^ key[(offset + i) % 4];
+    }
+    ws_mask(data, sizeof(data), key, offset);
+    TEST(memcmp(data, expected, sizeof(data)) == 0);
+  }
+
+  /* Unmasking in pieces gives the same result */
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)(i * 7);
+  }
+  ws_mask(data, 5, key, 0);
+  ws_mask(data + 5, sizeof(data) - 5, key, 5);
+  ws_mask(data, sizeof(data), key, 0);
+  for (i = 0; i < sizeof(data); i++) {
+    TEST(data[i] == (uint8_t)(i * 7));
+  }
+}
+
+struct parsed_frames {
+  int count;
+  int opcodes[4];
+  int flags[4];
+  size_t lengths[4];
+  char payload[16];
+};
+
+static int on_frame(int opcode,
+                    int flags,
+                    const char *payload,
+                    size_t len,
+                    void *data)
+{
+  struct parsed_frames *frames = (struct parsed_frames *)data;
+
+  frames->opcodes[frames->count] = opcode;
+  frames->flags[frames->count] = flags;
+  frames->lengths[frames->count] = len;
+  if (payload != NULL) {
+    memcpy(frames->payload, payload, len);
+  }
+  frames->count++;
+  return opcode == WS_OP_CLOSE ? -1 : 0;
+}
+
+void test_ws_parser(void)
+{
+  /* Ping "hi", 300 byte text message, empty pong, close */
+  uint8_t input[2 + 4 + 2 + 2 + 2 + 4 + 300 + 2 + 4 + 2 + 4];
+  uint8_t *p = input;
+  struct parsed_frames frames;
+  struct ws_parser parser;
+  size_t i;
+
+  *p++ = 0x89;
+  *p++ = 0x80 | 2;
+  memcpy(p, "\x01\x02\x03\x04", 4);
+  p += 4;
+  *p++ = 'h' ^ 0x01;
+  *p++ = 'i' ^ 0x02;
+  *p++ = 0x81;
+  *p++ = 0x80 | 126;
+  *p++ = 0x01;
+  *p++ = 0x2C;
+  memcpy(p, "\x00\x00\x00\x00", 4);
+  p += 4;
+  memset(p, 'x', 300);
+  p += 300;
+  *p++ = 0x8A;
+  *p++ = 0x80;
+  memcpy(p, "\x05\x06\x07\x08", 4);
+  p += 4;
+  *p++ = 0x88;
+  *p++ = 0x80;
+  memcpy(p, "\x05\x06\x07\x08", 4);
+  p += 4;
+
+  memset(&frames, 0, sizeof(frames));
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      (const char *)input,
+                      sizeof(input),
+                      on_frame,
+                      &frames) == -1);
+  TEST(frames.count == 4);
+  TEST(frames.opcodes[0] == WS_OP_PING && frames.lengths[0] == 2);
+  TEST(memcmp(frames.payload, "hi", 2) == 0);
+  TEST(frames.opcodes[1] == WS_OP_TEXT && frames.lengths[1] == 300);
+  TEST(frames.opcodes[2] == WS_OP_PONG && frames.lengths[2] == 0);
+  TEST(frames.opcodes[3] == WS_OP_CLOSE);
+
+  /* One byte at a time */
+  memset(&frames, 0, sizeof(frames));
+  ws_parser_init(&parser);
+  for (i = 0; i < sizeof(input) - 1; i++) {
+    TEST(ws_parser_feed(&parser,
+                        (const char *)input + i,
+                        1,
+                        on_frame,
+                        &frames) == 0);
+  }
+  TEST(frames.count == 3);
+  TEST(memcmp(frames.payload, "hi", 2) == 0);
+  TEST(frames.lengths[1] == 300);
+
+  /* Control frames can't be longer than 125 bytes */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x89\xFE\x00\x80\x00\x00\x00\x00",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+
+  /* Client frames must be masked */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x8A\x00",
+                      2,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+
+  /* Reserved opcodes */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x83\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x8B\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+
+  /* RSV1 only with an extension that uses it, and not on control frames */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\xC1\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  parser.extension_flags = WS_FLAG_RSV1;
+  frames.count = 0;
+  TEST(ws_parser_feed(&parser,
+                      "\xC1\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == 0);
+  TEST(frames.count == 1 && (frames.flags[0] & WS_FLAG_RSV1) != 0);
+  TEST(ws_parser_feed(&parser,
+                      "\xC9\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\xA1\x80\x00\x00\x00\x00",
+                      6,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+}
+
+void test_ws_parser_close(void)
+{
+  struct parsed_frames frames;
+  struct ws_parser parser;
+
+  /* Close frames are unmasked with a zero key here */
+  memset(&frames, 0, sizeof(frames));
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xE8",
+                      8,
+                      on_frame,
+                      &frames) == -1);
+  TEST(frames.count == 1 && frames.lengths[0] == 2);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x0F\xA0",
+                      8,
+                      on_frame,
+                      &frames) == -1);
+
+  /* A status code can't be cut short */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x81\x00\x00\x00\x00\x03",
+                      7,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+
+  /* Codes that are reserved or never sent: 999, 1005, 1006, 1015, 1016 */
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xE7",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xED",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xEE",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xF7",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  ws_parser_init(&parser);
+  TEST(ws_parser_feed(&parser,
+                      "\x88\x82\x00\x00\x00\x00\x03\xF8",
+                      8,
+                      on_frame,
+                      &frames) == WS_ERROR_PROTOCOL);
+  TEST(frames.count == 2);
+}
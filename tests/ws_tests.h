@@ -0,0 +1,7 @@
+void test_ws_frame_create(void);
+void test_ws_sendv(void);
+void test_ws_accept_deflate(void);
+void test_ws_accept_protocol(void);
+void test_ws_mask(void);
+void test_ws_parser(void);
+void test_ws_parser_close(void);